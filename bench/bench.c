@@ -0,0 +1,313 @@
+/*
+ * bench	Benchmark dump2png across palettes, zooms, skips and threads.
+ *
+ * Runs the dump2png binary once per combination of input file, palette,
+ * zoom, skip and mode (best of -r repeats), and prints a JSON array with
+ * the throughput (input MB/s), peak RSS and png size of each run.  The
+ * modes are a single file render, which is one thread, and then batch mode
+ * (-b) at each thread count, which splits the file into bands encoded in
+ * parallel.  Inputs usually come from gendump; see "make bench".
+ *
+ * With -c, each combination is also run on a baseline binary, with the
+ * repeats of the two interleaved so drift affects both alike, and the
+ * speedup is reported for each and overall (geometric mean); see "make
+ * pgo".
+ *
+ * USAGE: bench [-b dump2png] [-c baseline] [-p palettes] [-z zooms]
+ *              [-k skips] [-t threads] [-r repeats] file ...
+ *
+ * Lists are comma separated.  The default is every palette, zooms 1,16,
+ * skips 1,8, and batch threads 1 and the online CPU count.
+ *
+ * Copyright 2012 Joyent, Inc.  All rights reserved.
+ * Copyright 2012 Brendan Gregg.  All rights reserved.
+ *
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "../libdump2png.h"
+
+#define	MAXLIST		64		/* max entries per list option */
+
+typedef struct result {
+	double		secs;		/* wall time */
+	long		maxrss;		/* Kbytes */
+	off_t		outsize;	/* png bytes */
+} result_t;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "USAGE: bench [-b dump2png] [-c baseline] "
+	    "[-p palettes] [-z zooms]\n"
+	    "             [-k skips] [-t threads] [-r repeats] file ...\n");
+	exit(1);
+}
+
+/*
+ * Split a comma separated list in place.  Returns the count.
+ */
+static int
+split(char *str, char **items)
+{
+	int n = 0;
+	char *p;
+
+	for (p = strtok(str, ","); p != NULL && n < MAXLIST;
+	    p = strtok(NULL, ","))
+		items[n++] = p;
+	return (n);
+}
+
+static int
+splitint(char *str, int *items)
+{
+	char *s[MAXLIST];
+	int i, n;
+
+	n = split(str, s);
+	for (i = 0; i < n; i++) {
+		if ((items[i] = atoi(s[i])) <= 0)
+			usage();
+	}
+	return (n);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/*
+ * Run dump2png once, with output discarded: a single file render, or with
+ * threads non-zero, batch mode on that many threads.
+ */
+static int
+run(const char *bin, const char *file, const char *outfile,
+    const char *palette, int zoom, int skip, int threads, result_t *r)
+{
+	char zs[16], ks[16], ts[16];
+	const char *argv[16];
+	struct rusage ru;
+	struct stat st;
+	double start;
+	pid_t pid;
+	int status, fd, n = 0;
+
+	snprintf(zs, sizeof (zs), "%d", zoom);
+	snprintf(ks, sizeof (ks), "%d", skip);
+	snprintf(ts, sizeof (ts), "%d", threads);
+	argv[n++] = bin;
+	if (threads > 0) {
+		argv[n++] = "-b";
+		argv[n++] = "-t";
+		argv[n++] = ts;
+	}
+	argv[n++] = "-p";
+	argv[n++] = palette;
+	argv[n++] = "-z";
+	argv[n++] = zs;
+	argv[n++] = "-k";
+	argv[n++] = ks;
+	argv[n++] = "-h";
+	argv[n++] = "2000000000";
+	argv[n++] = "-o";
+	argv[n++] = outfile;
+	argv[n++] = file;
+	argv[n] = NULL;
+
+	start = now();
+	if ((pid = fork()) < 0) {
+		perror("fork");
+		return (-1);
+	}
+	if (pid == 0) {
+		if ((fd = open("/dev/null", O_WRONLY)) >= 0) {
+			dup2(fd, 1);
+			dup2(fd, 2);
+		}
+		execv(bin, (char *const *)argv);
+		_exit(127);
+	}
+	if (wait4(pid, &status, 0, &ru) < 0) {
+		perror("wait4");
+		return (-1);
+	}
+	r->secs = now() - start;
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		return (-1);
+	r->maxrss = ru.ru_maxrss;
+	r->outsize = stat(outfile, &st) == 0 ? st.st_size : 0;
+	return (0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *bin = "./dump2png", *base = NULL, *name, *mode;
+	char *pals[MAXLIST], outfile[PATH_MAX], dir[] = "/tmp/d2pbench.XXXXXX";
+	const char *const *all;
+	int zooms[MAXLIST] = { 1, 16 }, skips[MAXLIST] = { 1, 8 };
+	int threads[MAXLIST] = { 1 };
+	int npals = 0, nzooms = 2, nskips = 2, nthreads = 1, repeats = 1;
+	int opt, f, p, z, k, t, nt, i, first = 1, failures = 0, ncompared = 0;
+	result_t best = { 0 }, bbest = { 0 }, r;
+	double mbs, bmbs, logsum = 0;
+	struct stat st;
+	long ncpu;
+
+	if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) > 1)
+		threads[nthreads++] = ncpu;
+
+	while ((opt = getopt(argc, argv, "b:c:k:p:r:t:z:")) != EOF) {
+		switch (opt) {
+			case 'b':
+				bin = optarg;
+				break;
+			case 'c':
+				base = optarg;
+				break;
+			case 'k':
+				nskips = splitint(optarg, skips);
+				break;
+			case 'p':
+				npals = split(optarg, pals);
+				break;
+			case 'r':
+				if ((repeats = atoi(optarg)) <= 0)
+					usage();
+				break;
+			case 't':
+				nthreads = splitint(optarg, threads);
+				break;
+			case 'z':
+				nzooms = splitint(optarg, zooms);
+				break;
+			default:
+				usage();
+		}
+	}
+	if (optind >= argc || nzooms == 0 || nskips == 0 || nthreads == 0)
+		usage();
+	if (npals == 0) {
+		for (all = d2p_palettes(); all[npals] != NULL &&
+		    npals < MAXLIST; npals++)
+			pals[npals] = (char *)all[npals];
+	}
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		exit(2);
+	}
+	snprintf(outfile, sizeof (outfile), "%s/out.png", dir);
+
+	printf("[\n");
+	for (f = optind; f < argc; f++) {
+		if (stat(argv[f], &st) != 0) {
+			perror(argv[f]);
+			failures++;
+			continue;
+		}
+		name = strrchr(argv[f], '/') != NULL ?
+		    strrchr(argv[f], '/') + 1 : argv[f];
+		for (p = 0; p < npals; p++)
+		for (z = 0; z < nzooms; z++)
+		for (k = 0; k < nskips; k++)
+		for (t = -1; t < nthreads; t++) {
+			/* t -1 is the single render, then batch per count */
+			nt = t < 0 ? 0 : threads[t];
+			for (i = 0; i < repeats; i++) {
+				if (run(bin, argv[f], outfile, pals[p],
+				    zooms[z], skips[k], nt, &r) != 0)
+					break;
+				if (i == 0 || r.secs < best.secs)
+					best = r;
+				if (base == NULL)
+					continue;
+				if (run(base, argv[f], outfile, pals[p],
+				    zooms[z], skips[k], nt, &r) != 0)
+					break;
+				if (i == 0 || r.secs < bbest.secs)
+					bbest = r;
+			}
+			mode = nt > 0 ? "batch" : "single";
+			if (i < repeats) {
+				fprintf(stderr, "FAILED: %s -p %s -z %d -k %d "
+				    "%s -t %d\n", argv[f], pals[p], zooms[z],
+				    skips[k], mode, nt > 0 ? nt : 1);
+				failures++;
+				continue;
+			}
+			mbs = st.st_size / best.secs / 1048576;
+			printf("%s  {\"input\": \"%s\", \"bytes\": %lld, "
+			    "\"palette\": \"%s\", \"zoom\": %d, \"skip\": %d, "
+			    "\"mode\": \"%s\", \"threads\": %d, "
+			    "\"seconds\": %.4f, \"mb_per_s\": %.2f, "
+			    "\"peak_rss_kb\": %ld, \"output_bytes\": %lld",
+			    first ? "" : ",\n", name, (long long)st.st_size,
+			    pals[p], zooms[z], skips[k], mode, nt > 0 ? nt : 1,
+			    best.secs, mbs, best.maxrss,
+			    (long long)best.outsize);
+			first = 0;
+			if (base == NULL) {
+				fprintf(stderr, "%s %s z%d k%d %s t%d: "
+				    "%.1f MB/s\n", name, pals[p], zooms[z],
+				    skips[k], mode, nt > 0 ? nt : 1, mbs);
+				printf("}");
+				continue;
+			}
+			bmbs = st.st_size / bbest.secs / 1048576;
+			fprintf(stderr, "%s %s z%d k%d %s t%d: %.1f -> %.1f "
+			    "MB/s (%+.1f%%)\n", name, pals[p], zooms[z],
+			    skips[k], mode, nt > 0 ? nt : 1, bmbs, mbs,
+			    (mbs / bmbs - 1) * 100);
+			printf(", \"baseline_mb_per_s\": %.2f, "
+			    "\"speedup\": %.4f}", bmbs, mbs / bmbs);
+			logsum += log(mbs / bmbs);
+			ncompared++;
+		}
+	}
+	printf("\n]\n");
+	if (ncompared > 0) {
+		fprintf(stderr, "%d runs: %s is %+.1f%% vs %s (geometric "
+		    "mean)\n", ncompared, bin,
+		    (exp(logsum / ncompared) - 1) * 100, base);
+	}
+
+	(void) unlink(outfile);
+	(void) rmdir(dir);
+	return (failures ? 1 : 0);
+}
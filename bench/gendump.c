@@ -0,0 +1,306 @@
+/*
+ * gendump	Generate synthetic memory dumps for benchmarking dump2png.
+ *
+ * Each kind of dump imitates a common kind of memory: zero pages, text,
+ * x86 code, random (compressed or encrypted) data, pointer arrays, float
+ * arrays, and sparse files with holes.  Output is reproducible: the same
+ * kind, size and seed always give the same bytes.
+ *
+ * USAGE: gendump [-s size] [-S seed] kind outfile
+ *
+ * Copyright 2012 Joyent, Inc.  All rights reserved.
+ * Copyright 2012 Brendan Gregg.  All rights reserved.
+ *
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define	BLOCK		(1024 * 1024)	/* generated per write */
+#define	SPARSE_DATA	(64 * 1024)	/* data per sparse extent */
+#define	SPARSE_HOLE	(960 * 1024)	/* hole between extents */
+
+static uint64_t rngstate;
+
+/* xorshift64*: small, fast, and the same everywhere */
+static uint64_t
+rnd(void)
+{
+	rngstate ^= rngstate >> 12;
+	rngstate ^= rngstate << 25;
+	rngstate ^= rngstate >> 27;
+	return (rngstate * 0x2545F4914F6CDD1DULL);
+}
+
+static void
+genzero(unsigned char *buf, size_t len, off_t off)
+{
+	memset(buf, 0, len);
+}
+
+static void
+genrandom(unsigned char *buf, size_t len, off_t off)
+{
+	uint64_t v = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (i % 8 == 0)
+			v = rnd();
+		buf[i] = v;
+		v >>= 8;
+	}
+}
+
+static void
+gentext(unsigned char *buf, size_t len, off_t off)
+{
+	static const char *words[] = {
+		"the", "of", "and", "to", "in", "is", "that", "for", "it",
+		"as", "was", "with", "be", "by", "on", "not", "he", "this",
+		"are", "or", "his", "from", "at", "which", "but", "have",
+		"memory", "process", "thread", "error", "value", "function",
+		"return", "string", "buffer", "request", "session", "user"
+	};
+	const char *w;
+	size_t i = 0;
+
+	while (i < len) {
+		w = words[rnd() % (sizeof (words) / sizeof (words[0]))];
+		while (*w != '\0' && i < len)
+			buf[i++] = *w++;
+		if (i < len)
+			buf[i++] = rnd() % 12 == 0 ? '\n' : ' ';
+	}
+}
+
+/*
+ * x86 code: a mix of common instruction encodings, with random operands.
+ */
+static void
+genx86(unsigned char *buf, size_t len, off_t off)
+{
+	static const struct {
+		unsigned char	op[4];
+		int		oplen;
+		int		imm;		/* random operand bytes */
+	} insns[] = {
+		{ { 0x55 }, 1, 0 },			/* push %rbp */
+		{ { 0x48, 0x89, 0xe5 }, 3, 0 },		/* mov %rsp,%rbp */
+		{ { 0x48, 0x8b, 0x45 }, 3, 1 },		/* mov d8(%rbp),%rax */
+		{ { 0x89, 0x45 }, 2, 1 },		/* mov %eax,d8(%rbp) */
+		{ { 0x8b, 0x45 }, 2, 1 },		/* mov d8(%rbp),%eax */
+		{ { 0xe8 }, 1, 4 },			/* call rel32 */
+		{ { 0x85, 0xc0 }, 2, 0 },		/* test %eax,%eax */
+		{ { 0x74 }, 1, 1 },			/* je rel8 */
+		{ { 0x75 }, 1, 1 },			/* jne rel8 */
+		{ { 0x48, 0x83, 0xc4 }, 3, 1 },		/* add $i8,%rsp */
+		{ { 0xc7, 0x45 }, 2, 5 },		/* movl $i32,d8(%rbp) */
+		{ { 0x0f, 0x1f, 0x44, 0x00 }, 4, 1 },	/* nopl */
+		{ { 0x5d }, 1, 0 },			/* pop %rbp */
+		{ { 0xc3 }, 1, 0 },			/* ret */
+	};
+	size_t i = 0, n;
+	int j;
+
+	while (i < len) {
+		n = rnd() % (sizeof (insns) / sizeof (insns[0]));
+		for (j = 0; j < insns[n].oplen && i < len; j++)
+			buf[i++] = insns[n].op[j];
+		for (j = 0; j < insns[n].imm && i < len; j++)
+			buf[i++] = j == 0 ? rnd() :
+			    rnd() % 4 == 0 ? 0xff : 0;
+	}
+}
+
+/*
+ * Pointer arrays: aligned little-endian heap and stack addresses, with
+ * some NULLs.
+ */
+static void
+genpointers(unsigned char *buf, size_t len, off_t off)
+{
+	uint64_t base = 0x00007f3a12000000ULL, v;
+	size_t i;
+	int j;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		switch (rnd() % 8) {
+			case 0:
+				v = 0;
+				break;
+			case 1:
+				v = 0x00007ffde0000000ULL +
+				    (rnd() % 0x100000 & ~7ULL);
+				break;
+			default:
+				v = base + (rnd() % 0x4000000 & ~15ULL);
+				break;
+		}
+		for (j = 0; j < 8; j++)
+			buf[i + j] = v >> (j * 8);
+	}
+	for (; i < len; i++)
+		buf[i] = 0;
+}
+
+/*
+ * Float arrays: doubles of a slowly varying signal, with noise.
+ */
+static void
+genfloats(unsigned char *buf, size_t len, off_t off)
+{
+	double d;
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		d = sin((off + i) / 8 / 1000.0) * 100.0 +
+		    (double)(rnd() % 1000) / 1000.0;
+		memcpy(&buf[i], &d, 8);
+	}
+	for (; i < len; i++)
+		buf[i] = 0;
+}
+
+static const struct {
+	const char	*name;
+	void		(*gen)(unsigned char *, size_t, off_t);
+} kinds[] = {
+	{ "zero",	genzero },
+	{ "text",	gentext },
+	{ "x86",	genx86 },
+	{ "random",	genrandom },
+	{ "pointers",	genpointers },
+	{ "floats",	genfloats },
+	{ "sparse",	genx86 },	/* extents of code between holes */
+	{ NULL,		NULL }
+};
+
+static void
+usage(void)
+{
+	int i;
+
+	fprintf(stderr, "USAGE: gendump [-s size] [-S seed] kind outfile\n"
+	    "\t-s size\tbytes, with optional K, M or G suffix (default 64M)\n"
+	    "\t-S seed\trandom seed (default 1)\n\nkinds:");
+	for (i = 0; kinds[i].name != NULL; i++)
+		fprintf(stderr, " %s", kinds[i].name);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+static long long
+parsesize(const char *str)
+{
+	char *end;
+	long long v;
+
+	v = strtoll(str, &end, 10);
+	switch (*end) {
+		case 'G': case 'g':
+			v *= 1024;
+			/* FALLTHROUGH */
+		case 'M': case 'm':
+			v *= 1024;
+			/* FALLTHROUGH */
+		case 'K': case 'k':
+			v *= 1024;
+			end++;
+	}
+	return (*end == '\0' && end != str ? v : -1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	long long size = 64LL * 1024 * 1024, seed = 1, off, n;
+	unsigned char *buf;
+	int opt, fd, kind, sparse;
+
+	while ((opt = getopt(argc, argv, "s:S:")) != EOF) {
+		switch (opt) {
+			case 's':
+				if ((size = parsesize(optarg)) < 0)
+					usage();
+				break;
+			case 'S':
+				seed = atoll(optarg);
+				break;
+			default:
+				usage();
+		}
+	}
+	if (optind + 2 != argc)
+		usage();
+	for (kind = 0; kinds[kind].name != NULL; kind++) {
+		if (strcmp(argv[optind], kinds[kind].name) == 0)
+			break;
+	}
+	if (kinds[kind].name == NULL)
+		usage();
+	sparse = strcmp(kinds[kind].name, "sparse") == 0;
+
+	if ((fd = open(argv[optind + 1], O_WRONLY | O_CREAT | O_TRUNC,
+	    0644)) < 0) {
+		perror("Can't create outfile");
+		exit(2);
+	}
+	if ((buf = malloc(BLOCK)) == NULL) {
+		perror("Out of memory");
+		exit(2);
+	}
+	rngstate = seed * 0x9E3779B97F4A7C15ULL + 1;
+
+	for (off = 0; off < size; off += n) {
+		n = size - off < BLOCK ? size - off : BLOCK;
+		if (sparse) {
+			/* a data extent, then a hole */
+			if (n > SPARSE_DATA)
+				n = SPARSE_DATA;
+			kinds[kind].gen(buf, n, off);
+			if (pwrite(fd, buf, n, off) != n) {
+				perror("Write failed");
+				exit(2);
+			}
+			n += SPARSE_HOLE;
+			continue;
+		}
+		kinds[kind].gen(buf, n, off);
+		if (write(fd, buf, n) != n) {
+			perror("Write failed");
+			exit(2);
+		}
+	}
+	if (ftruncate(fd, size) != 0 || close(fd) != 0) {
+		perror("Write failed");
+		exit(2);
+	}
+	free(buf);
+
+	return (0);
+}
@@ -0,0 +1,268 @@
+/*
+ * kernels	Microbenchmarks for the libdump2png colorize and zoom kernels.
+ *
+ * Each palette kernel (map_hues, map_x86, the inline gray, color, rgb and
+ * dvi cases, ...) and the zoom reducer is timed on its own, on in-cache
+ * buffers, so kernel changes can be judged without disk and zlib noise.
+ * Every kernel is timed through dorow() itself, the code a render runs,
+ * with its two paths side by side: "scalar" is the render switch (or the
+ * x86_64 and bytecode kernels it hands off to), and "table" the
+ * precomputed 256 entry palette table, for palettes that have one.  The
+ * zoom rows time the zoom reducer, at -z zoom, within dorow().  Expression
+ * palettes (a palette of "=expr") take the table path for bytes, and the
+ * bytecode kernel for wider words; "@table16" is a random 65536 entry
+ * table, as loaded from a palette file.  The library has no vectorized
+ * paths, so there is no simd column.
+ *
+ * The library source is included directly, to reach dorow() and its
+ * context.  The process is pinned to one CPU, and each kernel is repeated
+ * until its fastest time has been stable for a while; results are cycles
+ * per input byte (TSC cycles on x86, else nanoseconds).
+ *
+ * USAGE: kernels [-c cpu] [-s bytes] [-z zoom]
+ *
+ * Copyright 2012 Joyent, Inc.  All rights reserved.
+ * Copyright 2012 Brendan Gregg.  All rights reserved.
+ *
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+#define	_GNU_SOURCE
+#include <sched.h>
+#include <time.h>
+#include "../libdump2png.c"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define	UNITS		"cycles/byte"
+#else
+#define	UNITS		"ns/byte"
+#endif
+
+#define	STABLE		50	/* samples without a new best to stop */
+#define	MIN_SAMPLES	100
+#define	MAX_SECS	2.0	/* per kernel */
+#define	IMPROVE		0.995	/* a new best must beat the old by 0.5% */
+
+static unsigned char *inbuf, *outbuf;
+static unsigned char words[65536 * 3];
+static size_t insize = 16 * 1024;
+static int zoom = 16;
+static d2p_t *rowd2p;
+
+static inline unsigned long long
+ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return (__rdtsc());
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+#endif
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/* dorow(), through the render switch or the palette table */
+static void
+k_row(size_t n)
+{
+	rowd2p->hastable = 0;
+	(void) dorow(rowd2p, inbuf, n, outbuf);
+}
+
+static void
+k_rowtable(size_t n)
+{
+	rowd2p->hastable = 1;
+	(void) dorow(rowd2p, inbuf, n, outbuf);
+}
+
+#define	NVARIANTS	2		/* scalar, table */
+
+typedef struct kernel {
+	const char	*name;
+	const char	*palette;
+	int		zoom;		/* -1 for -z zoom */
+	void		(*func[NVARIANTS])(size_t);
+} kernel_t;
+
+static kernel_t kernels[] = {
+	{ "gray",	"gray",		1, { k_row, k_rowtable } },
+	{ "color",	"color",	1, { k_row, k_rowtable } },
+	{ "map_hues",	"hues",		1, { k_row, k_rowtable } },
+	{ "map_hues6",	"hues6",	1, { k_row, k_rowtable } },
+	{ "map_fhues",	"fhues",	1, { k_row, k_rowtable } },
+	{ "map_x86",	"x86",		1, { k_row, k_rowtable } },
+	{ "map_color16", "color16",	1, { k_row } },
+	{ "map_color32", "color32",	1, { k_row } },
+	{ "rgb",	"rgb",		1, { k_row } },
+	{ "dvi",	"dvi",		1, { k_row } },
+	{ "x86_64",	"x86_64",	1, { k_row } },
+	{ "gray zoom",	"gray",		-1, { k_row, k_rowtable } },
+	{ "x86 zoom",	"x86",		-1, { k_row, k_rowtable } },
+	{ "rgb zoom",	"rgb",		-1, { k_row } },
+	{ "expr8",	"=r = b & 0xf0; g = (b == 0x48) * 255; "
+	    "b = popcount(b) * 32", 1, { NULL, k_rowtable } },
+	{ "expr16",	"=r = w >> 8; g = (w == 0) * 255; "
+	    "b = popcount(w) * 16", 1, { k_row } },
+	{ "table16",	"@table16",	1, { k_row } },
+	{ NULL }
+};
+
+static int
+rowpalette(d2p_t *d, const char *palette)
+{
+	switch (palette[0]) {
+		case '=':
+			return (d2p_set_palette_expr(d, &palette[1], NULL));
+		case '@':
+			return (d2p_set_palette_table(d, palette, words, 65536));
+		default:
+			return (d2p_set_palette(d, palette));
+	}
+}
+
+/*
+ * Time one kernel: repeat until the best time has been stable for STABLE
+ * samples (or MAX_SECS pass), and return the best, per input byte.
+ */
+static double
+measure(void (*func)(size_t))
+{
+	unsigned long long t, best = ~0ULL;
+	double start = now();
+	int samples, since = 0;
+
+	func(insize);		/* warm up */
+	for (samples = 0; samples < MIN_SAMPLES || (since < STABLE &&
+	    now() - start < MAX_SECS); samples++) {
+		t = ticks();
+		func(insize);
+		t = ticks() - t;
+		if (t < best * IMPROVE) {
+			since = 0;
+		} else {
+			since++;
+		}
+		if (t < best)
+			best = t;
+	}
+	return ((double)best / insize);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "USAGE: kernels [-c cpu] [-s bytes] [-z zoom]\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const char *vnames[NVARIANTS] = { "scalar", "table" };
+	cpu_set_t cpus;
+	kernel_t *k;
+	double cpb;
+	int cpu = -1, opt, v, i;
+
+	while ((opt = getopt(argc, argv, "c:s:z:")) != EOF) {
+		switch (opt) {
+			case 'c':
+				cpu = atoi(optarg);
+				break;
+			case 's':
+				insize = atol(optarg);
+				break;
+			case 'z':
+				zoom = atoi(optarg);
+				break;
+			default:
+				usage();
+		}
+	}
+	if (insize < 1024 || zoom < 1)
+		usage();
+
+	if (cpu < 0 && (cpu = sched_getcpu()) < 0)
+		cpu = 0;
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	if (sched_setaffinity(0, sizeof (cpus), &cpus) != 0)
+		perror("Can't pin to cpu; continuing");
+
+	/* output room for one pixel per input byte */
+	inbuf = malloc(insize);
+	outbuf = malloc(insize * 3);
+	if (inbuf == NULL || outbuf == NULL) {
+		perror("Out of memory");
+		exit(2);
+	}
+	srand(1);
+	for (i = 0; i < (int)insize; i++)
+		inbuf[i] = rand();
+	for (i = 0; i < (int)sizeof (words); i++)
+		words[i] = rand();
+
+	printf("%d bytes in cache, cpu %d, %s (best of stable runs)\n\n",
+	    (int)insize, cpu, UNITS);
+	printf("%-16s", "KERNEL");
+	for (v = 0; v < NVARIANTS; v++)
+		printf("%10s", vnames[v]);
+	printf("\n");
+
+	for (k = kernels; k->name != NULL; k++) {
+		d2p_destroy(rowd2p);
+		rowd2p = d2p_create();
+		if (rowd2p == NULL || rowpalette(rowd2p, k->palette) != D2P_OK ||
+		    d2p_set_mask(rowd2p, 0) != D2P_OK ||
+		    d2p_set_zoom(rowd2p, k->zoom > 0 ? k->zoom : zoom) !=
+		    D2P_OK || d2p_set_width(rowd2p, insize /
+		    (d2p_get_chrs(rowd2p) * d2p_get_zoom(rowd2p))) != D2P_OK) {
+			fprintf(stderr, "ERROR: row context\n");
+			exit(2);
+		}
+		printf("%-16s", k->name);
+		for (v = 0; v < NVARIANTS; v++) {
+			if (k->func[v] == NULL) {
+				printf("%10s", "-");
+				continue;
+			}
+			cpb = measure(k->func[v]);
+			printf("%10.3f", cpb);
+		}
+		printf("\n");
+		fflush(stdout);
+	}
+
+	d2p_destroy(rowd2p);
+	free(inbuf);
+	free(outbuf);
+	return (0);
+}
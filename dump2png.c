@@ -9,11 +9,14 @@
  *
  * USAGE: See: ./dump2png --help
  *
- * BUILD: gcc -O3 -lm -lpng -o dump2png dump2png.c	# requires libpng
+ * BUILD: make		# requires libpng and zlib
+ *
+ * The rendering is done by libdump2png (libdump2png.h); this file is the
+ * command line tool, and the multi-file modes built on the library.
  *
  * By default, the least significant bit is masked, so that the image can't
  * be converted back to the input file, to avoid inadvertent privacy leaks.
- * Use -M to avoid masking, or increase BYTE_MASK to mask more bits.
+ * Use -M to avoid masking, or increase D2P_BYTE_MASK to mask more bits.
  *
  * SEE ALSO: ImageMagick, which has similar functionality to the "gray" and
  * "rgb" palettes.
@@ -43,34 +46,113 @@
  * 30-Apr-2012	Brendan Gregg	Created this.
  */
 
+#define	_GNU_SOURCE		/* O_DIRECT */
 #include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <math.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <getopt.h>
+#include <limits.h>
+#include <time.h>
 #include <png.h>
+#include <zlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sched.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include "libdump2png.h"
+
+#define	PLUGIN_PATH	"/usr/local/lib/dump2png:/usr/lib/dump2png"
 
 static void
 usage(int full)
 {
 	printf("USAGE: dump2png [-HM] [-w width] [-h height_max]\n"
-	    "                [-p palette] [-o outfile.png]\n"
+	    "                [-p palette | -P expr] [-o outfile.png]\n"
 	    "                [-k skip_factor] [-s seek_bytes]\n"
-	    "                [-z zoom_factor] file\n\n"
+	    "                [-z zoom_factor] [-t threads] file\n"
+	    "       dump2png -a [-d delay_ms] [options] file1 file2 ...\n"
+	    "       dump2png -b [-o name_template] [options] file|dir|@list ...\n"
+	    "       dump2png -m columns [-g WxH] [options] file1 file2 ...\n"
+	    "       dump2png --locate out.png x y [file]\n\n"
 	    "                [--help]\t# for full help\n\n"
 	    "palette types: gray, gray16b, gray16l, gray32b, gray32l,\n"
 	    "               hues, hues6, fhues, color, color16, color32, rgb,\n"
-	    "               dvi, x86 (default).\n");
+	    "               dvi, x86 (default), x86_64, file:table, plugins.\n");
 	if (!full)
 		exit(1);
 	printf("\n\t-H            \tdon't autoscale height\n"
 	    "\t-M            \tdon't mask least significant bit\n"
+	    "\t-a            \tanimate: write an APNG, one frame per file\n"
+	    "\t-b            \tbatch: render each file, dir entry, or @list name\n"
+	    "\t-d delay_ms\tdelay between animation frames (default 500)\n"
+	    "\t-g WxH     \tmontage thumbnail size (default 128x128)\n"
 	    "\t-k skip_factor\tskips horiz lines; eg, 3 means show 1 out of 3\n"
+	    "\t-m columns\tmontage: a grid of labeled thumbnails, one per file\n"
+	    "\t-o outfile\toutput file; in batch mode a template where %%n is\n"
+	    "\t              \tthe input base name and %%i its index (%%n.png)\n"
 	    "\t-s seek_bytes\tthe byte offset of the infile to begin reading\n"
+	    "\t-t threads\tworker threads (default: online CPUs, or the\n"
+	    "\t              \tcgroup CPU quota if lower)\n"
 	    "\t-z zoom_factor\taverages multiple bytes; eg, 16 avgs 16 as 1\n"
-	    "\t-z palette\tpalette type for colorization:\n\n"
+	    "\t--cache dir\tkeep rendered pngs in dir, and reuse them for\n"
+	    "\t              \tidentical runs (default $DUMP2PNG_CACHE)\n"
+	    "\t--cache-max size\tcache size cap, eg 500M (default 1G)\n"
+	    "\t--cache-hash\tidentify inputs by sampled content, not inode\n"
+	    "\t--progressive[=numbered]\twrite a coarse preview first, then\n"
+	    "\t              \trefine it in passes, replacing the output (or\n"
+	    "\t              \twriting out.1.png, out.2.png, ...)\n"
+	    "\t--deadline time\tfinish within time (eg, 10s, 500ms), sampling\n"
+	    "\t              \tas many rows as fit and interpolating the rest\n"
+	    "\t--hatch       \twith --deadline, hatch unsampled rows instead\n"
+	    "\t--target palette:width:zoom:outfile\n"
+	    "\t              \talso render to outfile in the same read pass;\n"
+	    "\t              \tempty fields take the main settings (repeatable)\n"
+	    "\t--collapse rows\treplace runs of more than rows single-valued\n"
+	    "\t              \trows (eg, zeros) with a labeled separator\n"
+	    "\t--stats[=json]\tprint time per stage and counters after the\n"
+	    "\t              \trender (or as JSON)\n"
+	    "\t--perf        \tprint hardware counters (IPC, cache and branch\n"
+	    "\t              \tmisses) per stage after the render\n"
+	    "\t--progress[=fd]\treport bytes, rows, MB/s and ETA every second\n"
+	    "\t              \ton stderr (or as JSON lines to fd)\n"
+	    "\t--max-read-rate rate\tlimit input reads to rate per second\n"
+	    "\t              \t(eg, 50M)\n"
+	    "\t--idle        \trun at idle CPU and I/O priority\n"
+	    "\t--drop-behind \tdrop input from the page cache once read\n"
+	    "\t--memory-budget size\tbound buffer memory, eg 512M (default:\n"
+	    "\t              \thalf the cgroup memory limit, if any)\n"
+	    "\t--direct[=size]\tread input with O_DIRECT, bypassing the page\n"
+	    "\t              \tcache, into size buffers (default 4M)\n"
+	    "\t--async-write[=size]\twrite pngs from a writer thread, in\n"
+	    "\t              \tdouble buffered size writes (default 4M)\n"
+	    "\t--preallocate \twith --async-write, reserve each png's space\n"
+	    "\t              \tup front\n"
+	    "\t--trace file\twrite a Chrome trace (Perfetto) timeline of\n"
+	    "\t              \tthe work on each thread to file\n"
+	    "\t--locate png x y [file]\tprint the input offset and bytes\n"
+	    "\t              \tbehind pixel x, y of png\n"
+	    "\t-P expr       \tpalette from expressions of the input, eg\n"
+	    "\t              \t'r = b & 0xf0; g = (b == 0x48) * 255;\n"
+	    "\t              \tb = popcount(b) * 32', where b is a byte,\n"
+	    "\t              \tw|W a 16-bit word (little|big-endian), d|D\n"
+	    "\t              \t32-bit, q 64-bit; C operators, popcount(),\n"
+	    "\t              \tabs(), log2(), min(), max()\n"
+	    "\t-p palette\tpalette type for colorization:\n\n"
 	    "\tgray\t\tgrayscale, per byte\n"
 	    "\tgray16b\t\tgrayscale, per short (big-endian)\n"
 	    "\tgray16l\t\tgrayscale, per short (little-endian)\n"
@@ -87,43 +169,192 @@ usage(int full)
 	    "\tx86\t\tgrayscale with some (9) color indicators:\n\n"
 	    "\t    green = common english chars: 'e', 't', 'a'\n"
 	    "\t    red = common x86 instructions: movl, call, testl\n"
-	    "\t    blue = binary values: 0x01, 0x02, 0x03\n");
+	    "\t    blue = binary values: 0x01, 0x02, 0x03\n\n"
+	    "\tx86_64\t\tx86-64 code likeness of each 32 byte window, from\n"
+	    "\t\t\tREX, opcode, ModRM and prologue/epilogue byte\n"
+	    "\t\t\tpairs: code red, text green, other data gray\n\n"
+	    "\tfile:path\ta table of 256 (per byte) or 65536 (per 16-bit\n"
+	    "\t\t\tlittle-endian short) RGB entries: binary, or if\n"
+	    "\t\t\tpath ends in .txt, \"r g b\" or 0xrrggbb per line\n\n"
+	    "\tOther names load name.so from $DUMP2PNG_PLUGINS (a : separated\n"
+	    "\tpath; default " PLUGIN_PATH "), or a .so path.\n");
 	exit(1);
 }
 
-typedef enum {
-	GRAY = 0,
-	GRAY16B,
-	GRAY32B,
-	GRAY16L,
-	GRAY32L,
-	HUES,
-	HUES6,
-	FHUES,
-	COLOR,
-	COLOR16,
-	COLOR32,
-	RGB,
-	DVI,
-	X86
-} palette_t;
-
-static palette_t atopal(const char *opt);
-static int pal2chrs(palette_t pal);
-static int doimage(int infile, FILE *outfile, int width, int height,
-    palette_t pal, int skip, int zoom, int mask);
+typedef struct rect {
+	int		x, y, w, h;
+} rect_t;
+
+typedef struct frame {
+	char		*name;
+	int		fd;
+	int		x, y, w, h;	/* region encoded for this frame */
+	rect_t		*rects;		/* clusters of changes within it */
+	int		nrects;
+	FILE		*data;		/* deflated region */
+	int		error;
+} frame_t;
+
+typedef struct anim {
+	frame_t		*frames;
+	int		nframes;
+	d2p_t		*d2p;		/* settings for each frame */
+	int		width, height, skip;
+	off_t		seek;
+} anim_t;
+
+static anim_t *animopen(int nfiles, char **files, off_t *maxsize);
+static int doanim(anim_t *a, FILE *outfile, int delay, int nthreads);
+static int domontage(FILE *outfile, int nfiles, char **files, int cols,
+    int tw, int th, d2p_t *d2p, off_t seek, int nthreads);
+static int dobatch(int nargs, char **args, const char *tmpl, d2p_t *d2p,
+    int height, int hscale, off_t seek, int nthreads);
+
+static long long parsesize(const char *str);
+static int doprogressive(d2p_t *d2p, int infile, const char *outfilename,
+    int numbered, off_t seek, int nthreads);
+static double now(void);
+static double parsetime(const char *str);
+static int dodeadline(d2p_t *d2p, int infile, const char *outfilename,
+    double start, double deadline, int hatch, off_t seek, int nthreads);
+static int fanparse(const char *spec, d2p_t *d2p, d2p_t **tp,
+    char **outp);
+static int dofanout(d2p_t **d2ps, char **outfilenames, int ntargets,
+    int infile, size_t direct);
+static int dolocate(const char *pngname, int x, int y, const char *file);
+static int docollapse(d2p_t *d2p, int infile, const char *outfilename,
+    off_t seek, int minrows);
+static void printstats(d2p_t *d2p, const char *outfilename, double start,
+    int json);
+static void printperf(d2p_t *d2p, const char *outfilename);
+static int metering;			/* --progress given */
+static int meterfd = -1;		/* for JSON lines, else stderr */
+static void meterstart(long long bytes, long long rows);
+static void meteradd(long long bytes, long long rows);
+static void metertotal(long long bytes);
+static void meterstop(void);
+static int meterrow(void *arg, int y, const unsigned char *rgb, int width);
+static double maxrate;			/* --max-read-rate, bytes/sec */
+static int dropbehind;			/* --drop-behind given */
+static void throttle(long long bytes);
+static void dropcache(int fd, off_t offset, off_t len);
+static int feedpaced(d2p_t *d2p, int infile);
+static void demote(void);
+static long long membudget;		/* --memory-budget, bytes; 0 for none */
+static int cputhreads(void);
+static long long cgroupbudget(void);
+static int fitthreads(int nthreads, long long perthread, long long fixed);
+static long long awsize;		/* --async-write buffers; 0 for stdio */
+static int preallocate;			/* --preallocate given */
+static FILE *outopen(const char *path, long long expect);
+static int setpalette(d2p_t *d2p, const char *name);
+static int tracing;			/* --trace given */
+static void traceopen(const char *path);
+static void tracename(const char *fmt, ...);
+static uint64_t traceb(void);
+static void tracee(const char *name, uint64_t begin, long arg);
+static void tracehook(void *arg, const char *stage, uint64_t begin,
+    uint64_t end);
+static char *cachekey(const char *infilename, int hashcontent, d2p_t *d2p,
+    off_t seek);
+static int cacheget(const char *dir, const char *key,
+    const char *outfilename);
+static void cacheput(const char *dir, const char *key,
+    const char *outfilename, long long max);
+
+#define	CACHE_MAX	(1024LL * 1024 * 1024)	/* default cache size cap */
+#define	FAN_MAX		16		/* max --target outputs */
+#define	ZMEM		(300 * 1024)	/* a default deflate stream */
+#define	WARM_BYTES	64		/* input that sets dvi, x86_64 state */
+#define	DIRECT_ALIGN	4096		/* O_DIRECT offset, size unit */
+#define	DIRECT_CHUNK	(4 * 1024 * 1024)	/* --direct buffer */
+#define	AW_BUF		(4 * 1024 * 1024)	/* --async-write buffer */
+
+/* long options without a short equivalent */
+enum {
+	OPT_CACHE = 256,
+	OPT_CACHE_MAX,
+	OPT_CACHE_HASH,
+	OPT_PROGRESSIVE,
+	OPT_DEADLINE,
+	OPT_HATCH,
+	OPT_TARGET,
+	OPT_LOCATE,
+	OPT_COLLAPSE,
+	OPT_STATS,
+	OPT_TRACE,
+	OPT_PERF,
+	OPT_PROGRESS,
+	OPT_MAX_READ_RATE,
+	OPT_IDLE,
+	OPT_DROP_BEHIND,
+	OPT_MEMORY_BUDGET,
+	OPT_DIRECT,
+	OPT_ASYNC_WRITE,
+	OPT_PREALLOCATE
+};
+
+static struct option longopts[] = {
+	{ "cache",		required_argument,	NULL,	OPT_CACHE },
+	{ "cache-max",		required_argument,	NULL,	OPT_CACHE_MAX },
+	{ "cache-hash",		no_argument,		NULL,	OPT_CACHE_HASH },
+	{ "progressive",	optional_argument,	NULL,	OPT_PROGRESSIVE },
+	{ "deadline",		required_argument,	NULL,	OPT_DEADLINE },
+	{ "hatch",		no_argument,		NULL,	OPT_HATCH },
+	{ "target",		required_argument,	NULL,	OPT_TARGET },
+	{ "locate",		required_argument,	NULL,	OPT_LOCATE },
+	{ "collapse",		required_argument,	NULL,	OPT_COLLAPSE },
+	{ "stats",		optional_argument,	NULL,	OPT_STATS },
+	{ "trace",		required_argument,	NULL,	OPT_TRACE },
+	{ "perf",		no_argument,		NULL,	OPT_PERF },
+	{ "progress",		optional_argument,	NULL,	OPT_PROGRESS },
+	{ "max-read-rate",	required_argument,	NULL,	OPT_MAX_READ_RATE },
+	{ "idle",		no_argument,		NULL,	OPT_IDLE },
+	{ "drop-behind",	no_argument,		NULL,	OPT_DROP_BEHIND },
+	{ "memory-budget",	required_argument,	NULL,	OPT_MEMORY_BUDGET },
+	{ "direct",		optional_argument,	NULL,	OPT_DIRECT },
+	{ "async-write",	optional_argument,	NULL,	OPT_ASYNC_WRITE },
+	{ "preallocate",	no_argument,		NULL,	OPT_PREALLOCATE },
+	{ NULL,			0,			NULL,	0 }
+};
+
+static void
+d2pcheck(int err, const char *what)
+{
+	if (err != D2P_OK) {
+		fprintf(stderr, "ERROR: %s: %s\n", what, d2p_strerror(err));
+		exit(2);
+	}
+}
 
 int
 main(int argc, char *argv[])
 {
-	char *infilename, *outfilename = "dump2png.png";
+	char *infilename, *outfilename = "dump2png.png", *palname = "x86";
+	char *palexpr = NULL;
 	extern char *optarg;
 	extern int optind, optopt;
 	struct stat filestat;
-	int infile, opt, width, height, skip, zoom, chrs, mask, hscale = 1;
-	palette_t pal;
-	off_t seek;
+	int infile = -1, opt, width, height, skip, zoom, chrs, mask, hscale = 1;
+	int animate = 0, batch = 0, delay = 500, nthreads;
+	int montcols = 0, thumbw = 128, thumbh = 128;
+	char *cachedir = getenv("DUMP2PNG_CACHE"), *key = NULL;
+	long long cachemax = CACHE_MAX;
+	int cachehash = 0, progressive = 0, hatch = 0;
+	double start = now(), deadline = 0;
+	char *targets[FAN_MAX], *fanout[FAN_MAX + 1];
+	d2p_t *fand2p[FAN_MAX + 1];
+	int ntargets = 0, maxheight, i;
+	char *locate = NULL, *path, *p;
+	int budgeted = 0, custom = 0, pos;
+	long long direct = 0;
+	int collapse = 0, stats = 0, perf = 0;
+	off_t seek, size;
+	long long covered;
+	anim_t *anim = NULL;
+	d2p_t *d2p;
 	FILE *outfile;
+	int result;
 
 	/* defaults */
 	width = 1024 * 1;
@@ -131,16 +362,131 @@ main(int argc, char *argv[])
 	zoom = skip = 1;
 	seek = 0;
 	mask = 1;
-	pal = X86;
+	nthreads = cputhreads();
 
 	if (argc < 2 || strcmp(argv[1], "--help") == 0)
 		usage(argc >= 2);
 
-	while ((opt = getopt(argc, argv, "HMh:k:o:p:s:w:z:?")) != EOF) {
+	while ((opt = getopt_long(argc, argv, "HMP:abd:g:h:k:m:o:p:s:t:w:z:?",
+	    longopts, NULL)) != EOF) {
 		switch (opt) {
+			case OPT_CACHE:
+				cachedir = optarg;
+				break;
+			case OPT_CACHE_MAX:
+				if ((cachemax = parsesize(optarg)) < 0)
+					usage(0);
+				break;
+			case OPT_CACHE_HASH:
+				cachehash = 1;
+				break;
+			case OPT_DEADLINE:
+				if ((deadline = parsetime(optarg)) <= 0)
+					usage(0);
+				break;
+			case OPT_HATCH:
+				hatch = 1;
+				break;
+			case OPT_TRACE:
+				traceopen(optarg);
+				break;
+			case OPT_PERF:
+				perf = 1;
+				break;
+			case OPT_PROGRESS:
+				metering = 1;
+				if (optarg != NULL &&
+				    (meterfd = atoi(optarg)) <= 0)
+					usage(0);
+				break;
+			case OPT_MAX_READ_RATE:
+				if ((p = strstr(optarg, "/s")) != NULL &&
+				    p[2] == '\0')
+					*p = '\0';
+				if ((maxrate = parsesize(optarg)) <= 0)
+					usage(0);
+				break;
+			case OPT_IDLE:
+				demote();
+				break;
+			case OPT_DROP_BEHIND:
+				dropbehind = 1;
+				break;
+			case OPT_MEMORY_BUDGET:
+				if ((membudget = parsesize(optarg)) < 0)
+					usage(0);
+				budgeted = 1;
+				break;
+			case OPT_DIRECT:
+				direct = DIRECT_CHUNK;
+				if (optarg != NULL &&
+				    (direct = parsesize(optarg)) <= 0)
+					usage(0);
+				/* whole aligned blocks */
+				direct = (direct + DIRECT_ALIGN - 1) &
+				    ~(long long)(DIRECT_ALIGN - 1);
+				break;
+			case OPT_ASYNC_WRITE:
+				awsize = AW_BUF;
+				if (optarg != NULL &&
+				    (awsize = parsesize(optarg)) <= 0)
+					usage(0);
+				awsize = (awsize + DIRECT_ALIGN - 1) &
+				    ~(long long)(DIRECT_ALIGN - 1);
+				break;
+			case OPT_PREALLOCATE:
+				preallocate = 1;
+				break;
+			case OPT_STATS:
+				if (optarg == NULL)
+					stats = 1;
+				else if (strcmp(optarg, "json") == 0)
+					stats = 2;
+				else
+					usage(0);
+				break;
+			case OPT_COLLAPSE:
+				if ((collapse = atoi(optarg)) <= 0)
+					usage(0);
+				break;
+			case OPT_LOCATE:
+				locate = optarg;
+				break;
+			case OPT_TARGET:
+				if (ntargets == FAN_MAX) {
+					fprintf(stderr, "ERROR: at most %d "
+					    "targets\n", FAN_MAX);
+					exit(1);
+				}
+				targets[ntargets++] = optarg;
+				break;
+			case OPT_PROGRESSIVE:
+				if (optarg == NULL)
+					progressive = 1;
+				else if (strcmp(optarg, "numbered") == 0)
+					progressive = 2;
+				else
+					usage(0);
+				break;
 			case 'H':
 				hscale = 0;
 				break;
+			case 'a':
+				animate = 1;
+				break;
+			case 'b':
+				batch = 1;
+				if (outfilename == NULL || strcmp(outfilename,
+				    "dump2png.png") == 0)
+					outfilename = "%n.png";
+				break;
+			case 'd':
+				delay = atoi(optarg);
+				break;
+			case 'g':
+				if (sscanf(optarg, "%dx%d", &thumbw, &thumbh) != 2)
+					usage(0);
+				break;
 			case 'h':
 				height = atoi(optarg);
 				break;
@@ -150,15 +496,24 @@ main(int argc, char *argv[])
 			case 'M':
 				mask = 0;
 				break;
+			case 'm':
+				montcols = atoi(optarg);
+				break;
 			case 'o':
 				outfilename = optarg;
 				break;
 			case 'p':
-				pal = atopal(optarg);
+				palname = optarg;
+				break;
+			case 'P':
+				palexpr = optarg;
 				break;
 			case 's':
 				seek = atoi(optarg);
 				break;
+			case 't':
+				nthreads = atoi(optarg);
+				break;
 			case 'w':
 				width = atoi(optarg);
 				break;
@@ -170,417 +525,4668 @@ main(int argc, char *argv[])
 		}
 	}
 
-	if (width == 0 || height == 0 || skip == 0 || zoom == 0)
+	if (locate != NULL) {
+		if (optind + 2 != argc && optind + 3 != argc)
+			usage(0);
+		return (dolocate(locate, atoi(argv[optind]),
+		    atoi(argv[optind + 1]), argv[optind + 2]));
+	}
+
+	if (width <= 0 || height <= 0 || skip <= 0 || zoom <= 0 ||
+	    nthreads <= 0 || delay < 0 || delay > 65535 || montcols < 0 ||
+	    thumbw <= 0 || thumbh <= 0)
+		usage(0);
+	if (ntargets > 0 && (animate || batch || montcols || progressive ||
+	    deadline))
+		usage(0);
+	if (collapse && (animate || batch || montcols || progressive ||
+	    deadline || ntargets))
+		usage(0);
+	if (metering && (animate || montcols))
 		usage(0);
-	if (optind + 1 != argc)
+	if ((stats || perf) && (animate || batch || montcols || progressive ||
+	    deadline || ntargets || collapse || direct))
+		usage(0);
+	if (preallocate && !awsize)
+		usage(0);
+	if (direct && (animate || batch || montcols || progressive ||
+	    deadline || collapse))
+		usage(0);
+	if (animate ? optind + 2 > argc : (batch || montcols) ?
+	    optind >= argc : optind + 1 != argc)
 		usage(0);
 	infilename = argv[optind];
+	if (!budgeted)
+		membudget = cgroupbudget();
 
-	if (stat(infilename, &filestat) != 0) {
-		perror("Can't access infile");
-		return (2);
+	if ((d2p = d2p_create()) == NULL) {
+		perror("Out of memory");
+		exit(2);
+	}
+	if (palexpr != NULL) {
+		if ((result = d2p_set_palette_expr(d2p, palexpr, &pos)) ==
+		    D2P_EINVAL) {
+			fprintf(stderr, "ERROR: invalid palette expression:\n"
+			    "  %s\n  %*s^\n", palexpr, pos, "");
+			exit(3);
+		}
+		d2pcheck(result, "palette expression");
+	} else if ((custom = setpalette(d2p, palname)) < 0) {
+		fprintf(stderr, "invalid palette. See USAGE (--help).\n");
+		exit(3);
+	}
+	d2pcheck(d2p_set_width(d2p, width), "width");
+	d2pcheck(d2p_set_zoom(d2p, zoom), "zoom");
+	d2pcheck(d2p_set_skip(d2p, skip), "skip");
+	d2pcheck(d2p_set_mask(d2p, mask), "mask");
+
+	if (montcols) {
+		if ((outfile = outopen(outfilename, (long long)montcols *
+		    thumbw * thumbh * 3)) == NULL) {
+			fprintf(stderr, "ERROR: Could not write to %s\n",
+			    outfilename);
+			exit(2);
+		}
+		printf("Writing %s...\n", outfilename);
+		result = domontage(outfile, argc - optind, &argv[optind],
+		    montcols, thumbw, thumbh, d2p, seek, nthreads);
+		if (fclose(outfile) != 0) {
+			fprintf(stderr, "ERROR: Write to %s failed\n",
+			    outfilename);
+			result = 1;
+		}
+		return (result);
+	}
+
+	if (batch) {
+		return (dobatch(argc - optind, &argv[optind], outfilename,
+		    d2p, height, hscale, seek, nthreads));
+	}
+
+	if (animate) {
+		if ((anim = animopen(argc - optind, &argv[optind], &size)) ==
+		    NULL)
+			return (2);
+	} else {
+		if (stat(infilename, &filestat) != 0) {
+			perror("Can't access infile");
+			return (2);
+		}
+		size = filestat.st_size;
 	}
 
-	chrs = pal2chrs(pal);
-	int fullheight = ceil((float)(filestat.st_size /
-	    (zoom * skip * chrs)) / width);
+	chrs = d2p_get_chrs(d2p);
+	maxheight = height;
+	int fullheight = d2p_height_for(d2p, size);
 
 	if (fullheight > height) {
 		printf("Truncating height: showing %llu of %llu bytes. ",
 		    (unsigned long long)width * height * zoom * skip * chrs,
-		    (unsigned long long)filestat.st_size);
+		    (unsigned long long)size);
 		printf("Use -h to allow larger heights.\n");
 	} else {
 		if (hscale) {
 			height = fullheight;
 		}
 	}
+	/* progressive and deadline renders hold the whole image */
+	if ((progressive || deadline) && membudget > 0 &&
+	    (long long)height * (width * 3 + 1) > membudget) {
+		height = membudget / (width * 3 + 1);
+		if (height < 1)
+			height = 1;
+		printf("Truncating height to %d, to fit the memory budget.\n",
+		    height);
+	}
+	d2pcheck(d2p_set_height(d2p, height), "height");
 
 	printf("Output image: height:%d, width:%d\n", height, width);
 
-	if ((infile = open(infilename, O_RDONLY)) < 0) {
-		fprintf(stderr, "Can't read %s", infilename);
-		exit(2);
+	if (!animate) {
+		path = realpath(infilename, NULL);
+		d2pcheck(d2p_set_origin(d2p, path != NULL ? path : infilename,
+		    seek), "origin");
+		free(path);
 	}
 
-	if (seek && lseek(infile, seek, SEEK_SET) == -1) {
-		perror("Seek failed");
-		exit(2);
+	for (i = 0; i < ntargets; i++) {
+		if (fanparse(targets[i], d2p, &fand2p[i + 1],
+		    &fanout[i + 1]) != 0) {
+			fprintf(stderr, "ERROR: invalid target %s\n",
+			    targets[i]);
+			exit(1);
+		}
+		if ((fullheight = d2p_height_for(fand2p[i + 1], size)) <=
+		    maxheight && hscale)
+			d2pcheck(d2p_set_height(fand2p[i + 1], fullheight),
+			    "height");
+		else
+			d2pcheck(d2p_set_height(fand2p[i + 1], maxheight),
+			    "height");
+	}
+
+	if (!animate && !progressive && !deadline && !ntargets && !collapse &&
+	    !direct && !custom && cachedir != NULL &&
+	    cachedir[0] != '\0' &&
+	    (key = cachekey(infilename, cachehash, d2p, seek)) != NULL &&
+	    cacheget(cachedir, key, outfilename) == 0) {
+		printf("Wrote %s from cache.\n", outfilename);
+		return (0);
+	}
+
+	if (!animate) {
+		infile = open(infilename, O_RDONLY | (direct ? O_DIRECT : 0));
+		if (infile < 0 && direct && errno == EINVAL) {
+			fprintf(stderr, "WARNING: %s doesn't support direct "
+			    "I/O, reading through the page cache\n",
+			    infilename);
+			direct = 0;
+			infile = open(infilename, O_RDONLY);
+		}
+		if (infile < 0) {
+			fprintf(stderr, "Can't read %s", infilename);
+			exit(2);
+		}
+
+		if (seek && lseek(infile, seek, SEEK_SET) == -1) {
+			perror("Seek failed");
+			exit(2);
+		}
 	}
 
-	outfile = fopen(outfilename, "wb");
+	covered = (long long)height * d2p_row_stride(d2p);
+	if (covered > size - seek)
+		covered = size > seek ? size - seek : 0;
+
+	if (collapse) {
+		meterstart(covered, 0);
+		result = docollapse(d2p, infile, outfilename, seek, collapse);
+		meterstop();
+		close(infile);
+		d2p_destroy(d2p);
+		return (result);
+	}
+
+	/* direct I/O uses the fan-out reader, for its ring of buffers */
+	if (ntargets > 0 || direct) {
+		fand2p[0] = d2p;
+		fanout[0] = outfilename;
+		for (i = 1; i <= ntargets; i++) {
+			if (covered < (long long)d2p_get_height(fand2p[i]) *
+			    d2p_row_stride(fand2p[i]))
+				covered = (long long)d2p_get_height(fand2p[i]) *
+				    d2p_row_stride(fand2p[i]);
+		}
+		meterstart(covered < size - seek ? covered : size - seek,
+		    height);
+		result = dofanout(fand2p, fanout, ntargets + 1, infile,
+		    direct);
+		meterstop();
+		close(infile);
+		for (i = 0; i <= ntargets; i++)
+			d2p_destroy(fand2p[i]);
+		return (result);
+	}
+
+	if (deadline) {
+		printf("Writing %s within %.2fs...\n", outfilename, deadline);
+		meterstart(covered, height);
+		result = dodeadline(d2p, infile, outfilename, start, deadline,
+		    hatch, seek, nthreads);
+		meterstop();
+		close(infile);
+		d2p_destroy(d2p);
+		return (result);
+	}
+
+	if (progressive) {
+		printf("Writing %s progressively...\n", outfilename);
+		meterstart(covered, height);
+		result = doprogressive(d2p, infile, outfilename,
+		    progressive == 2, seek, nthreads);
+		meterstop();
+		close(infile);
+		d2p_destroy(d2p);
+		return (result);
+	}
+
+	outfile = outopen(outfilename, (long long)height * (width * 3 + 1));
 	if (outfile == NULL) {
 		fprintf(stderr, "ERROR: Could not write to %s\n", outfilename);
 		exit(2);
 	}
 
 	printf("Writing %s...\n", outfilename);
-	int result = doimage(infile, outfile, width, height, pal, skip, zoom,
-	    mask);
-	close(infile);
-	fclose(outfile);
+	if (animate) {
+		anim->d2p = d2p;
+		anim->width = width;
+		anim->height = height;
+		anim->skip = skip;
+		anim->seek = seek;
+		result = doanim(anim, outfile, delay, nthreads);
+	} else {
+		if (perf && d2p_set_perf(d2p, 1) != D2P_OK) {
+			fprintf(stderr, "WARNING: hardware counters "
+			    "unavailable (%s), continuing without them\n",
+			    strerror(errno));
+			perf = 0;
+		}
+		meterstart(covered, height);
+		if ((result = d2p_set_stats(d2p, stats != 0)) != D2P_OK ||
+		    (result = d2p_set_trace(d2p, tracing ? tracehook : NULL,
+		    NULL)) != D2P_OK ||
+		    (metering && (result = d2p_set_row_callback(d2p, meterrow,
+		    d2p)) != D2P_OK) ||
+		    (result = d2p_set_png_file(d2p, outfile)) != D2P_OK ||
+		    (result = maxrate > 0 || dropbehind ?
+		    feedpaced(d2p, infile) : d2p_feed_fd(d2p, infile, -1)) !=
+		    D2P_OK ||
+		    (result = d2p_finish(d2p)) != D2P_OK) {
+			fprintf(stderr, "ERROR: %s\n", d2p_strerror(result));
+			result = 1;
+		}
+		meterstop();
+		close(infile);
+	}
+	if (fclose(outfile) != 0) {
+		fprintf(stderr, "ERROR: Write to %s failed\n", outfilename);
+		result = 1;
+	}
+	if (result == 0 && stats)
+		printstats(d2p, outfilename, start, stats == 2);
+	if (result == 0 && perf)
+		printperf(d2p, outfilename);
+	if (result == 0 && key != NULL)
+		cacheput(cachedir, key, outfilename, cachemax);
+	d2p_destroy(d2p);
 
 	return (result);
 }
 
-static palette_t
-atopal(const char *opt)
-{
-	if (strcmp(opt, "gray") == 0)
-		return (GRAY);
-	if (strcmp(opt, "gray16b") == 0)
-		return (GRAY16B);
-	if (strcmp(opt, "gray32b") == 0)
-		return (GRAY32B);
-	if (strcmp(opt, "gray16l") == 0)
-		return (GRAY16L);
-	if (strcmp(opt, "gray32l") == 0)
-		return (GRAY32L);
-	if (strcmp(opt, "hues") == 0)
-		return (HUES);
-	if (strcmp(opt, "hues6") == 0)
-		return (HUES6);
-	if (strcmp(opt, "fhues") == 0)
-		return (FHUES);
-	if (strcmp(opt, "color") == 0)
-		return (COLOR);
-	if (strcmp(opt, "color16") == 0)
-		return (COLOR16);
-	if (strcmp(opt, "color32") == 0)
-		return (COLOR32);
-	if (strcmp(opt, "rgb") == 0)
-		return (RGB);
-	if (strcmp(opt, "dvi") == 0)
-		return (DVI);
-	if (strcmp(opt, "x86") == 0)
-		return (X86);
-	fprintf(stderr, "invalid palette. See USAGE (--help).\n");
-	exit(3);
-}
-
-static int
-pal2chrs(palette_t pal)
-{
-	switch (pal) {
-		case RGB:
-			return (3);
-		case GRAY16B:
-		case GRAY16L:
-		case COLOR16:
-			return (2);
-		case GRAY32B:
-		case GRAY32L:
-		case COLOR32:
-			return (4);
-		default:
-			return (1);
+/*
+ * Work-stealing thread pool.  Each worker has a deque of tasks: it pushes
+ * and pops its own tasks at the tail (newest first, for locality), and when
+ * it runs dry it steals from the head of the other workers' deques (oldest,
+ * usually the largest pieces of work).  Tasks may submit more tasks.  The
+ * thread that creates the pool is worker 0, and runs tasks while it waits.
+ */
+typedef struct task {
+	void		(*func)(void *);
+	void		*arg;
+} task_t;
+
+typedef struct deque {
+	pthread_mutex_t	lock;
+	task_t		*tasks;
+	int		head;		/* steal from here */
+	int		count;
+	int		size;
+} deque_t;
+
+typedef struct pool pool_t;
+
+typedef struct worker {
+	pool_t		*pool;
+	int		id;
+	pthread_t	tid;
+	void		*scratch;	/* per worker state, see pool_scratch */
+} worker_t;
+
+struct pool {
+	worker_t	*workers;
+	deque_t		*deques;
+	int		nthreads;
+	pthread_mutex_t	lock;
+	pthread_cond_t	cv;
+	long		queued;		/* tasks sitting in deques */
+	long		pending;	/* tasks submitted but not finished */
+	int		shutdown;
+	void		(*scratchfree)(void *);
+};
+
+static __thread worker_t *poolself;
+
+static int
+deque_push(deque_t *d, task_t *t)
+{
+	task_t *tasks;
+	int i;
+
+	pthread_mutex_lock(&d->lock);
+	if (d->count == d->size) {
+		if ((tasks = malloc(sizeof (task_t) * (d->size * 2 + 16))) ==
+		    NULL) {
+			pthread_mutex_unlock(&d->lock);
+			return (-1);
+		}
+		for (i = 0; i < d->count; i++)
+			tasks[i] = d->tasks[(d->head + i) % d->size];
+		free(d->tasks);
+		d->tasks = tasks;
+		d->head = 0;
+		d->size = d->size * 2 + 16;
 	}
+	d->tasks[(d->head + d->count++) % d->size] = *t;
+	pthread_mutex_unlock(&d->lock);
+	return (0);
 }
 
-inline void
-map_hues(png_byte *ptr, unsigned char val)
+static int
+deque_take(deque_t *d, task_t *t, int steal)
 {
-	int v = val * 3;
-	if (v < 256) {
-		ptr[0] = v; ptr[1] = 0; ptr[2] = 0;
-	} else if (v < 512) {
-		ptr[0] = 0; ptr[1] = v % 256; ptr[2] = 0;
-	} else {
-		ptr[0] = 0; ptr[1] = 0; ptr[2] = v % 256;
+	int found = 0;
+
+	pthread_mutex_lock(&d->lock);
+	if (d->count > 0) {
+		if (steal) {
+			*t = d->tasks[d->head];
+			d->head = (d->head + 1) % d->size;
+		} else {
+			*t = d->tasks[(d->head + d->count - 1) % d->size];
+		}
+		d->count--;
+		found = 1;
 	}
+	pthread_mutex_unlock(&d->lock);
+	return (found);
 }
 
-inline void
-map_fhues(png_byte *ptr, unsigned char val)
+static void
+pool_submit(pool_t *p, void (*func)(void *), void *arg)
 {
-	int v = val * 6;
-	if (v < 256) {
-		ptr[0] = v; ptr[1] = 0; ptr[2] = 0;
-	} else if (v < 256 * 2) {
-		ptr[0] = 255; ptr[1] = v % 256; ptr[2] = v % 256;
-	} else if (v < 256 * 3) {
-		ptr[0] = 0; ptr[1] = v % 256; ptr[2] = 0;
-	} else if (v < 256 * 4) {
-		ptr[0] = v % 256; ptr[1] = 255; ptr[2] = v % 256;
-	} else if (v < 256 * 5) {
-		ptr[0] = 0; ptr[1] = 0; ptr[2] = v % 256;
-	} else {
-		ptr[0] = v % 256; ptr[1] = v % 256; ptr[2] = 255;
+	worker_t *self = poolself;
+	task_t t;
+
+	t.func = func;
+	t.arg = arg;
+
+	pthread_mutex_lock(&p->lock);
+	p->pending++;
+	pthread_mutex_unlock(&p->lock);
+
+	if (deque_push(&p->deques[self != NULL && self->pool == p ?
+	    self->id : 0], &t) != 0) {
+		/* out of memory: run it now */
+		func(arg);
+		pthread_mutex_lock(&p->lock);
+		if (--p->pending == 0)
+			pthread_cond_broadcast(&p->cv);
+		pthread_mutex_unlock(&p->lock);
+		return;
 	}
+
+	pthread_mutex_lock(&p->lock);
+	p->queued++;
+	pthread_cond_signal(&p->cv);
+	pthread_mutex_unlock(&p->lock);
 }
 
-inline void
-map_hues6(png_byte *ptr, unsigned char val)
+/*
+ * Run tasks as worker self.  Returns when the pool is shut down, or if
+ * waiting is set, when all submitted tasks have finished.
+ */
+static void
+pool_run(pool_t *p, int self, int waiting)
 {
-	int v = val * 6;
-	if (v < 256) {
-		ptr[0] = v; ptr[1] = 0; ptr[2] = 0;
-	} else if (v < 256 * 2) {
-		ptr[0] = 0; ptr[1] = v % 256; ptr[2] = 0;
-	} else if (v < 256 * 3) {
-		ptr[0] = 0; ptr[1] = 0; ptr[2] = v % 256;
-	} else if (v < 256 * 4) {
-		ptr[0] = 0; ptr[1] = v % 256; ptr[2] = v % 256;
-	} else if (v < 256 * 5) {
-		ptr[0] = v % 256; ptr[1] = 0; ptr[2] = v % 256;
-	} else {
-		ptr[0] = v % 256; ptr[1] = v % 256; ptr[2] = 0;
+	task_t t;
+	int i, found;
+
+	for (;;) {
+		found = deque_take(&p->deques[self], &t, 0);
+		for (i = 1; !found && i < p->nthreads; i++)
+			found = deque_take(&p->deques[(self + i) %
+			    p->nthreads], &t, 1);
+
+		pthread_mutex_lock(&p->lock);
+		if (found) {
+			p->queued--;
+			pthread_mutex_unlock(&p->lock);
+			t.func(t.arg);
+			pthread_mutex_lock(&p->lock);
+			if (--p->pending == 0)
+				pthread_cond_broadcast(&p->cv);
+			pthread_mutex_unlock(&p->lock);
+			continue;
+		}
+		if (waiting ? p->pending == 0 : p->shutdown) {
+			pthread_mutex_unlock(&p->lock);
+			return;
+		}
+		if (p->queued == 0)
+			pthread_cond_wait(&p->cv, &p->lock);
+		pthread_mutex_unlock(&p->lock);
 	}
 }
 
-inline void
-map_color16(png_byte *ptr, unsigned short val)
+static void *
+pool_thread(void *arg)
+{
+	worker_t *w = arg;
+
+	poolself = w;
+	tracename("worker %d", w->id);
+	pool_run(w->pool, w->id, 0);
+	return (NULL);
+}
+
+static pool_t *
+pool_create(int nthreads, void (*scratchfree)(void *))
 {
-	ptr[0] = (val & 0xfc00) >> 8;
-	ptr[1] = (val & 0x03c0) >> 2;
-	ptr[2] = (val & 0x001f) << 3;
+	pool_t *p;
+	int i;
+
+	if ((p = calloc(1, sizeof (pool_t))) == NULL ||
+	    (p->workers = calloc(nthreads, sizeof (worker_t))) == NULL ||
+	    (p->deques = calloc(nthreads, sizeof (deque_t))) == NULL) {
+		perror("Out of memory");
+		exit(2);
+	}
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cv, NULL);
+	p->scratchfree = scratchfree;
+	p->nthreads = 1;
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_mutex_init(&p->deques[i].lock, NULL);
+		p->workers[i].pool = p;
+		p->workers[i].id = i;
+	}
+	poolself = &p->workers[0];
+
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&p->workers[i].tid, NULL, pool_thread,
+		    &p->workers[i]) != 0)
+			break;
+		p->nthreads++;
+	}
+
+	return (p);
 }
 
-inline void
-map_color32(png_byte *ptr, unsigned long val)
+static void
+pool_wait(pool_t *p)
 {
-	ptr[0] = (val & 0xff000000) >> 24;
-	ptr[1] = (val & 0x001fe000) >> 13;
-	ptr[2] = (val & 0x000001fe) >> 1;
+	pool_run(p, 0, 1);
 }
 
-inline unsigned char
-c2v_binary(unsigned char c)
+static void
+pool_destroy(pool_t *p)
 {
-	switch (c) {
-		case 0x01: return (0xff);
-		case 0x02: return (0xcf);
-		case 0x03: return (0xaf);
+	int i;
+
+	pthread_mutex_lock(&p->lock);
+	p->shutdown = 1;
+	pthread_cond_broadcast(&p->cv);
+	pthread_mutex_unlock(&p->lock);
+
+	for (i = 0; i < p->nthreads; i++) {
+		if (i > 0)
+			pthread_join(p->workers[i].tid, NULL);
+		if (p->workers[i].scratch != NULL && p->scratchfree != NULL)
+			p->scratchfree(p->workers[i].scratch);
+		free(p->deques[i].tasks);
+		pthread_mutex_destroy(&p->deques[i].lock);
 	}
-	return (0);
+	if (poolself == &p->workers[0])
+		poolself = NULL;
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->cv);
+	free(p->workers);
+	free(p->deques);
+	free(p);
+}
+
+/*
+ * Return the calling worker's scratch pointer, for state reused across
+ * tasks (buffers, compressor streams).
+ */
+static void **
+pool_scratch(pool_t *p)
+{
+	return (&poolself->scratch);
+}
+
+/*
+ * Run func(arg, i) for i in 0..njobs-1 on nthreads threads.
+ */
+typedef struct job {
+	void		(*func)(void *, int);
+	void		*arg;
+	int		index;
+} job_t;
+
+static void
+jobtask(void *arg)
+{
+	job_t *job = arg;
+
+	job->func(job->arg, job->index);
 }
 
-inline unsigned char
-c2v_english(char c)
+static void
+runjobs(void (*func)(void *, int), void *arg, int njobs, int nthreads)
 {
-	switch (c) {
-		case 'e': return (0xff);
-		case 't': return (0xcf);
-		case 'a': return (0xaf);
+	job_t *jobs;
+	pool_t *p;
+	int i;
+
+	if ((jobs = malloc(njobs * sizeof (job_t))) == NULL) {
+		perror("Out of memory");
+		exit(2);
 	}
-	return (0);
+	p = pool_create(nthreads > njobs ? njobs : nthreads, NULL);
+	for (i = njobs - 1; i >= 0; i--) {
+		jobs[i].func = func;
+		jobs[i].arg = arg;
+		jobs[i].index = i;
+		pool_submit(p, jobtask, &jobs[i]);
+	}
+	pool_wait(p);
+	pool_destroy(p);
+	free(jobs);
+}
+
+/*
+ * Palettes with state: dvi colors by the previous byte, and x86_64 by a
+ * window of them, carried from row to row.  A row rendered out of order
+ * (a band, a frame region, a progressive or deadline row) is preceded by
+ * WARM_BYTES of the rows above it, so it colors as in one render.
+ */
+static int
+stateful(const d2p_t *d2p)
+{
+	return (strcmp(d2p_get_palette(d2p), "dvi") == 0 ||
+	    strcmp(d2p_get_palette(d2p), "x86_64") == 0);
 }
 
-inline unsigned char
-c2v_x86(unsigned char c)
+/*
+ * Render the rows above row y into rgb, discarding them, to warm d2p's
+ * state for y.  Returns -1 if the render fails.
+ */
+static int
+warmrows(d2p_t *d2p, int fd, off_t seek, int skip, int y,
+    unsigned char *inbuf, unsigned char *rgb)
 {
-	switch (c) {
-		case 0x8b: return (0xff);	/* movl */
-		case 0xe8: return (0xcf);	/* call */
-		case 0x85: return (0xaf);	/* testl */
+	size_t rowbytes = d2p_row_bytes(d2p);
+	ssize_t in;
+	int w;
+
+	w = y - (WARM_BYTES + rowbytes - 1) / rowbytes;
+	for (w = w < 0 ? 0 : w; w < y; w++) {
+		throttle(rowbytes);
+		in = pread(fd, inbuf, rowbytes, seek +
+		    (off_t)w * rowbytes * skip);
+		if (in < 0)
+			in = 0;
+		if (d2p_render_row(d2p, inbuf, in, rgb) != D2P_OK)
+			return (-1);
 	}
 	return (0);
 }
 
+/*
+ * Animated PNG (APNG) output.  Each input file is a frame.  The first frame
+ * is the full image; following frames only carry the pixels whose input
+ * bytes differ from the previous file, found by comparing the inputs a page
+ * at a time.  Changed rows less than APNG_GAP rows apart form a cluster.  A
+ * frame covers the bounding box of its clusters and is blended over the
+ * previous one: the image is RGBA, and only each cluster's own box is
+ * opaque, so the rows between clusters are transparent zeros that cost
+ * next to nothing to deflate.  Unchanged areas are never colorized.  Frames
+ * are encoded in parallel into temporary files, then written out in order
+ * with their sequence numbers.
+ */
+#define	APNG_PAGE	4096		/* input compare granularity */
+#define	APNG_CHUNK	(1024 * 1024)	/* max IDAT/fdAT payload */
+#define	APNG_GAP	8		/* unchanged rows that split a cluster */
+#define	APNG_RECTS	64		/* max clusters per frame */
+
 static void
-map_x86(unsigned char *rgb, unsigned char c)
+put32(unsigned char *p, unsigned long v)
 {
-	rgb[0] = rgb[1] = rgb[2] = 0;
+	p[0] = (v >> 24) & 0xff;
+	p[1] = (v >> 16) & 0xff;
+	p[2] = (v >> 8) & 0xff;
+	p[3] = v & 0xff;
+}
 
-	rgb[0] = c2v_x86(c);
-	rgb[1] = c2v_english(c);
-	rgb[2] = c2v_binary(c);
+static unsigned long
+get32(const unsigned char *p)
+{
+	return ((unsigned long)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]);
+}
 
-	/* default to grayscale */
-	if ((rgb[0] + rgb[1] + rgb[2]) == 0) {
-		rgb[0] = rgb[1] = rgb[2] = c;
-	}
+static void
+put16(unsigned char *p, unsigned int v)
+{
+	p[0] = (v >> 8) & 0xff;
+	p[1] = v & 0xff;
 }
 
-#define	BYTE_MASK	0xfe
+/*
+ * Write a png chunk.  hdr is an optional prefix to data (eg, the fdAT
+ * sequence number), covered by the same length and crc.
+ */
+static int
+writechunk(FILE *out, const char *type, const unsigned char *hdr, int hlen,
+    const unsigned char *data, size_t len)
+{
+	unsigned char buf[8];
+	unsigned long crc;
+
+	put32(buf, hlen + len);
+	memcpy(&buf[4], type, 4);
+	crc = crc32(0, (const Bytef *)type, 4);
+	if (hlen)
+		crc = crc32(crc, hdr, hlen);
+	if (len)
+		crc = crc32(crc, data, len);
+	if (fwrite(buf, 1, 8, out) != 8 ||
+	    (hlen && fwrite(hdr, 1, hlen, out) != hlen) ||
+	    (len && fwrite(data, 1, len, out) != len))
+		return (-1);
+	put32(buf, crc);
+	return (fwrite(buf, 1, 4, out) == 4 ? 0 : -1);
+}
 
+/*
+ * Find the clusters of pixels that differ between frame i-1 and i, as
+ * f->rects.  Returns the number found, 0 if the inputs are the same.
+ */
 static int
-doimage(int infile, FILE *outfile, int width, int height, palette_t pal,
-    int skip, int zoom, int mask)
+animdiff(anim_t *a, int i, unsigned char *prev, unsigned char *cur)
 {
-	png_text pngtitle;
-	png_structp pngstruct;
-	png_infop pnginfo;
-	png_bytep pngbyte;
-	unsigned char last, rgb[3], *inbuf;
-	int in, xx, x, y, z, chrs, i = 0, code = 1;
-	unsigned long sum[3];
-
-	/* setup png */
-	pngbyte = (png_bytep)malloc(width * skip * zoom * sizeof (png_byte) *
-	    3);
-	pngstruct = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL,
-	    NULL);
-	pnginfo = png_create_info_struct(pngstruct);
-	chrs = pal2chrs(pal);
-	inbuf = (char *)malloc(width * skip * zoom * chrs);
+	frame_t *f = &a->frames[i];
+	int rowbytes = d2p_row_bytes(a->d2p);
+	int pixbytes = rowbytes / a->width;
+	int y, p, len, inp, inc, np, nc, x0, x1, warm = 0;
+	rect_t *r;
+	off_t off;
 
-	if (pngbyte == NULL | pngstruct == NULL | pnginfo == NULL |
-	    inbuf == NULL) {
-		perror("Out of memory");
-		goto out;
+	/* DVI and x86_64 carry state across pixels and rows */
+	if (stateful(a->d2p))
+		warm = (WARM_BYTES + rowbytes - 1) / rowbytes;
+
+	f->nrects = 0;
+	for (y = 0; y < a->height; y++) {
+		off = a->seek + (off_t)y * rowbytes * a->skip;
+		throttle(2 * rowbytes);
+		inp = pread(a->frames[i - 1].fd, prev, rowbytes, off);
+		inc = pread(f->fd, cur, rowbytes, off);
+		if (inp < 0)
+			inp = 0;
+		if (inc < 0)
+			inc = 0;
+		if (inp == 0 && inc == 0)
+			break;
+
+		x0 = a->width;
+		x1 = -1;
+		for (p = 0; p < rowbytes; p += APNG_PAGE) {
+			len = rowbytes - p < APNG_PAGE ? rowbytes - p :
+			    APNG_PAGE;
+			/* bytes past EOF in only one file count as changed */
+			np = inp - p < 0 ? 0 : inp - p < len ? inp - p : len;
+			nc = inc - p < 0 ? 0 : inc - p < len ? inc - p : len;
+			if (np == nc && memcmp(&prev[p], &cur[p], np) == 0)
+				continue;
+			if (p / pixbytes < x0)
+				x0 = p / pixbytes;
+			if ((p + len - 1) / pixbytes > x1)
+				x1 = (p + len - 1) / pixbytes;
+		}
+		if (x1 < 0)
+			continue;
+		if (x1 >= a->width)
+			x1 = a->width - 1;
+		if (warm) {
+			x0 = 0;
+			x1 = a->width - 1;
+		}
+
+		/* join the last cluster if near it (or out of sub-frames) */
+		r = f->nrects > 0 ? &f->rects[f->nrects - 1] : NULL;
+		if (r != NULL && (y - (r->y + r->h) < APNG_GAP + warm ||
+		    f->nrects == APNG_RECTS)) {
+			if (x1 >= r->x + r->w)
+				r->w = x1 - r->x + 1;
+			if (x0 < r->x) {
+				r->w += r->x - x0;
+				r->x = x0;
+			}
+			r->h = y - r->y + 1;
+			continue;
+		}
+		r = &f->rects[f->nrects++];
+		r->x = x0;
+		r->y = y;
+		r->w = x1 - x0 + 1;
+		r->h = 1;
 	}
 
-	if (setjmp(png_jmpbuf(pngstruct))) {
-		perror("Error during png creation");
-		goto out;
+	/* a change colors the state's reach of rows below it, too */
+	for (p = 0; p < f->nrects; p++) {
+		r = &f->rects[p];
+		r->h += warm;
+		if (r->y + r->h > a->height)
+			r->h = a->height - r->y;
 	}
+	return (f->nrects);
+}
 
-	png_init_io(pngstruct, outfile);
-	png_set_IHDR(pngstruct, pnginfo, width, height, 8, PNG_COLOR_TYPE_RGB,
-	    PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE,
-	    PNG_FILTER_TYPE_BASE);
+/*
+ * Colorize and deflate the region of frame i into a temporary file.
+ */
+static void
+animframe(void *arg, int i)
+{
+	anim_t *a = arg;
+	frame_t *f = &a->frames[i];
+	int rowbytes = d2p_row_bytes(a->d2p);
+	unsigned char *inbuf, *prev, *rgb, *pngbyte, *zbuf, *px;
+	int k, x, y, in, flush, ret = Z_OK;
+	rect_t *r;
+	d2p_t *d2p;
+	z_stream zs;
+	uint64_t t = traceb();
 
-	pngtitle.compression = PNG_TEXT_COMPRESSION_NONE;
-	pngtitle.key = "Title";
-	pngtitle.text = "dump2png";
-	png_set_text(pngstruct, pnginfo, &pngtitle, 1);
+	f->error = 1;
+	d2p = d2p_clone(a->d2p);
+	inbuf = malloc(rowbytes);
+	prev = malloc(rowbytes);
+	rgb = malloc(a->width * 3);
+	pngbyte = malloc(a->width * 4 + 1);
+	zbuf = malloc(APNG_CHUNK);
+	f->rects = malloc(APNG_RECTS * sizeof (rect_t));
+	if (d2p == NULL || inbuf == NULL || prev == NULL || rgb == NULL ||
+	    pngbyte == NULL || zbuf == NULL || f->rects == NULL) {
+		perror("Out of memory");
+		goto out;
+	}
 
-	png_write_info(pngstruct, pnginfo);
+	f->nrects = 1;
+	f->rects[0].x = f->rects[0].y = 0;
+	f->rects[0].w = a->width;
+	f->rects[0].h = a->height;
+	if (i > 0 && animdiff(a, i, prev, inbuf) == 0) {
+		/* nothing changed: one transparent pixel */
+		f->nrects = 0;
+		f->x = f->y = 0;
+		f->w = f->h = 1;
+	} else {
+		f->x = a->width;
+		f->w = 0;
+		for (k = 0; k < f->nrects; k++) {
+			r = &f->rects[k];
+			if (r->x < f->x)
+				f->x = r->x;
+			if (r->x + r->w > f->w)
+				f->w = r->x + r->w;
+		}
+		f->w -= f->x;
+		f->y = f->rects[0].y;
+		r = &f->rects[f->nrects - 1];
+		f->h = r->y + r->h - f->y;
+	}
 
-	/*
-	 * Read data and convert to png image.  x tracks the destination pixel
-	 * x offset.  xx tracks the offset in the input buffer, which can step
-	 * at a faster rate when it's necessary to combine multiple bytes into
-	 * one pixel (with zoom or certain palettes).
-	 */
-	for (y = 0; y < height; y++) {
-		in = read(infile, inbuf, width * chrs * skip * zoom);
+	if ((f->data = tmpfile()) == NULL) {
+		perror("Can't create temporary file");
+		goto out;
+	}
 
-		for (x = 0, xx = 0; x < width; x++) {
-			if (xx + chrs > in) {
-				(&pngbyte[x * 3])[0] = 0;
-				(&pngbyte[x * 3])[1] = 0;
-				(&pngbyte[x * 3])[2] = 0;
-				continue;
-			}
+	memset(&zs, 0, sizeof (zs));
+	if (deflateInit(&zs, Z_DEFAULT_COMPRESSION) != Z_OK) {
+		fprintf(stderr, "ERROR: deflateInit failed\n");
+		goto out;
+	}
 
-			sum[0] = sum[1] = sum[2] = 0;
-
-			for (z = 0; z < zoom; z++, xx++) {
-				switch (pal) {
-					case GRAY:
-						rgb[0] = inbuf[xx];
-						rgb[1] = inbuf[xx];
-						rgb[2] = inbuf[xx];
-						break;
-					/*
-					 * Gray 16|32 skip bytes and map
-					 * significant byte to grayscale.
-					 */
-					case GRAY16B:
-						rgb[0] = inbuf[xx];
-						rgb[1] = inbuf[xx];
-						rgb[2] = inbuf[xx++];
-						break;
-					case GRAY32B:
-						rgb[0] = inbuf[xx];
-						rgb[1] = inbuf[xx];
-						rgb[2] = inbuf[xx];
-						xx += 3;
-						break;
-					case GRAY16L:
-						rgb[0] = inbuf[++xx];
-						rgb[1] = inbuf[xx];
-						rgb[2] = inbuf[xx];
-						break;
-					case GRAY32L:
-						xx += 3;
-						rgb[0] = inbuf[xx];
-						rgb[1] = inbuf[xx];
-						rgb[2] = inbuf[xx];
-						break;
-					case HUES:
-						map_hues(&rgb[0], inbuf[xx]);
-						break;
-					case HUES6:
-						map_hues6(&rgb[0], inbuf[xx]);
-						break;
-					case FHUES:
-						map_fhues(&rgb[0], inbuf[xx]);
-						break;
-					/*
-					 * Color palettes mask and shifts bits
-					 * into RGB
-					 */
-					case COLOR:
-						rgb[0] = inbuf[xx] & 0xe0;
-						rgb[1] = (inbuf[xx] & 0x1c) <<
-						    3;
-						rgb[2] = (inbuf[xx] & 0x03) <<
-						    6;
-						break;
-					case COLOR16:
-						map_color16(&rgb[0],
-						    inbuf[xx++] +
-						    (inbuf[xx] << 8));
-						break;
-					case COLOR32:
-						map_color32(&rgb[0],
-						    inbuf[xx++] +
-						    (inbuf[xx++] << 8) +
-						    (inbuf[xx++] << 16) +
-						    (inbuf[xx] << 24));
-						break;
-					/*
-					 * RGB uses sequential bytes for RGB
-					 */
-					case RGB:
-						rgb[0] = inbuf[xx++];
-						rgb[1] = inbuf[xx++];
-						rgb[2] = inbuf[xx];
-						break;
-					case X86:
-						map_x86(&rgb[0], inbuf[xx]);
-						break;
-					case DVI:
-						rgb[0] = abs(inbuf[xx] - last);
-						rgb[1] = inbuf[xx];
-						rgb[2] = (inbuf[xx] + last) / 2;
-						break;
-					default:
-						fprintf(stderr, "palette?\n");
-						goto out;
-				}
+	for (k = 0, y = f->y; ret == Z_OK && y < f->y + f->h; y++) {
+		/* the cluster holding row y, if any */
+		while (k < f->nrects && y >= f->rects[k].y + f->rects[k].h)
+			k++;
+		r = k < f->nrects && y >= f->rects[k].y ? &f->rects[k] : NULL;
 
-				if (zoom > 1) {
-					sum[0] += rgb[0];
-					sum[1] += rgb[1];
-					sum[2] += rgb[2];
-				}
+		/* filter type none, then transparent pixels */
+		memset(pngbyte, 0, f->w * 4 + 1);
+		if (r != NULL) {
+			/* the rows above warm up palettes with state */
+			if (y == r->y && stateful(d2p) && warmrows(d2p, f->fd,
+			    a->seek, a->skip, y, inbuf, rgb) != 0)
+				break;
+			throttle(rowbytes);
+			in = pread(f->fd, inbuf, rowbytes, a->seek +
+			    (off_t)y * rowbytes * a->skip);
+			if (in < 0)
+				in = 0;
+			if (d2p_render_row(d2p, inbuf, in, rgb) != D2P_OK)
+				break;
+			for (x = r->x; x < r->x + r->w; x++) {
+				px = &pngbyte[1 + (x - f->x) * 4];
+				px[0] = rgb[x * 3];
+				px[1] = rgb[x * 3 + 1];
+				px[2] = rgb[x * 3 + 2];
+				px[3] = 0xff;
 			}
+		}
 
-			if (zoom > 1) {
-				rgb[0] = sum[0] / zoom;
-				rgb[1] = sum[1] / zoom;
-				rgb[2] = sum[2] / zoom;
+		zs.next_in = pngbyte;
+		zs.avail_in = f->w * 4 + 1;
+		flush = (y == f->y + f->h - 1) ? Z_FINISH : Z_NO_FLUSH;
+		do {
+			zs.next_out = zbuf;
+			zs.avail_out = APNG_CHUNK;
+			ret = deflate(&zs, flush);
+			if (fwrite(zbuf, 1, APNG_CHUNK - zs.avail_out,
+			    f->data) != APNG_CHUNK - zs.avail_out) {
+				perror("Temporary file write failed");
+				ret = Z_ERRNO;
+				break;
 			}
+		} while (zs.avail_out == 0 || (flush == Z_FINISH &&
+		    ret == Z_OK));
+		if (ret == Z_STREAM_END)
+			ret = Z_OK;
+	}
+	deflateEnd(&zs);
 
-			if (mask) {
-				rgb[0] = rgb[0] & BYTE_MASK;
-				rgb[1] = rgb[1] & BYTE_MASK;
-				rgb[2] = rgb[2] & BYTE_MASK;
-			}
+	if (ret == Z_OK && y == f->y + f->h)
+		f->error = 0;
+	tracee("frame", t, i);
+out:
+	d2p_destroy(d2p);
+	free(inbuf);
+	free(prev);
+	free(rgb);
+	free(pngbyte);
+	free(zbuf);
+}
+
+static int
+doanim(anim_t *a, FILE *outfile, int delay, int nthreads)
+{
+	static const unsigned char sig[8] =
+	    { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	unsigned char hdr[26], *buf;
+	unsigned long seq = 0;
+	frame_t *f;
+	size_t len;
+	int i, code = 1;
+
+	if ((buf = malloc(APNG_CHUNK)) == NULL) {
+		perror("Out of memory");
+		return (1);
+	}
 
-			(&pngbyte[x * 3])[0] = rgb[0];
-			(&pngbyte[x * 3])[1] = rgb[1];
-			(&pngbyte[x * 3])[2] = rgb[2];
+	/* each frame job: a deflate stream, its buffer, and four rows */
+	runjobs(animframe, a, a->nframes, fitthreads(nthreads, ZMEM +
+	    APNG_CHUNK + 2LL * d2p_row_bytes(a->d2p) + 7LL * a->width, 0));
 
-			last = inbuf[x];
+	for (i = 0; i < a->nframes; i++) {
+		if (a->frames[i].error) {
+			fprintf(stderr, "ERROR: Could not encode frame %s\n",
+			    a->frames[i].name);
+			goto out;
 		}
-		png_write_row(pngstruct, pngbyte);
 	}
 
-	png_write_end(pngstruct, NULL);
-	code = 0;
+	if (fwrite(sig, 1, 8, outfile) != 8)
+		goto werr;
 
-out:
-	if (pnginfo != NULL)
-		png_free_data(pngstruct, pnginfo, PNG_FREE_ALL, -1);
-	if (pngstruct != NULL)
-		png_destroy_write_struct(&pngstruct, (png_infopp) NULL);
-	if (pngbyte != NULL)
-		free(pngbyte);
+	/* IHDR: 8-bit RGBA, deflate, adaptive filtering, no interlace */
+	put32(&hdr[0], a->width);
+	put32(&hdr[4], a->height);
+	hdr[8] = 8;
+	hdr[9] = PNG_COLOR_TYPE_RGB_ALPHA;
+	hdr[10] = hdr[11] = hdr[12] = 0;
+	if (writechunk(outfile, "IHDR", NULL, 0, hdr, 13) != 0)
+		goto werr;
+
+	/* acTL: frame count, loop forever */
+	put32(&hdr[0], a->nframes);
+	put32(&hdr[4], 0);
+	if (writechunk(outfile, "acTL", NULL, 0, hdr, 8) != 0)
+		goto werr;
+
+	if (writechunk(outfile, "tEXt", NULL, 0,
+	    (const unsigned char *)"Title\0dump2png", 14) != 0)
+		goto werr;
+
+	for (i = 0; i < a->nframes; i++) {
+		f = &a->frames[i];
+
+		/*
+		 * fcTL: region, delay, dispose none, blend source for the
+		 * first frame and over the previous (through the transparent
+		 * pixels) after it.
+		 */
+		put32(&hdr[0], seq++);
+		put32(&hdr[4], f->w);
+		put32(&hdr[8], f->h);
+		put32(&hdr[12], f->x);
+		put32(&hdr[16], f->y);
+		put16(&hdr[20], delay);
+		put16(&hdr[22], 1000);
+		hdr[24] = 0;
+		hdr[25] = i == 0 ? 0 : 1;
+		if (writechunk(outfile, "fcTL", NULL, 0, hdr, 26) != 0)
+			goto werr;
+
+		rewind(f->data);
+		while ((len = fread(buf, 1, APNG_CHUNK, f->data)) > 0) {
+			if (i == 0) {
+				if (writechunk(outfile, "IDAT", NULL, 0, buf,
+				    len) != 0)
+					goto werr;
+			} else {
+				put32(hdr, seq++);
+				if (writechunk(outfile, "fdAT", hdr, 4, buf,
+				    len) != 0)
+					goto werr;
+			}
+		}
+	}
+
+	if (writechunk(outfile, "IEND", NULL, 0, NULL, 0) != 0)
+		goto werr;
+	code = 0;
+	goto out;
+
+werr:
+	perror("Write failed");
+out:
+	for (i = 0; i < a->nframes; i++) {
+		if (a->frames[i].data != NULL)
+			fclose(a->frames[i].data);
+		free(a->frames[i].rects);
+	}
+	free(buf);
+	return (code);
+}
+
+/*
+ * Open the frame input files, and return the largest file size.
+ */
+static anim_t *
+animopen(int nfiles, char **files, off_t *maxsize)
+{
+	struct stat filestat;
+	anim_t *a;
+	int i;
+
+	if ((a = calloc(1, sizeof (anim_t))) == NULL ||
+	    (a->frames = calloc(nfiles, sizeof (frame_t))) == NULL) {
+		perror("Out of memory");
+		return (NULL);
+	}
+	a->nframes = nfiles;
+	*maxsize = 0;
+
+	for (i = 0; i < nfiles; i++) {
+		a->frames[i].name = files[i];
+		if ((a->frames[i].fd = open(files[i], O_RDONLY)) < 0 ||
+		    fstat(a->frames[i].fd, &filestat) != 0) {
+			fprintf(stderr, "Can't read %s\n", files[i]);
+			return (NULL);
+		}
+		if (filestat.st_size > *maxsize)
+			*maxsize = filestat.st_size;
+	}
+
+	return (a);
+}
+
+/*
+ * Batch mode: render many input files in one process.  Files are scheduled
+ * on a work-stealing pool.  Large files are split into bands of rows which
+ * are colorized and deflated in parallel, then stitched into one zlib
+ * stream (each band but the last ends with a sync flush, and the band
+ * checksums are combined).  Small files are packed several to a task.
+ * Each worker keeps its buffers and deflate stream across tasks.  Each band
+ * renders with a fresh context, first fed the WARM_BYTES of rows above
+ * it, so palettes with state (dvi, x86_64's window) carry across the
+ * band boundary as they would in one render.
+ */
+#define	BATCH_BAND	(4 * 1024 * 1024)	/* input bytes per band */
+#define	BATCH_BAND_MIN	(64 * 1024)	/* smallest, for --memory-budget */
+#define	BANDMEM(bt, band)	((long long)(bt)->rowbytes + \
+	    ((band) / (bt)->rowbytes + 1) * ((bt)->width * 3 + 1))
+
+typedef struct batch batch_t;
+typedef struct bfile bfile_t;
+
+typedef struct band {
+	bfile_t		*file;
+	int		y0, y1;		/* rows [y0, y1) */
+	unsigned char	*data;		/* raw deflate output */
+	size_t		len, size;
+	unsigned long	adler;		/* of the filtered rows */
+	unsigned long	rawlen;
+} band_t;
+
+struct bfile {
+	batch_t		*batch;
+	char		*name;
+	char		*outname;
+	int		fd;
+	off_t		size;
+	int		height;
+	int		nbands;
+	band_t		*bands;
+	int		remaining;	/* bands still encoding */
+	int		error;
+	long long	expect;		/* input bytes --progress counted */
+	long long	covered;	/* input bytes the image shows */
+};
+
+typedef struct bpack {
+	batch_t		*batch;
+	int		first;
+	int		count;
+} bpack_t;
+
+struct batch {
+	pool_t		*pool;
+	bfile_t		*files;
+	int		nfiles;
+	d2p_t		*d2p;		/* settings for each file */
+	int		width, height, hscale, skip;
+	int		rowbytes;
+	int		band;		/* input bytes per band */
+	off_t		seek;
+	int		errors;
+};
+
+typedef struct encoder {
+	z_stream	zs;
+	unsigned char	*inbuf;
+	unsigned char	*pngbyte;
+	int		width;
+	int		rowbytes;
+} encoder_t;
+
+static void
+encoder_free(void *arg)
+{
+	encoder_t *enc = arg;
+
+	deflateEnd(&enc->zs);
+	free(enc->inbuf);
+	free(enc->pngbyte);
+	free(enc);
+}
+
+static encoder_t *
+encoder_get(pool_t *p, int width, int rowbytes)
+{
+	void **scratch = pool_scratch(p);
+	encoder_t *enc = *scratch;
+
+	if (enc == NULL) {
+		if ((enc = calloc(1, sizeof (encoder_t))) == NULL)
+			return (NULL);
+		if (deflateInit2(&enc->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+		    -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			free(enc);
+			return (NULL);
+		}
+		*scratch = enc;
+	} else {
+		deflateReset(&enc->zs);
+	}
+
+	if (enc->rowbytes < rowbytes) {
+		free(enc->inbuf);
+		enc->inbuf = malloc(rowbytes);
+		enc->rowbytes = enc->inbuf == NULL ? 0 : rowbytes;
+	}
+	if (enc->width < width) {
+		free(enc->pngbyte);
+		enc->pngbyte = malloc(width * 3 + 1);
+		enc->width = enc->pngbyte == NULL ? 0 : width;
+	}
+	if (enc->inbuf == NULL || enc->pngbyte == NULL)
+		return (NULL);
+	return (enc);
+}
+
+/*
+ * Apply the png "sub" filter to a row of rgb pixels, in place.  The filter
+ * type byte precedes the row.
+ */
+static void
+pngfilter(unsigned char *row, int width)
+{
+	int i;
+
+	for (i = width * 3; i > 3; i--)
+		row[i] -= row[i - 3];
+	row[0] = 1;
+}
+
+static int
+deflateout(z_stream *zs, band_t *b, int flush)
+{
+	unsigned char *data;
+	int ret;
+
+	do {
+		if (b->size - b->len < 64 * 1024) {
+			if ((data = realloc(b->data, b->size * 2 + 256 * 1024))
+			    == NULL)
+				return (-1);
+			b->data = data;
+			b->size = b->size * 2 + 256 * 1024;
+		}
+		zs->next_out = &b->data[b->len];
+		zs->avail_out = b->size - b->len;
+		ret = deflate(zs, flush);
+		b->len = b->size - zs->avail_out;
+		if (ret == Z_STREAM_ERROR)
+			return (-1);
+	} while (zs->avail_out == 0 || (flush == Z_FINISH &&
+	    ret != Z_STREAM_END));
+
+	return (0);
+}
+
+static int
+encband(band_t *b)
+{
+	bfile_t *f = b->file;
+	batch_t *bt = f->batch;
+	int rowbytes = bt->rowbytes;
+	encoder_t *enc;
+	d2p_t *d2p;
+	int y, in, code = -1;
+
+	if ((enc = encoder_get(bt->pool, bt->width, rowbytes)) == NULL ||
+	    (d2p = d2p_clone(bt->d2p)) == NULL)
+		return (-1);
+
+	b->adler = adler32(0, NULL, 0);
+	b->rawlen = 0;
+	y = b->y0 - (WARM_BYTES + rowbytes - 1) / rowbytes;
+	for (y = y < 0 ? 0 : y; y < b->y1; y++) {
+		in = pread(f->fd, enc->inbuf, rowbytes, bt->seek +
+		    (off_t)y * rowbytes * bt->skip);
+		if (in < 0)
+			in = 0;
+		if (d2p_render_row(d2p, enc->inbuf, in,
+		    &enc->pngbyte[1]) != D2P_OK)
+			goto out;
+		if (y < b->y0)
+			continue;
+		pngfilter(enc->pngbyte, bt->width);
+
+		b->adler = adler32(b->adler, enc->pngbyte, bt->width * 3 + 1);
+		b->rawlen += bt->width * 3 + 1;
+		enc->zs.next_in = enc->pngbyte;
+		enc->zs.avail_in = bt->width * 3 + 1;
+		if (deflateout(&enc->zs, b, Z_NO_FLUSH) != 0)
+			goto out;
+	}
+
+	code = deflateout(&enc->zs, b, b == &f->bands[f->nbands - 1] ?
+	    Z_FINISH : Z_SYNC_FLUSH);
+out:
+	d2p_destroy(d2p);
+	return (code);
+}
+
+/*
+ * Write the coordinate map chunk for a batch file.
+ */
+static int
+bfile_map(bfile_t *f, FILE *out)
+{
+	unsigned char *buf = NULL;
+	char *path;
+	size_t len;
+	d2p_t *d2p;
+	int code = -1;
 
+	if ((d2p = d2p_clone(f->batch->d2p)) == NULL)
+		return (-1);
+	path = realpath(f->name, NULL);
+	if (d2p_set_origin(d2p, path != NULL ? path : f->name,
+	    f->batch->seek) == D2P_OK &&
+	    (buf = malloc(len = d2p_map_chunk(d2p, NULL, 0))) != NULL) {
+		(void) d2p_map_chunk(d2p, buf, len);
+		code = writechunk(out, D2P_MAP_CHUNK, NULL, 0, buf, len);
+	}
+	free(buf);
+	free(path);
+	d2p_destroy(d2p);
 	return (code);
 }
+
+/*
+ * Write the png for a file whose bands have all been encoded.
+ */
+static void
+bfile_write(bfile_t *f)
+{
+	batch_t *bt = f->batch;
+	unsigned char hdr[13];
+	unsigned long adler;
+	long long expect;
+	FILE *out;
+	int i;
+
+	if (f->error)
+		goto err;
+	for (expect = 1024, i = 0; i < f->nbands; i++)
+		expect += f->bands[i].len + 12;
+	if ((out = outopen(f->outname, expect)) == NULL) {
+		fprintf(stderr, "ERROR: Could not write to %s\n", f->outname);
+		goto err;
+	}
+
+	put32(&hdr[0], bt->width);
+	put32(&hdr[4], f->height);
+	hdr[8] = 8;
+	hdr[9] = PNG_COLOR_TYPE_RGB;
+	hdr[10] = hdr[11] = hdr[12] = 0;
+	if (fwrite("\211PNG\r\n\032\n", 1, 8, out) != 8 ||
+	    writechunk(out, "IHDR", NULL, 0, hdr, 13) != 0 ||
+	    writechunk(out, "tEXt", NULL, 0,
+	    (const unsigned char *)"Title\0dump2png", 14) != 0 ||
+	    bfile_map(f, out) != 0)
+		goto werr;
+
+	/* zlib header: deflate, 32k window, default compression */
+	hdr[0] = 0x78;
+	hdr[1] = 0x9c;
+	adler = f->bands[0].adler;
+	for (i = 0; i < f->nbands; i++) {
+		if (i > 0)
+			adler = adler32_combine(adler, f->bands[i].adler,
+			    f->bands[i].rawlen);
+		if (writechunk(out, "IDAT", hdr, i == 0 ? 2 : 0,
+		    f->bands[i].data, f->bands[i].len) != 0)
+			goto werr;
+	}
+	put32(hdr, adler);
+	if (writechunk(out, "IDAT", NULL, 0, hdr, 4) != 0 ||
+	    writechunk(out, "IEND", NULL, 0, NULL, 0) != 0)
+		goto werr;
+	if (fclose(out) != 0) {
+		out = NULL;
+		goto werr;
+	}
+	printf("Wrote %s (%dx%d)\n", f->outname, bt->width, f->height);
+	goto out;
+
+werr:
+	fprintf(stderr, "ERROR: Write to %s failed\n", f->outname);
+	if (out != NULL)
+		fclose(out);
+err:
+	__sync_fetch_and_add(&bt->errors, 1);
+out:
+	for (i = 0; i < f->nbands; i++)
+		free(f->bands[i].data);
+	free(f->bands);
+	f->bands = NULL;
+	close(f->fd);
+}
+
+static void
+bandtask(void *arg)
+{
+	band_t *b = arg;
+	bfile_t *f = b->file;
+	long long stride = (long long)f->batch->rowbytes * f->batch->skip;
+	long long lo, hi;
+	uint64_t t = traceb();
+
+	throttle((long long)(b->y1 - b->y0) * f->batch->rowbytes);
+	if (encband(b) != 0)
+		f->error = 1;
+	dropcache(f->fd, f->batch->seek + b->y0 * stride,
+	    (b->y1 - b->y0) * stride);
+	tracee("encode band", t, b->y0);
+	lo = (long long)b->y0 * stride;
+	hi = (long long)b->y1 * stride;
+	meteradd((hi < f->covered ? hi : f->covered) -
+	    (lo < f->covered ? lo : f->covered), b->y1 - b->y0);
+	/* the last band to finish writes the file */
+	if (__sync_sub_and_fetch(&f->remaining, 1) == 0) {
+		t = traceb();
+		bfile_write(f);
+		tracee("write png", t, -1);
+	}
+}
+
+/*
+ * Open a file and size its image and bands.  Returns the number of bands,
+ * or 0 on error.
+ */
+static int
+bfile_open(bfile_t *f)
+{
+	batch_t *bt = f->batch;
+	struct stat filestat;
+	int bandrows, fullheight, i;
+
+	if ((f->fd = open(f->name, O_RDONLY)) < 0 ||
+	    fstat(f->fd, &filestat) != 0) {
+		fprintf(stderr, "Can't read %s\n", f->name);
+		if (f->fd >= 0)
+			close(f->fd);
+		__sync_fetch_and_add(&bt->errors, 1);
+		metertotal(-f->expect);
+		return (0);
+	}
+	f->size = filestat.st_size;
+
+	fullheight = d2p_height_for(bt->d2p, f->size);
+	f->height = bt->height;
+	if (fullheight <= bt->height && bt->hscale)
+		f->height = fullheight;
+	if (f->height < 1)
+		f->height = 1;
+
+	bandrows = bt->band / bt->rowbytes;
+	if (bandrows < 1)
+		bandrows = 1;
+	f->nbands = (f->height + bandrows - 1) / bandrows;
+	if ((f->bands = calloc(f->nbands, sizeof (band_t))) == NULL) {
+		perror("Out of memory");
+		close(f->fd);
+		__sync_fetch_and_add(&bt->errors, 1);
+		metertotal(-f->expect);
+		return (0);
+	}
+
+	/* the image may show less of the file than --progress expected */
+	f->covered = (long long)f->height * bt->rowbytes * bt->skip;
+	if (f->covered > f->size - bt->seek)
+		f->covered = f->size > bt->seek ? f->size - bt->seek : 0;
+	metertotal(f->covered - f->expect);
+	for (i = 0; i < f->nbands; i++) {
+		f->bands[i].file = f;
+		f->bands[i].y0 = i * bandrows;
+		f->bands[i].y1 = (i + 1) * bandrows > f->height ? f->height :
+		    (i + 1) * bandrows;
+	}
+	f->remaining = f->nbands;
+
+	return (f->nbands);
+}
+
+static void
+bfiletask(void *arg)
+{
+	bfile_t *f = arg;
+	int i;
+
+	if (bfile_open(f) == 0)
+		return;
+	/* submit in reverse, so this worker starts on the first band */
+	for (i = f->nbands - 1; i > 0; i--)
+		pool_submit(f->batch->pool, bandtask, &f->bands[i]);
+	bandtask(&f->bands[0]);
+}
+
+static void
+bpacktask(void *arg)
+{
+	bpack_t *pk = arg;
+	bfile_t *f;
+	int i, b;
+
+	for (i = pk->first; i < pk->first + pk->count; i++) {
+		f = &pk->batch->files[i];
+		if (bfile_open(f) == 0)
+			continue;
+		for (b = 0; b < f->nbands; b++)
+			bandtask(&f->bands[b]);
+	}
+}
+
+/*
+ * Expand an output name template: %n is the input file's base name, %i
+ * the input's index, and %% a percent sign.
+ */
+static char *
+outtemplate(const char *tmpl, const char *name, int index)
+{
+	const char *base, *s;
+	char *out, *o;
+	size_t len;
+
+	base = (base = strrchr(name, '/')) == NULL ? name : base + 1;
+	len = strlen(tmpl) + 1;
+	for (s = tmpl; *s != '\0'; s++) {
+		if (s[0] == '%' && s[1] != '\0')
+			len += strlen(base) + 16;
+	}
+	if ((out = malloc(len)) == NULL)
+		return (NULL);
+
+	for (s = tmpl, o = out; *s != '\0'; s++) {
+		if (s[0] != '%' || s[1] == '\0') {
+			*o++ = *s;
+			continue;
+		}
+		switch (*++s) {
+			case 'n':
+				o += sprintf(o, "%s", base);
+				break;
+			case 'i':
+				o += sprintf(o, "%d", index);
+				break;
+			default:
+				*o++ = *s;
+		}
+	}
+	*o = '\0';
+	return (out);
+}
+
+/*
+ * Add input names for an operand: a file, a directory of files, or
+ * @listfile with one name per line ("@-" for stdin).
+ */
+static int
+batchadd(char ***names, int *count, int *size, const char *arg)
+{
+	struct dirent *de;
+	struct stat st;
+	char line[4096], *name, **n;
+	FILE *list;
+	DIR *dir;
+	size_t len;
+
+	if (arg[0] == '@') {
+		list = strcmp(arg, "@-") == 0 ? stdin : fopen(&arg[1], "r");
+		if (list == NULL) {
+			fprintf(stderr, "Can't read list %s\n", &arg[1]);
+			return (-1);
+		}
+		while (fgets(line, sizeof (line), list) != NULL) {
+			if ((len = strlen(line)) > 0 && line[len - 1] == '\n')
+				line[--len] = '\0';
+			if (len > 0 && batchadd(names, count, size, line) != 0)
+				return (-1);
+		}
+		if (list != stdin)
+			fclose(list);
+		return (0);
+	}
+
+	if (stat(arg, &st) == 0 && S_ISDIR(st.st_mode)) {
+		if ((dir = opendir(arg)) == NULL) {
+			fprintf(stderr, "Can't read directory %s\n", arg);
+			return (-1);
+		}
+		while ((de = readdir(dir)) != NULL) {
+			if (de->d_name[0] == '.')
+				continue;
+			if ((name = malloc(strlen(arg) + strlen(de->d_name) +
+			    2)) == NULL)
+				return (-1);
+			sprintf(name, "%s/%s", arg, de->d_name);
+			if (stat(name, &st) != 0 || !S_ISREG(st.st_mode)) {
+				free(name);
+				continue;
+			}
+			if (batchadd(names, count, size, name) != 0)
+				return (-1);
+			free(name);
+		}
+		closedir(dir);
+		return (0);
+	}
+
+	if (*count == *size) {
+		if ((n = realloc(*names, (*size * 2 + 64) *
+		    sizeof (char *))) == NULL)
+			return (-1);
+		*names = n;
+		*size = *size * 2 + 64;
+	}
+	if (((*names)[*count] = strdup(arg)) == NULL)
+		return (-1);
+	(*count)++;
+	return (0);
+}
+
+static int
+dobatch(int nargs, char **args, const char *tmpl, d2p_t *d2p, int height,
+    int hscale, off_t seek, int nthreads)
+{
+	batch_t batch, *bt = &batch;
+	char **names = NULL;
+	bpack_t *packs;
+	struct stat st;
+	off_t packbytes = 0, bytes;
+	int i, count = 0, size = 0, npacks = 0;
+
+	for (i = 0; i < nargs; i++) {
+		if (batchadd(&names, &count, &size, args[i]) != 0) {
+			fprintf(stderr, "ERROR: Can't build batch list\n");
+			return (2);
+		}
+	}
+	if (count == 0) {
+		fprintf(stderr, "ERROR: No input files\n");
+		return (2);
+	}
+	if (count > 1 && strchr(tmpl, '%') == NULL) {
+		fprintf(stderr, "ERROR: batch output name needs %%n or %%i\n");
+		return (2);
+	}
+
+	memset(bt, 0, sizeof (batch_t));
+	bt->d2p = d2p;
+	bt->width = d2p_get_width(d2p);
+	bt->height = height;
+	bt->hscale = hscale;
+	bt->skip = d2p_get_skip(d2p);
+	bt->rowbytes = d2p_row_bytes(d2p);
+	bt->seek = seek;
+
+	/*
+	 * Each worker holds a deflate stream, a row, and the output of the
+	 * band it's encoding (at worst the band's raw pixels).  Under
+	 * --memory-budget, use smaller bands and then fewer workers.
+	 */
+	bt->band = BATCH_BAND;
+	while (membudget > 0 && bt->band > BATCH_BAND_MIN &&
+	    ZMEM + BANDMEM(bt, bt->band) > membudget)
+		bt->band /= 2;
+	nthreads = fitthreads(nthreads, ZMEM + BANDMEM(bt, bt->band), 0);
+
+	if ((bt->files = calloc(count, sizeof (bfile_t))) == NULL ||
+	    (packs = calloc(count, sizeof (bpack_t))) == NULL) {
+		perror("Out of memory");
+		return (2);
+	}
+	bt->nfiles = count;
+	bt->pool = pool_create(nthreads, encoder_free);
+	meterstart(0, 0);
+
+	/*
+	 * Files that fit in one band are packed together until the pack
+	 * covers a band's worth of input.  Larger files get their own task,
+	 * which splits them into bands.
+	 */
+	for (i = 0; i < count; i++) {
+		bt->files[i].batch = bt;
+		bt->files[i].name = names[i];
+		if ((bt->files[i].outname = outtemplate(tmpl, names[i], i)) ==
+		    NULL) {
+			perror("Out of memory");
+			return (2);
+		}
+		bytes = stat(names[i], &st) == 0 ? st.st_size / bt->skip : 0;
+		bt->files[i].expect = bytes > 0 && st.st_size > seek ?
+		    st.st_size - seek : 0;
+		/* at most the height cap shows; bfile_open() settles it */
+		if (bt->files[i].expect > (long long)bt->height *
+		    bt->rowbytes * bt->skip)
+			bt->files[i].expect = (long long)bt->height *
+			    bt->rowbytes * bt->skip;
+		metertotal(bt->files[i].expect);
+		if (bytes >= bt->band) {
+			pool_submit(bt->pool, bfiletask, &bt->files[i]);
+			continue;
+		}
+		if (npacks == 0 || packbytes >= bt->band ||
+		    packs[npacks - 1].first + packs[npacks - 1].count != i) {
+			packs[npacks].batch = bt;
+			packs[npacks].first = i;
+			packs[npacks].count = 0;
+			packbytes = 0;
+			npacks++;
+		}
+		packs[npacks - 1].count++;
+		packbytes += bytes;
+	}
+	for (i = 0; i < npacks; i++)
+		pool_submit(bt->pool, bpacktask, &packs[i]);
+
+	pool_wait(bt->pool);
+	pool_destroy(bt->pool);
+	meterstop();
+
+	for (i = 0; i < count; i++) {
+		free(bt->files[i].outname);
+		free(names[i]);
+	}
+	free(names);
+	free(packs);
+	free(bt->files);
+
+	return (bt->errors ? 1 : 0);
+}
+
+/*
+ * 5x7 font for labels, ASCII 0x20-0x5f (lower case is drawn as upper).
+ * Each glyph is 5 columns, bit 0 is the top row.
+ */
+static const unsigned char font5x7[64][5] = {
+	{ 0x00, 0x00, 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0x5f, 0x00, 0x00 },
+	{ 0x00, 0x07, 0x00, 0x07, 0x00 }, { 0x14, 0x7f, 0x14, 0x7f, 0x14 },
+	{ 0x24, 0x2a, 0x7f, 0x2a, 0x12 }, { 0x23, 0x13, 0x08, 0x64, 0x62 },
+	{ 0x36, 0x49, 0x55, 0x22, 0x50 }, { 0x00, 0x05, 0x03, 0x00, 0x00 },
+	{ 0x00, 0x1c, 0x22, 0x41, 0x00 }, { 0x00, 0x41, 0x22, 0x1c, 0x00 },
+	{ 0x08, 0x2a, 0x1c, 0x2a, 0x08 }, { 0x08, 0x08, 0x3e, 0x08, 0x08 },
+	{ 0x00, 0x50, 0x30, 0x00, 0x00 }, { 0x08, 0x08, 0x08, 0x08, 0x08 },
+	{ 0x00, 0x60, 0x60, 0x00, 0x00 }, { 0x20, 0x10, 0x08, 0x04, 0x02 },
+	{ 0x3e, 0x51, 0x49, 0x45, 0x3e }, { 0x00, 0x42, 0x7f, 0x40, 0x00 },
+	{ 0x42, 0x61, 0x51, 0x49, 0x46 }, { 0x21, 0x41, 0x45, 0x4b, 0x31 },
+	{ 0x18, 0x14, 0x12, 0x7f, 0x10 }, { 0x27, 0x45, 0x45, 0x45, 0x39 },
+	{ 0x3c, 0x4a, 0x49, 0x49, 0x30 }, { 0x01, 0x71, 0x09, 0x05, 0x03 },
+	{ 0x36, 0x49, 0x49, 0x49, 0x36 }, { 0x06, 0x49, 0x49, 0x29, 0x1e },
+	{ 0x00, 0x36, 0x36, 0x00, 0x00 }, { 0x00, 0x56, 0x36, 0x00, 0x00 },
+	{ 0x00, 0x08, 0x14, 0x22, 0x41 }, { 0x14, 0x14, 0x14, 0x14, 0x14 },
+	{ 0x41, 0x22, 0x14, 0x08, 0x00 }, { 0x02, 0x01, 0x51, 0x09, 0x06 },
+	{ 0x32, 0x49, 0x79, 0x41, 0x3e }, { 0x7e, 0x11, 0x11, 0x11, 0x7e },
+	{ 0x7f, 0x49, 0x49, 0x49, 0x36 }, { 0x3e, 0x41, 0x41, 0x41, 0x22 },
+	{ 0x7f, 0x41, 0x41, 0x22, 0x1c }, { 0x7f, 0x49, 0x49, 0x49, 0x41 },
+	{ 0x7f, 0x09, 0x09, 0x01, 0x01 }, { 0x3e, 0x41, 0x41, 0x51, 0x32 },
+	{ 0x7f, 0x08, 0x08, 0x08, 0x7f }, { 0x00, 0x41, 0x7f, 0x41, 0x00 },
+	{ 0x20, 0x40, 0x41, 0x3f, 0x01 }, { 0x7f, 0x08, 0x14, 0x22, 0x41 },
+	{ 0x7f, 0x40, 0x40, 0x40, 0x40 }, { 0x7f, 0x02, 0x04, 0x02, 0x7f },
+	{ 0x7f, 0x04, 0x08, 0x10, 0x7f }, { 0x3e, 0x41, 0x41, 0x41, 0x3e },
+	{ 0x7f, 0x09, 0x09, 0x09, 0x06 }, { 0x3e, 0x41, 0x51, 0x21, 0x5e },
+	{ 0x7f, 0x09, 0x19, 0x29, 0x46 }, { 0x46, 0x49, 0x49, 0x49, 0x31 },
+	{ 0x01, 0x01, 0x7f, 0x01, 0x01 }, { 0x3f, 0x40, 0x40, 0x40, 0x3f },
+	{ 0x1f, 0x20, 0x40, 0x20, 0x1f }, { 0x7f, 0x20, 0x18, 0x20, 0x7f },
+	{ 0x63, 0x14, 0x08, 0x14, 0x63 }, { 0x03, 0x04, 0x78, 0x04, 0x03 },
+	{ 0x61, 0x51, 0x49, 0x45, 0x43 }, { 0x00, 0x00, 0x7f, 0x41, 0x41 },
+	{ 0x02, 0x04, 0x08, 0x10, 0x20 }, { 0x41, 0x41, 0x7f, 0x00, 0x00 },
+	{ 0x04, 0x02, 0x01, 0x02, 0x04 }, { 0x40, 0x40, 0x40, 0x40, 0x40 }
+};
+
+#define	FONT_W		6		/* glyph width plus spacing */
+#define	FONT_H		7
+
+/*
+ * Draw glyph row gy (0..FONT_H-1) of text into a png row, starting at pixel
+ * x, clipped to maxw pixels.
+ */
+static void
+drawtext(png_bytep row, int x, int maxw, int gy, const char *text)
+{
+	int c, col, i;
+
+	for (i = 0; text[i] != '\0' && (i + 1) * FONT_W <= maxw; i++) {
+		c = (unsigned char)text[i];
+		if (c >= 'a' && c <= 'z')
+			c -= 'a' - 'A';
+		if (c < 0x20 || c > 0x5f)
+			c = '?';
+		for (col = 0; col < 5; col++) {
+			if (font5x7[c - 0x20][col] & (1 << gy)) {
+				row[(x + i * FONT_W + col) * 3] = 0xff;
+				row[(x + i * FONT_W + col) * 3 + 1] = 0xff;
+				row[(x + i * FONT_W + col) * 3 + 2] = 0xff;
+			}
+		}
+	}
+}
+
+/*
+ * Montage mode: a contact sheet of many inputs, as a grid of labeled
+ * thumbnails.  Each thumbnail is a 2-D average of the whole input: every
+ * thumbnail row stands for an equal slice of the file, and averages up to
+ * MONT_SAMPLES lines read from evenly spaced (stratified) offsets within
+ * that slice, each zoomed horizontally to the thumbnail width.  Only the
+ * sampled lines are read.  Thumbnails are rendered in parallel, one grid
+ * row (band) at a time, and the band is written out before the next is
+ * started, so memory holds one band of thumbnails.
+ */
+#define	MONT_SAMPLES	4		/* lines averaged per thumbnail row */
+#define	MONT_ZOOM	16		/* max horizontal zoom per line */
+#define	MONT_PAD	4		/* pixels between thumbnails */
+#define	MONT_LABEL	(FONT_H + 3)	/* label height under a thumbnail */
+#define	MONT_BG		0x20		/* background gray */
+
+typedef struct thumb {
+	struct montage	*mont;
+	char		*name;
+	unsigned char	*rgb;		/* tw x th pixels */
+	int		error;
+} thumb_t;
+
+typedef struct montage {
+	int		tw, th;		/* thumbnail size */
+	d2p_t		*d2p;
+	off_t		seek;
+} montage_t;
+
+static void
+thumbtask(void *arg)
+{
+	thumb_t *t = arg;
+	montage_t *m = t->mont;
+	struct stat st;
+	unsigned char *line = NULL, *rgb = NULL, mask;
+	unsigned long *sum = NULL;
+	int chrs = d2p_get_chrs(m->d2p);
+	int fd, x, y, s, in, zoom, nsamp, linebytes;
+	d2p_t *d2p = NULL;
+	off_t size, span, off;
+	uint64_t begin = traceb();
+
+	if ((fd = open(t->name, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+		fprintf(stderr, "Can't read %s\n", t->name);
+		t->error = 1;
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	size = st.st_size > m->seek ? st.st_size - m->seek : 0;
+
+	/*
+	 * Each thumbnail row covers span bytes of input.  Zoom lines
+	 * horizontally to fill it (up to MONT_ZOOM), then average up to
+	 * MONT_SAMPLES of those lines vertically.
+	 */
+	span = size / m->th / chrs * chrs;
+	if (span < m->tw * chrs)
+		span = m->tw * chrs;
+	zoom = span / (m->tw * chrs);
+	if (zoom > MONT_ZOOM)
+		zoom = MONT_ZOOM;
+	linebytes = m->tw * zoom * chrs;
+	nsamp = span / linebytes;
+	if (nsamp > MONT_SAMPLES)
+		nsamp = MONT_SAMPLES;
+
+	/* mask after averaging */
+	mask = d2p_get_mask(m->d2p) ? D2P_BYTE_MASK : 0xff;
+	if ((d2p = d2p_clone(m->d2p)) != NULL &&
+	    (d2p_set_width(d2p, m->tw) != D2P_OK ||
+	    d2p_set_zoom(d2p, zoom) != D2P_OK ||
+	    d2p_set_mask(d2p, 0) != D2P_OK)) {
+		d2p_destroy(d2p);
+		d2p = NULL;
+	}
+	line = malloc(linebytes);
+	rgb = malloc(m->tw * 3);
+	sum = malloc(m->tw * 3 * sizeof (unsigned long));
+	if (d2p == NULL || line == NULL || rgb == NULL || sum == NULL) {
+		perror("Out of memory");
+		t->error = 1;
+		goto out;
+	}
+
+	for (y = 0; y < m->th; y++) {
+		memset(sum, 0, m->tw * 3 * sizeof (unsigned long));
+		for (s = 0; s < nsamp; s++) {
+			off = m->seek + y * span + span / nsamp * s /
+			    chrs * chrs;
+			throttle(linebytes);
+			in = pread(fd, line, linebytes, off);
+			if (in < 0)
+				in = 0;
+			d2p_render_row(d2p, line, in, rgb);
+			for (x = 0; x < m->tw * 3; x++)
+				sum[x] += rgb[x];
+		}
+		for (x = 0; x < m->tw * 3; x++) {
+			t->rgb[y * m->tw * 3 + x] = sum[x] / nsamp & mask;
+		}
+	}
+	tracee("thumbnail", begin, -1);
+
+out:
+	close(fd);
+	d2p_destroy(d2p);
+	free(line);
+	free(rgb);
+	free(sum);
+}
+
+/*
+ * Write the montage png, thumbnailing a grid row of files at a time.
+ * Returns the number of files that failed, or -1 if the png did.
+ */
+static int
+montwrite(png_structp pngstruct, png_infop pnginfo, montage_t *mont,
+    thumb_t *thumbs, pool_t *pool, png_bytep row, int nfiles, char **files,
+    int cols, int width, int height)
+{
+	png_text pngtitle;
+	const char *base;
+	int rows, band, i, c, y, ty, tw = mont->tw, th = mont->th;
+	volatile int errors = 0;	/* across setjmp */
+
+	if (setjmp(png_jmpbuf(pngstruct))) {
+		perror("Error during png creation");
+		return (-1);
+	}
+
+	rows = (nfiles + cols - 1) / cols;
+	png_set_IHDR(pngstruct, pnginfo, width, height, 8, PNG_COLOR_TYPE_RGB,
+	    PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE,
+	    PNG_FILTER_TYPE_BASE);
+	pngtitle.compression = PNG_TEXT_COMPRESSION_NONE;
+	pngtitle.key = "Title";
+	pngtitle.text = "dump2png montage";
+	png_set_text(pngstruct, pnginfo, &pngtitle, 1);
+	png_write_info(pngstruct, pnginfo);
+
+	/* top padding */
+	memset(row, MONT_BG, width * 3);
+	for (y = 0; y < MONT_PAD; y++)
+		png_write_row(pngstruct, row);
+
+	for (band = 0; band < rows; band++) {
+		for (c = 0; c < cols && band * cols + c < nfiles; c++) {
+			thumbs[c].name = files[band * cols + c];
+			thumbs[c].error = 0;
+			memset(thumbs[c].rgb, 0, tw * th * 3);
+			pool_submit(pool, thumbtask, &thumbs[c]);
+		}
+		pool_wait(pool);
+		for (c = 0; c < cols && band * cols + c < nfiles; c++)
+			errors += thumbs[c].error;
+
+		for (y = 0; y < th + MONT_LABEL + MONT_PAD; y++) {
+			memset(row, MONT_BG, width * 3);
+			for (c = 0; c < cols && band * cols + c < nfiles;
+			    c++) {
+				i = MONT_PAD + c * (tw + MONT_PAD);
+				if (y < th) {
+					memcpy(&row[i * 3],
+					    &thumbs[c].rgb[y * tw * 3],
+					    tw * 3);
+					continue;
+				}
+				ty = y - th - 2;
+				if (ty < 0 || ty >= FONT_H)
+					continue;
+				base = strrchr(thumbs[c].name, '/');
+				base = base == NULL ? thumbs[c].name : base + 1;
+				drawtext(row, i, tw, ty, base);
+			}
+			png_write_row(pngstruct, row);
+		}
+	}
+
+	png_write_end(pngstruct, NULL);
+	return (errors);
+}
+
+static int
+domontage(FILE *outfile, int nfiles, char **files, int cols, int tw, int th,
+    d2p_t *d2p, off_t seek, int nthreads)
+{
+	montage_t mont;
+	thumb_t *thumbs = NULL;
+	png_structp pngstruct;
+	png_infop pnginfo = NULL;
+	png_bytep row = NULL;
+	pool_t *pool = NULL;
+	int width, height, rows, c, errors, code = 1;
+
+	if (cols > nfiles)
+		cols = nfiles;
+	rows = (nfiles + cols - 1) / cols;
+	width = cols * (tw + MONT_PAD) + MONT_PAD;
+	height = rows * (th + MONT_LABEL + MONT_PAD) + MONT_PAD;
+	printf("Output image: height:%d, width:%d\n", height, width);
+
+	mont.tw = tw;
+	mont.th = th;
+	mont.d2p = d2p;
+	mont.seek = seek;
+
+	pngstruct = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL,
+	    NULL);
+	if (pngstruct != NULL)
+		pnginfo = png_create_info_struct(pngstruct);
+	row = malloc(width * 3);
+	thumbs = calloc(cols, sizeof (thumb_t));
+	if (pngstruct == NULL || pnginfo == NULL || row == NULL ||
+	    thumbs == NULL) {
+		perror("Out of memory");
+		goto out;
+	}
+	for (c = 0; c < cols; c++) {
+		thumbs[c].mont = &mont;
+		if ((thumbs[c].rgb = malloc(tw * th * 3)) == NULL) {
+			perror("Out of memory");
+			goto out;
+		}
+	}
+	png_init_io(pngstruct, outfile);
+
+	/* a grid row of thumbnails, and each worker's line and sums */
+	pool = pool_create(fitthreads(nthreads, (long long)tw * MONT_ZOOM *
+	    d2p_get_chrs(d2p) + tw * 3 * (1 + sizeof (unsigned long)),
+	    (long long)cols * tw * th * 3), NULL);
+
+	if ((errors = montwrite(pngstruct, pnginfo, &mont, thumbs, pool, row,
+	    nfiles, files, cols, width, height)) >= 0)
+		code = errors ? 1 : 0;
+
+out:
+	if (pool != NULL)
+		pool_destroy(pool);
+	if (pngstruct != NULL)
+		png_destroy_write_struct(&pngstruct, &pnginfo);
+	if (thumbs != NULL) {
+		for (c = 0; c < cols; c++)
+			free(thumbs[c].rgb);
+	}
+	free(thumbs);
+	free(row);
+	return (code);
+}
+
+/*
+ * Parse a size with an optional K, M, G or T suffix (powers of 1024).
+ * Returns -1 if invalid.
+ */
+static long long
+parsesize(const char *str)
+{
+	char *end;
+	double v;
+
+	v = strtod(str, &end);
+	if (end == str || v < 0)
+		return (-1);
+	switch (*end) {
+		case 'k': case 'K': v *= 1024.0; end++; break;
+		case 'm': case 'M': v *= 1024.0 * 1024; end++; break;
+		case 'g': case 'G': v *= 1024.0 * 1024 * 1024; end++; break;
+		case 't': case 'T': v *= 1024.0 * 1024 * 1024 * 1024; end++;
+			break;
+	}
+	if (*end == 'b' || *end == 'B')
+		end++;
+	return (*end == '\0' ? (long long)v : -1);
+}
+
+/*
+ * Render cache.  Finished pngs are kept in a cache directory, named by a
+ * hash of a key describing the input file and every render parameter.  The
+ * file is identified by device, inode, size and mtime, or with
+ * --cache-hash, by its size and a hash of CACHE_SAMPLES blocks sampled
+ * across it (for dumps rewritten in place, or on filesystems without stable
+ * inodes).  The key also holds the file's real path, as the png's map chunk
+ * names it for --locate.  Each entry is <hash>.png plus <hash>.key holding
+ * the full key, which must match on lookup.  Entries are written to
+ * temporary names and renamed into place, so concurrent runs never see
+ * partial files.  A hit refreshes the entry's mtime, and after each insert
+ * the least recently used entries are removed until the cache is under its
+ * size cap.
+ */
+#define	CACHE_SAMPLES	64
+#define	CACHE_BLOCK	4096
+
+typedef struct centry {
+	char		name[32];	/* hash, without suffix */
+	time_t		mtime;
+	off_t		size;
+} centry_t;
+
+static unsigned long long
+fnv1a(unsigned long long h, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	while (len-- > 0) {
+		h ^= *p++;
+		h *= 1099511628211ULL;
+	}
+	return (h);
+}
+
+static char *
+cachekey(const char *infilename, int hashcontent, d2p_t *d2p, off_t seek)
+{
+	unsigned long long h = 14695981039346656037ULL;
+	unsigned char block[CACHE_BLOCK];
+	char file[256], *key, *path;
+	struct stat st;
+	off_t span;
+	ssize_t n;
+	int fd, i, len;
+
+	if ((fd = open(infilename, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+		if (fd >= 0)
+			close(fd);
+		return (NULL);
+	}
+	if (hashcontent) {
+		span = st.st_size > CACHE_BLOCK ? st.st_size - CACHE_BLOCK : 0;
+		for (i = 0; i < CACHE_SAMPLES; i++) {
+			n = pread(fd, block, CACHE_BLOCK,
+			    span / (CACHE_SAMPLES - 1) * i);
+			if (n > 0)
+				h = fnv1a(h, block, n);
+		}
+	}
+	close(fd);
+
+	if (hashcontent) {
+		snprintf(file, sizeof (file), "v1 size=%lld content=%016llx",
+		    (long long)st.st_size, h);
+	} else {
+		snprintf(file, sizeof (file), "v1 dev=%llu ino=%llu size=%lld "
+		    "mtime=%lld.%09ld", (unsigned long long)st.st_dev,
+		    (unsigned long long)st.st_ino, (long long)st.st_size,
+		    (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+	}
+
+	/* the png's map chunk names the source, so it is part of the key */
+	if ((path = realpath(infilename, NULL)) == NULL)
+		return (NULL);
+
+	/* sized to fit, as an expression palette's name is the expression */
+	for (key = NULL, len = 0; ; ) {
+		if ((n = snprintf(key, len, "%s source=%s palette=%s width=%d "
+		    "height=%d zoom=%d skip=%d mask=%d seek=%lld\n", file,
+		    path, d2p_get_palette(d2p), d2p_get_width(d2p),
+		    d2p_get_height(d2p), d2p_get_zoom(d2p), d2p_get_skip(d2p),
+		    d2p_get_mask(d2p), (long long)seek)) < 0) {
+			free(key);
+			key = NULL;
+			break;
+		}
+		if (key != NULL)
+			break;
+		len = n + 1;
+		if ((key = malloc(len)) == NULL)
+			break;
+	}
+	free(path);
+	return (key);
+}
+
+static void
+cachepath(char *buf, size_t len, const char *dir, const char *key,
+    const char *suffix)
+{
+	snprintf(buf, len, "%s/%016llx%s", dir,
+	    fnv1a(14695981039346656037ULL, key, strlen(key)), suffix);
+}
+
+static int
+copyfile(const char *from, const char *to)
+{
+	char buf[64 * 1024];
+	ssize_t n;
+	int in, out, err = 0;
+
+	if ((in = open(from, O_RDONLY)) < 0)
+		return (-1);
+	if ((out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		close(in);
+		return (-1);
+	}
+	while ((n = read(in, buf, sizeof (buf))) > 0) {
+		if (write(out, buf, n) != n) {
+			err = -1;
+			break;
+		}
+	}
+	if (n < 0)
+		err = -1;
+	close(in);
+	if (close(out) != 0)
+		err = -1;
+	return (err);
+}
+
+/*
+ * Look up key, and copy a hit to outfilename.  Returns 0 on a hit.
+ */
+static int
+cacheget(const char *dir, const char *key, const char *outfilename)
+{
+	char path[PATH_MAX], *stored;
+	size_t len = strlen(key);
+	ssize_t n;
+	int fd;
+
+	cachepath(path, sizeof (path), dir, key, ".key");
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return (-1);
+	/* a byte more than key, so a longer stored key doesn't match */
+	if ((stored = malloc(len + 1)) == NULL) {
+		close(fd);
+		return (-1);
+	}
+	n = read(fd, stored, len + 1);
+	close(fd);
+	if (n != (ssize_t)len || memcmp(stored, key, len) != 0) {
+		free(stored);
+		return (-1);
+	}
+	free(stored);
+
+	cachepath(path, sizeof (path), dir, key, ".png");
+	if (copyfile(path, outfilename) != 0)
+		return (-1);
+	(void) utimes(path, NULL);
+	return (0);
+}
+
+static int
+centrycmp(const void *a, const void *b)
+{
+	const centry_t *x = a, *y = b;
+
+	return (x->mtime < y->mtime ? -1 : x->mtime > y->mtime);
+}
+
+/*
+ * Remove least recently used entries until the cache is under max bytes.
+ */
+static void
+cachetrim(const char *dir, long long max)
+{
+	char path[PATH_MAX];
+	centry_t *ents = NULL, *e;
+	struct dirent *de;
+	struct stat st;
+	long long total = 0;
+	int n = 0, size = 0, i;
+	size_t len;
+	DIR *d;
+
+	if ((d = opendir(dir)) == NULL)
+		return;
+	while ((de = readdir(d)) != NULL) {
+		len = strlen(de->d_name);
+		if (len < 5 || len > 20 ||
+		    strcmp(&de->d_name[len - 4], ".png") != 0)
+			continue;
+		snprintf(path, sizeof (path), "%s/%s", dir, de->d_name);
+		if (stat(path, &st) != 0)
+			continue;
+		if (n == size) {
+			size = size * 2 + 64;
+			if ((e = realloc(ents, size * sizeof (centry_t))) ==
+			    NULL)
+				break;
+			ents = e;
+		}
+		memcpy(ents[n].name, de->d_name, len - 4);
+		ents[n].name[len - 4] = '\0';
+		ents[n].mtime = st.st_mtime;
+		ents[n].size = st.st_size;
+		total += st.st_size;
+		n++;
+	}
+	closedir(d);
+
+	qsort(ents, n, sizeof (centry_t), centrycmp);
+	for (i = 0; i < n && total > max; i++) {
+		snprintf(path, sizeof (path), "%s/%s.key", dir, ents[i].name);
+		(void) unlink(path);
+		snprintf(path, sizeof (path), "%s/%s.png", dir, ents[i].name);
+		(void) unlink(path);
+		total -= ents[i].size;
+	}
+	free(ents);
+}
+
+/*
+ * Store outfilename under key.  Failures only cost the cache entry.
+ */
+static void
+cacheput(const char *dir, const char *key, const char *outfilename,
+    long long max)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	int fd, ok;
+
+	(void) mkdir(dir, 0755);
+
+	cachepath(tmp, sizeof (tmp), dir, key, "");
+	snprintf(&tmp[strlen(tmp)], sizeof (tmp) - strlen(tmp),
+	    ".%d.tmp.png", (int)getpid());
+	cachepath(path, sizeof (path), dir, key, ".png");
+	if (copyfile(outfilename, tmp) != 0 || rename(tmp, path) != 0) {
+		(void) unlink(tmp);
+		return;
+	}
+
+	cachepath(tmp, sizeof (tmp), dir, key, "");
+	snprintf(&tmp[strlen(tmp)], sizeof (tmp) - strlen(tmp),
+	    ".%d.tmp.key", (int)getpid());
+	cachepath(path, sizeof (path), dir, key, ".key");
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+		return;
+	ok = write(fd, key, strlen(key)) == strlen(key);
+	if (close(fd) != 0 || !ok || rename(tmp, path) != 0) {
+		(void) unlink(tmp);
+		return;
+	}
+
+	cachetrim(dir, max);
+}
+
+/*
+ * Progressive rendering.  Rows are rendered coarse to fine: the first pass
+ * renders every step'th row (one per stratum of step rows) for a preview of
+ * about PROG_PREVIEW rows, and each following pass halves the step,
+ * rendering only the rows between those already done.  Rendered rows are
+ * kept, so no input is read twice.  After each pass the full size image is
+ * written, with rows not yet rendered filled from the nearest rendered row
+ * above, either atomically replacing the output file or as numbered files
+ * (out.1.png, out.2.png, ...).  Rows of a pass are rendered in parallel.
+ */
+#define	PROG_PREVIEW	64		/* rows in the first pass */
+#define	PROG_CHUNK	64		/* rows per render task */
+
+typedef struct prog {
+	d2p_t		*d2p;
+	int		fd;
+	int		width, height, skip;
+	size_t		rowbytes;
+	off_t		seek;
+	unsigned char	*rgb;		/* height rows of width pixels */
+	unsigned char	*done;		/* row rendered flags */
+	int		rows;		/* rows rendered */
+	int		step;		/* current pass */
+	int		error;
+	/* deadline mode */
+	double		stopat;		/* stop rendering at this time */
+	int		next;		/* next index into the pass */
+	int		npass;		/* rows in the pass */
+	int		stride;		/* pass visiting order */
+	int		must;		/* render a batch of this pass regardless */
+	int		fast;		/* favor encode speed over size */
+	int		store;		/* no compression at all */
+	int		ystep;		/* write every ystep'th row */
+} prog_t;
+
+/*
+ * Render chunk i of the rows in this pass: rows at multiples of step that
+ * aren't done yet.
+ */
+static void
+progchunk(void *arg, int i)
+{
+	prog_t *p = arg;
+	unsigned char *inbuf, *warm;
+	d2p_t *d2p;
+	ssize_t in;
+	int k, y, n = 0, ready = 0;
+	uint64_t t = traceb();
+
+	d2p = d2p_clone(p->d2p);
+	inbuf = malloc(p->rowbytes);
+	warm = malloc(p->width * 3);
+	if (d2p == NULL || inbuf == NULL || warm == NULL) {
+		p->error = 1;
+		goto out;
+	}
+
+	for (k = i * PROG_CHUNK; k < (i + 1) * PROG_CHUNK; k++) {
+		y = k * p->step;
+		if (y >= p->height)
+			break;
+		if (p->done[y])
+			continue;
+		/* state from the row above, unless it was the last rendered */
+		if (y != ready && stateful(d2p) && warmrows(d2p, p->fd,
+		    p->seek, p->skip, y, inbuf, warm) != 0) {
+			p->error = 1;
+			break;
+		}
+		ready = y + 1;
+		throttle(p->rowbytes);
+		in = pread(p->fd, inbuf, p->rowbytes, p->seek +
+		    (off_t)y * p->rowbytes * p->skip);
+		if (in < 0)
+			in = 0;
+		dropcache(p->fd, p->seek + (off_t)y * p->rowbytes * p->skip,
+		    p->rowbytes);
+		if (d2p_render_row(d2p, inbuf, in,
+		    &p->rgb[(size_t)y * p->width * 3]) != D2P_OK) {
+			p->error = 1;
+			break;
+		}
+		p->done[y] = 1;
+		n++;
+	}
+	__sync_fetch_and_add(&p->rows, n);
+	meteradd((long long)n * p->rowbytes * p->skip, n);
+	tracee("render rows", t, i);
+
+out:
+	d2p_destroy(d2p);
+	free(inbuf);
+	free(warm);
+}
+
+static void
+progpass(prog_t *p, int step, int nthreads)
+{
+	int nrows = (p->height + step - 1) / step;
+
+	p->step = step;
+	runjobs(progchunk, p, (nrows + PROG_CHUNK - 1) / PROG_CHUNK, nthreads);
+}
+
+/*
+ * Add d2p's coordinate map, if it has one, to a png being written.
+ */
+static void
+pngmap(png_structp pngstruct, png_infop pnginfo, const d2p_t *d2p)
+{
+	png_unknown_chunk map;
+
+	if ((map.size = d2p_map_chunk(d2p, NULL, 0)) == 0 ||
+	    (map.data = malloc(map.size)) == NULL)
+		return;
+	memcpy(map.name, D2P_MAP_CHUNK, 5);
+	(void) d2p_map_chunk(d2p, map.data, map.size);
+	map.location = PNG_HAVE_IHDR;
+	png_set_keep_unknown_chunks(pngstruct, PNG_HANDLE_CHUNK_ALWAYS,
+	    (png_const_bytep)D2P_MAP_CHUNK, 1);
+	png_set_unknown_chunks(pngstruct, pnginfo, &map, 1);
+	free(map.data);
+}
+
+/*
+ * Write the image so far to path.  Rows not yet rendered are filled from
+ * the nearest rendered row above (PROG_COPY), interpolated between the
+ * rendered rows above and below (PROG_LERP), or drawn with a hatch pattern
+ * (PROG_HATCH).  coverage, if set, is recorded as a text chunk.  With
+ * ystep over 1, only every ystep'th row is written, and the coordinate map
+ * says so with a skip factor ystep times larger.
+ */
+#define	PROG_COPY	0
+#define	PROG_LERP	1
+#define	PROG_HATCH	2
+
+#define	HATCH_RGB	0x60, 0x00, 0x60	/* hatch stripe color */
+
+static int
+progwrite(prog_t *p, const char *path, int fill, const char *coverage)
+{
+	static const unsigned char hatch[3] = { HATCH_RGB };
+	png_structp pngstruct;
+	png_infop pnginfo = NULL;
+	png_text pngtext[2];
+	unsigned char *row = NULL, *a, *b;
+	FILE *out;
+	d2p_t *map = NULL;
+	int x, y, c, ystep = p->ystep > 1 ? p->ystep : 1;
+	int height = (p->height + ystep - 1) / ystep;
+	volatile int above = -1, below = -1, code = 1;	/* across setjmp */
+	uint64_t t = traceb();
+
+	if ((out = outopen(path, (long long)height * (p->width * 3 + 1))) ==
+	    NULL) {
+		fprintf(stderr, "ERROR: Could not write to %s\n", path);
+		return (1);
+	}
+	pngstruct = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL,
+	    NULL);
+	if (pngstruct != NULL)
+		pnginfo = png_create_info_struct(pngstruct);
+	row = malloc(p->width * 3);
+	if (ystep > 1 && (map = d2p_clone(p->d2p)) != NULL &&
+	    d2p_set_skip(map, p->skip * ystep) != D2P_OK) {
+		d2p_destroy(map);
+		map = NULL;
+	}
+	if (pngstruct == NULL || pnginfo == NULL || row == NULL ||
+	    (ystep > 1 && map == NULL)) {
+		perror("Out of memory");
+		goto out;
+	}
+	if (setjmp(png_jmpbuf(pngstruct))) {
+		perror("Error during png creation");
+		goto out;
+	}
+
+	png_init_io(pngstruct, out);
+	png_set_IHDR(pngstruct, pnginfo, p->width, height, 8,
+	    PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE,
+	    PNG_FILTER_TYPE_BASE);
+	pngtext[0].compression = PNG_TEXT_COMPRESSION_NONE;
+	pngtext[0].key = "Title";
+	pngtext[0].text = "dump2png";
+	pngtext[1].compression = PNG_TEXT_COMPRESSION_NONE;
+	pngtext[1].key = "Coverage";
+	pngtext[1].text = (char *)coverage;
+	png_set_text(pngstruct, pnginfo, pngtext, coverage != NULL ? 2 : 1);
+	pngmap(pngstruct, pnginfo, map != NULL ? map : p->d2p);
+	if (p->store) {
+		png_set_compression_level(pngstruct, Z_NO_COMPRESSION);
+		png_set_filter(pngstruct, PNG_FILTER_TYPE_BASE,
+		    PNG_FILTER_NONE);
+	} else if (p->fast) {
+		png_set_compression_level(pngstruct, Z_BEST_SPEED);
+		png_set_filter(pngstruct, PNG_FILTER_TYPE_BASE,
+		    PNG_FILTER_SUB);
+	}
+	png_write_info(pngstruct, pnginfo);
+
+	for (y = 0; y < p->height; y += ystep) {
+		if (p->done[y]) {
+			above = y;
+			png_write_row(pngstruct, &p->rgb[(size_t)y *
+			    p->width * 3]);
+			continue;
+		}
+		if (fill == PROG_HATCH) {
+			for (x = 0; x < p->width; x++) {
+				for (c = 0; c < 3; c++) {
+					row[x * 3 + c] = ((x + y / ystep) & 7) <
+					    2 ? hatch[c] : 0;
+				}
+			}
+			png_write_row(pngstruct, row);
+			continue;
+		}
+		if (below <= y) {
+			for (below = y + ystep; below < p->height &&
+			    !p->done[below]; below += ystep)
+				;
+		}
+		if (above < 0 && below >= p->height) {
+			memset(row, 0, p->width * 3);
+			png_write_row(pngstruct, row);
+			continue;
+		}
+		a = &p->rgb[(size_t)(above >= 0 ? above : below) * p->width * 3];
+		b = &p->rgb[(size_t)(below < p->height ? below : above) *
+		    p->width * 3];
+		if (fill == PROG_COPY || above < 0 || below >= p->height) {
+			png_write_row(pngstruct, a);
+			continue;
+		}
+		for (x = 0; x < p->width * 3; x++) {
+			row[x] = (a[x] * (below - y) + b[x] * (y - above)) /
+			    (below - above);
+		}
+		png_write_row(pngstruct, row);
+	}
+	png_write_end(pngstruct, NULL);
+	code = 0;
+
+out:
+	if (pngstruct != NULL)
+		png_destroy_write_struct(&pngstruct, &pnginfo);
+	d2p_destroy(map);
+	free(row);
+	if (fclose(out) != 0) {
+		fprintf(stderr, "ERROR: Write to %s failed\n", path);
+		code = 1;
+	}
+	tracee("write png", t, -1);
+	return (code);
+}
+
+/*
+ * Name the output of a pass: out.png becomes out.<pass>.png when numbered,
+ * or out.png.tmp to be renamed over out.png.
+ */
+static char *
+progname(const char *outfilename, int pass, int numbered)
+{
+	size_t len = strlen(outfilename);
+	char *name;
+
+	if ((name = malloc(len + 32)) == NULL)
+		return (NULL);
+	if (!numbered)
+		snprintf(name, len + 32, "%s.%d.tmp", outfilename, (int)getpid());
+	else if (len > 4 && strcmp(&outfilename[len - 4], ".png") == 0)
+		snprintf(name, len + 32, "%.*s.%d.png", (int)len - 4,
+		    outfilename, pass);
+	else
+		snprintf(name, len + 32, "%s.%d", outfilename, pass);
+	return (name);
+}
+
+static int
+doprogressive(d2p_t *d2p, int infile, const char *outfilename, int numbered,
+    off_t seek, int nthreads)
+{
+	prog_t prog;
+	char *name;
+	int step, pass, code = 1;
+
+	memset(&prog, 0, sizeof (prog));
+	prog.d2p = d2p;
+	prog.fd = infile;
+	prog.width = d2p_get_width(d2p);
+	prog.height = d2p_get_height(d2p);
+	prog.skip = d2p_get_skip(d2p);
+	prog.rowbytes = d2p_row_bytes(d2p);
+	prog.seek = seek;
+	prog.rgb = calloc(prog.height, prog.width * 3);
+	prog.done = calloc(prog.height, 1);
+	nthreads = fitthreads(nthreads, prog.rowbytes + prog.width * 3,
+	    (long long)prog.height * (prog.width * 3 + 1));
+	if (prog.rgb == NULL || prog.done == NULL) {
+		perror("Out of memory");
+		goto out;
+	}
+
+	for (step = 1; step * 2 * PROG_PREVIEW <= prog.height; step *= 2)
+		;
+
+	for (pass = 1; step >= 1; step /= 2, pass++) {
+		progpass(&prog, step, nthreads);
+		if (prog.error) {
+			fprintf(stderr, "ERROR: render failed\n");
+			goto out;
+		}
+		if ((name = progname(outfilename, pass, numbered)) == NULL) {
+			perror("Out of memory");
+			goto out;
+		}
+		if (progwrite(&prog, name, PROG_COPY, NULL) != 0 ||
+		    (!numbered && rename(name, outfilename) != 0)) {
+			fprintf(stderr, "ERROR: Could not write to %s\n",
+			    numbered ? name : outfilename);
+			(void) unlink(name);
+			free(name);
+			goto out;
+		}
+		printf("Pass %d: %d of %d rows, wrote %s\n", pass, prog.rows,
+		    prog.height, numbered ? name : outfilename);
+		fflush(stdout);
+		free(name);
+	}
+	code = 0;
+
+out:
+	free(prog.rgb);
+	free(prog.done);
+	return (code);
+}
+
+/*
+ * Deadline mode.  Rendering runs coarse to fine as with --progressive, but
+ * stops when the time budget runs out, leaving enough of it to encode and
+ * write the png.  The rows of each pass are visited in a scattered order
+ * (index * stride mod rows, with stride coprime to the row count near the
+ * golden ratio), so a pass cut short still samples the whole input evenly.
+ * The clock is checked every DL_BATCH rows, in every pass: the first,
+ * preview, pass renders at least one batch, so even a slow input gives an
+ * image (of lower coverage) on time.  Throughput is measured per
+ * pass and reported, and used to say whether the next pass will fit.
+ * Unsampled rows are interpolated, or hatched, and the fraction of rows
+ * rendered is recorded in the png's "Coverage" text.
+ *
+ * The encode must fit in half the budget whatever the coverage, as every
+ * output row is encoded.  If a fast deflate of the image won't, the rows are
+ * stored uncompressed, and if that won't either, only every ystep'th row
+ * (a power of two) is rendered and written, the map's skip factor scaled
+ * to match.
+ */
+#define	DL_BATCH	8		/* rows claimed per clock check */
+#define	DL_ENC_RATE	(30.0 * 1024 * 1024)	/* bytes/s to budget for encode */
+#define	DL_STORE_RATE	(150.0 * 1024 * 1024)	/* same, stored */
+#define	DL_ENC_MIN	0.05		/* seconds, minimum encode budget */
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/*
+ * Parse a duration: a number with an optional ms, s, m or h suffix
+ * (default seconds).  Returns a negative value if invalid.
+ */
+static double
+parsetime(const char *str)
+{
+	char *end;
+	double v;
+
+	v = strtod(str, &end);
+	if (end == str || v < 0)
+		return (-1);
+	if (strcmp(end, "ms") == 0)
+		return (v / 1000);
+	if (*end == '\0' || strcmp(end, "s") == 0)
+		return (v);
+	if (strcmp(end, "m") == 0)
+		return (v * 60);
+	if (strcmp(end, "h") == 0)
+		return (v * 3600);
+	return (-1);
+}
+
+static int
+gcd(int a, int b)
+{
+	int t;
+
+	while (b != 0) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+	return (a);
+}
+
+static void *
+dlworker(void *arg)
+{
+	prog_t *p = arg;
+	unsigned char *inbuf, *warm;
+	d2p_t *d2p;
+	ssize_t in;
+	int i, j, y, n, ready = 0;
+	uint64_t t;
+
+	d2p = d2p_clone(p->d2p);
+	inbuf = malloc(p->rowbytes);
+	warm = malloc(p->width * 3);
+	if (d2p == NULL || inbuf == NULL || warm == NULL) {
+		p->error = 1;
+		goto out;
+	}
+
+	while ((p->must && p->next == 0) || now() < p->stopat) {
+		j = __sync_fetch_and_add(&p->next, DL_BATCH);
+		if (j >= p->npass)
+			break;
+		t = traceb();
+		n = 0;
+		for (i = j; i < j + DL_BATCH && i < p->npass; i++) {
+			y = (int)((long long)i * p->stride % p->npass) *
+			    p->step;
+			if (p->done[y])
+				continue;
+			if (y != ready && stateful(d2p) && warmrows(d2p,
+			    p->fd, p->seek, p->skip, y, inbuf, warm) != 0) {
+				p->error = 1;
+				goto out;
+			}
+			ready = y + 1;
+			throttle(p->rowbytes);
+			in = pread(p->fd, inbuf, p->rowbytes, p->seek +
+			    (off_t)y * p->rowbytes * p->skip);
+			if (in < 0)
+				in = 0;
+			dropcache(p->fd, p->seek + (off_t)y * p->rowbytes *
+			    p->skip, p->rowbytes);
+			if (d2p_render_row(d2p, inbuf, in,
+			    &p->rgb[(size_t)y * p->width * 3]) != D2P_OK) {
+				p->error = 1;
+				goto out;
+			}
+			p->done[y] = 1;
+			n++;
+		}
+		__sync_fetch_and_add(&p->rows, n);
+		meteradd((long long)n * p->rowbytes * p->skip, n);
+		tracee("render rows", t, j);
+	}
+
+out:
+	d2p_destroy(d2p);
+	free(inbuf);
+	free(warm);
+	return (NULL);
+}
+
+static int
+dodeadline(d2p_t *d2p, int infile, const char *outfilename, double start,
+    double deadline, int hatch, off_t seek, int nthreads)
+{
+	prog_t prog;
+	pthread_t *tids = NULL;
+	char coverage[64];
+	double t, rate = 0, reserve, bytes;
+	int step, pass, rows, outrows, started, i, code = 1;
+
+	memset(&prog, 0, sizeof (prog));
+	prog.d2p = d2p;
+	prog.fd = infile;
+	prog.width = d2p_get_width(d2p);
+	prog.height = d2p_get_height(d2p);
+	prog.skip = d2p_get_skip(d2p);
+	prog.rowbytes = d2p_row_bytes(d2p);
+	prog.seek = seek;
+	prog.rgb = calloc(prog.height, prog.width * 3);
+	prog.done = calloc(prog.height, 1);
+	nthreads = fitthreads(nthreads, prog.rowbytes + prog.width * 3,
+	    (long long)prog.height * (prog.width * 3 + 1));
+	tids = malloc(nthreads * sizeof (pthread_t));
+	if (prog.rgb == NULL || prog.done == NULL || tids == NULL) {
+		perror("Out of memory");
+		goto out;
+	}
+
+	prog.fast = 1;
+	prog.ystep = 1;
+	bytes = (double)prog.height * (prog.width * 3 + 1);
+	reserve = bytes / DL_ENC_RATE + DL_ENC_MIN;
+	if (reserve > deadline / 2) {
+		prog.store = 1;
+		while (prog.ystep < prog.height && bytes / prog.ystep /
+		    DL_STORE_RATE + DL_ENC_MIN > deadline / 2)
+			prog.ystep *= 2;
+		reserve = bytes / prog.ystep / DL_STORE_RATE + DL_ENC_MIN;
+		printf("Encode: stored, 1 in %d rows\n", prog.ystep);
+	}
+	prog.stopat = start + deadline - reserve;
+	outrows = (prog.height + prog.ystep - 1) / prog.ystep;
+
+	for (step = 1; step * 2 * PROG_PREVIEW <= prog.height; step *= 2)
+		;
+	if (step < prog.ystep)
+		step = prog.ystep;
+
+	for (pass = 1; step >= prog.ystep && (pass == 1 ||
+	    now() < prog.stopat); step /= 2, pass++) {
+		prog.step = step;
+		prog.must = (pass == 1);
+		prog.npass = (prog.height + step - 1) / step;
+		prog.next = 0;
+		for (prog.stride = prog.npass * 0.618 + 1; prog.npass > 1 &&
+		    gcd(prog.stride, prog.npass) != 1; prog.stride++)
+			;
+
+		if (rate > 0 && (prog.npass - prog.npass / 2) / rate >
+		    prog.stopat - now())
+			printf("Pass %d: won't finish, sampling\n", pass);
+
+		t = now();
+		rows = prog.rows;
+		for (started = 0, i = 1; i < nthreads; i++) {
+			if (pthread_create(&tids[started], NULL, dlworker,
+			    &prog) != 0)
+				break;
+			started++;
+		}
+		(void) dlworker(&prog);
+		for (i = 0; i < started; i++)
+			pthread_join(tids[i], NULL);
+		if (prog.error) {
+			fprintf(stderr, "ERROR: render failed\n");
+			goto out;
+		}
+
+		t = now() - t;
+		if (t > 0)
+			rate = (prog.rows - rows) / t;
+		printf("Pass %d: %d of %d rows, %.0f rows/s\n", pass,
+		    prog.rows, outrows, rate);
+	}
+
+	snprintf(coverage, sizeof (coverage), "%.4f",
+	    outrows > 0 ? (double)prog.rows / outrows : 1.0);
+	if (progwrite(&prog, outfilename, hatch ? PROG_HATCH : PROG_LERP,
+	    coverage) != 0)
+		goto out;
+	printf("Wrote %s: coverage %s in %.2fs\n", outfilename, coverage,
+	    now() - start);
+	code = 0;
+
+out:
+	free(tids);
+	free(prog.rgb);
+	free(prog.done);
+	return (code);
+}
+
+/*
+ * Fan-out: render one input to several targets, each with its own palette,
+ * width, zoom and output file, in a single read pass.  The input is read in
+ * chunks into a small ring of shared buffers; each target has a thread that
+ * feeds every chunk, in order, to its own context, so colorization and png
+ * encoding of the targets run concurrently.  A buffer is reused only once
+ * every target has consumed it, and reading stops early once every target
+ * has all its rows.
+ *
+ * With --direct (even for one target) the input is opened O_DIRECT, and
+ * read in larger chunks from the aligned offset below the seek; the head
+ * of the first chunk is skipped.  The ring is a single mapping, of huge
+ * pages where the system has them, so the buffers are page aligned.
+ */
+#define	FAN_CHUNK	(1024 * 1024)	/* bytes per read */
+#define	FAN_NBUF	8		/* chunks in flight */
+#define	HUGE_PAGE	(2 * 1024 * 1024)
+
+typedef struct fan fan_t;
+
+typedef struct fantarget {
+	fan_t		*fan;
+	d2p_t		*d2p;
+	char		*outfilename;
+	FILE		*out;
+	pthread_t	tid;
+	long		consumed;	/* chunks fed */
+	int		done;		/* all rows rendered */
+	int		error;
+} fantarget_t;
+
+struct fan {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cv;
+	unsigned char	*pool;		/* the ring's mapping */
+	size_t		poolsize;
+	unsigned char	*bufs[FAN_NBUF];
+	size_t		heads[FAN_NBUF];	/* bytes to skip */
+	size_t		lens[FAN_NBUF];		/* bytes after the head */
+	size_t		chunk;		/* bytes per read */
+	int		nbuf;		/* ring size, up to FAN_NBUF */
+	long		produced;	/* chunks read */
+	int		eof;
+	fantarget_t	*targets;
+	int		ntargets;
+};
+
+/*
+ * Parse a target: palette:width:zoom:outfile.  Empty fields take the
+ * settings of d2p.
+ */
+static int
+fanparse(const char *spec, d2p_t *d2p, d2p_t **tp, char **outp)
+{
+	char *copy, *f[4], *p;
+	d2p_t *t;
+	int i;
+
+	if ((copy = strdup(spec)) == NULL)
+		return (-1);
+	for (p = copy, i = 0; i < 3; i++) {
+		f[i] = p;
+		if ((p = strchr(p, ':')) == NULL) {
+			free(copy);
+			return (-1);
+		}
+		*p++ = '\0';
+	}
+	f[3] = p;
+	if (*f[3] == '\0' || (t = d2p_clone(d2p)) == NULL) {
+		free(copy);
+		return (-1);
+	}
+	if ((*f[0] != '\0' && setpalette(t, f[0]) < 0) ||
+	    (*f[1] != '\0' && d2p_set_width(t, atoi(f[1])) != D2P_OK) ||
+	    (*f[2] != '\0' && d2p_set_zoom(t, atoi(f[2])) != D2P_OK)) {
+		d2p_destroy(t);
+		free(copy);
+		return (-1);
+	}
+	*tp = t;
+	*outp = f[3];		/* copy is kept for the name */
+	return (0);
+}
+
+static void *
+fanworker(void *arg)
+{
+	fantarget_t *t = arg;
+	fan_t *f = t->fan;
+	int slot, err, rows = 0;
+	uint64_t begin;
+
+	tracename("target %s", t->outfilename);
+	(void) d2p_set_trace(t->d2p, tracing ? tracehook : NULL, NULL);
+	for (;;) {
+		begin = traceb();
+		pthread_mutex_lock(&f->lock);
+		while (t->consumed == f->produced && !f->eof)
+			pthread_cond_wait(&f->cv, &f->lock);
+		if (t->consumed == f->produced) {
+			pthread_mutex_unlock(&f->lock);
+			break;
+		}
+		pthread_mutex_unlock(&f->lock);
+		tracee("wait", begin, -1);
+
+		slot = t->consumed % f->nbuf;
+		if (!t->error && !t->done) {
+			if ((err = d2p_feed(t->d2p, f->bufs[slot] +
+			    f->heads[slot], f->lens[slot])) != D2P_OK) {
+				fprintf(stderr, "ERROR: %s: %s\n",
+				    t->outfilename, d2p_strerror(err));
+				t->error = 1;
+			}
+		}
+
+		/* the main output's progress stands for all */
+		if (t == f->targets) {
+			meteradd(f->lens[slot], d2p_rows(t->d2p) - rows);
+			rows = d2p_rows(t->d2p);
+		}
+
+		pthread_mutex_lock(&f->lock);
+		t->consumed++;
+		if (d2p_done(t->d2p))
+			t->done = 1;
+		pthread_cond_broadcast(&f->cv);
+		pthread_mutex_unlock(&f->lock);
+	}
+
+	if (!t->error && (err = d2p_finish(t->d2p)) != D2P_OK) {
+		fprintf(stderr, "ERROR: %s: %s\n", t->outfilename,
+		    d2p_strerror(err));
+		t->error = 1;
+	}
+	return (NULL);
+}
+
+/*
+ * Map size bytes for the ring: huge pages if some are reserved, else
+ * ordinary pages with a transparent huge page hint.
+ */
+static void *
+poolmap(size_t size)
+{
+	void *p = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+	if (p == MAP_FAILED) {
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			return (NULL);
+#ifdef MADV_HUGEPAGE
+		(void) madvise(p, size, MADV_HUGEPAGE);
+#endif
+	}
+	return (p);
+}
+
+static int
+dofanout(d2p_t **d2ps, char **outfilenames, int ntargets, int infile,
+    size_t direct)
+{
+	fan_t fan;
+	fantarget_t *t;
+	ssize_t in = 0;
+	long oldest;
+	long long left;
+	int i, started = 0, done, slot, code = 1;
+	off_t pos = lseek(infile, 0, SEEK_CUR);
+	size_t head = 0;
+	uint64_t begin;
+
+	memset(&fan, 0, sizeof (fan));
+	pthread_mutex_init(&fan.lock, NULL);
+	pthread_cond_init(&fan.cv, NULL);
+	fan.ntargets = ntargets;
+	if ((fan.targets = calloc(ntargets, sizeof (fantarget_t))) == NULL) {
+		perror("Out of memory");
+		goto out;
+	}
+
+	/* under --memory-budget, after each target's deflate stream */
+	fan.chunk = direct > 0 ? direct : FAN_CHUNK;
+	fan.nbuf = FAN_NBUF;
+	if (membudget > 0) {
+		left = (membudget - ntargets * ZMEM) / fan.chunk;
+		fan.nbuf = left < 2 ? 2 : left < FAN_NBUF ? left : FAN_NBUF;
+	}
+	fan.poolsize = (fan.chunk * fan.nbuf + HUGE_PAGE - 1) &
+	    ~(size_t)(HUGE_PAGE - 1);
+	if ((fan.pool = poolmap(fan.poolsize)) == NULL) {
+		perror("Out of memory");
+		goto out;
+	}
+	for (i = 0; i < fan.nbuf; i++)
+		fan.bufs[i] = fan.pool + i * fan.chunk;
+
+	/* direct reads start at the block holding the seek offset */
+	if (direct > 0) {
+		head = pos % DIRECT_ALIGN;
+		if (lseek(infile, pos - head, SEEK_SET) == -1) {
+			perror("Seek failed");
+			goto out;
+		}
+		pos -= head;
+	}
+
+	for (i = 0; i < ntargets; i++) {
+		t = &fan.targets[i];
+		t->fan = &fan;
+		t->d2p = d2ps[i];
+		t->outfilename = outfilenames[i];
+		if ((t->out = outopen(t->outfilename,
+		    (long long)d2p_get_height(t->d2p) *
+		    (d2p_get_width(t->d2p) * 3 + 1))) == NULL) {
+			fprintf(stderr, "ERROR: Could not write to %s\n",
+			    t->outfilename);
+			goto out;
+		}
+		if (d2p_set_png_file(t->d2p, t->out) != D2P_OK)
+			goto out;
+		printf("Writing %s: %s, height:%d, width:%d, zoom:%d\n",
+		    t->outfilename, d2p_get_palette(t->d2p),
+		    d2p_get_height(t->d2p), d2p_get_width(t->d2p),
+		    d2p_get_zoom(t->d2p));
+	}
+	for (; started < ntargets; started++) {
+		if (pthread_create(&fan.targets[started].tid, NULL, fanworker,
+		    &fan.targets[started]) != 0) {
+			perror("Can't create thread");
+			break;
+		}
+	}
+
+	for (;;) {
+		/* wait for the oldest buffer to be free */
+		begin = traceb();
+		pthread_mutex_lock(&fan.lock);
+		for (;;) {
+			oldest = fan.produced;
+			for (done = 1, i = 0; i < started; i++) {
+				if (fan.targets[i].consumed < oldest)
+					oldest = fan.targets[i].consumed;
+				if (!fan.targets[i].done &&
+				    !fan.targets[i].error)
+					done = 0;
+			}
+			if (done || fan.produced - oldest < fan.nbuf)
+				break;
+			pthread_cond_wait(&fan.cv, &fan.lock);
+		}
+		pthread_mutex_unlock(&fan.lock);
+		tracee("wait", begin, -1);
+		if (done || started < ntargets)
+			break;
+
+		slot = fan.produced % fan.nbuf;
+		throttle(fan.chunk);
+		begin = traceb();
+		in = read(infile, fan.bufs[slot], fan.chunk);
+		if (in < 0 && errno == EINVAL && direct > 0) {
+			/* accepted at open, but not for these reads */
+			fprintf(stderr, "WARNING: direct reads failed, "
+			    "reading through the page cache\n");
+			(void) fcntl(infile, F_SETFL,
+			    fcntl(infile, F_GETFL) & ~O_DIRECT);
+			direct = 0;
+			in = read(infile, fan.bufs[slot], fan.chunk);
+		}
+		if (in <= (ssize_t)head) {
+			if (in < 0)
+				perror("Read failed");
+			break;
+		}
+		tracee("read", begin, fan.produced);
+		dropcache(infile, pos, in);
+		pos += in;
+		pthread_mutex_lock(&fan.lock);
+		fan.heads[slot] = head;
+		fan.lens[slot] = in - head;
+		fan.produced++;
+		head = 0;
+		pthread_cond_broadcast(&fan.cv);
+		pthread_mutex_unlock(&fan.lock);
+	}
+
+	pthread_mutex_lock(&fan.lock);
+	fan.eof = 1;
+	pthread_cond_broadcast(&fan.cv);
+	pthread_mutex_unlock(&fan.lock);
+	for (i = 0; i < started; i++)
+		pthread_join(fan.targets[i].tid, NULL);
+	if (started == ntargets && in >= 0)
+		code = 0;
+
+out:
+	for (i = 0; fan.targets != NULL && i < ntargets; i++) {
+		t = &fan.targets[i];
+		if (t->error)
+			code = 1;
+		if (t->out != NULL && fclose(t->out) != 0) {
+			fprintf(stderr, "ERROR: Write to %s failed\n",
+			    t->outfilename);
+			code = 1;
+		}
+	}
+	if (fan.pool != NULL)
+		(void) munmap(fan.pool, fan.poolsize);
+	free(fan.targets);
+	pthread_mutex_destroy(&fan.lock);
+	pthread_cond_destroy(&fan.cv);
+	return (code);
+}
+
+/*
+ * Locate: print the input offset range behind a pixel, from the png's
+ * coordinate map chunk, and hexdump those bytes from the source (or file,
+ * if given).  Only the pixel's bytes are read.
+ */
+#define	LOCATE_MAX	256		/* max bytes to hexdump */
+
+static int
+dolocate(const char *pngname, int x, int y, const char *file)
+{
+	unsigned char hdr[8], dims[8], *map = NULL, buf[LOCATE_MAX];
+	char source[PATH_MAX];
+	unsigned long len;
+	size_t plen;
+	ssize_t in;
+	off_t offset, start;
+	long pngw = 0, pngh = 0;
+	FILE *png;
+	int fd, i, j, n, err, code = 1;
+
+	if ((png = fopen(pngname, "rb")) == NULL) {
+		fprintf(stderr, "ERROR: Can't read %s\n", pngname);
+		return (2);
+	}
+	if (fread(hdr, 1, 8, png) != 8 ||
+	    memcmp(hdr, "\211PNG\r\n\032\n", 8) != 0) {
+		fprintf(stderr, "ERROR: %s is not a png\n", pngname);
+		goto out;
+	}
+	while (fread(hdr, 1, 8, png) == 8) {
+		len = get32(hdr);
+		if (memcmp(&hdr[4], D2P_MAP_CHUNK, 4) == 0) {
+			if ((map = malloc(len)) == NULL ||
+			    fread(map, 1, len, png) != len) {
+				free(map);
+				map = NULL;
+			}
+			break;
+		}
+		if (memcmp(&hdr[4], "IHDR", 4) == 0 && len >= 8) {
+			if (fread(dims, 1, 8, png) != 8)
+				break;
+			pngw = get32(&dims[0]);
+			pngh = get32(&dims[4]);
+			len -= 8;
+		}
+		if (memcmp(&hdr[4], "IEND", 4) == 0 ||
+		    fseeko(png, (off_t)len + 4, SEEK_CUR) != 0)
+			break;
+	}
+	if (map == NULL) {
+		fprintf(stderr, "ERROR: %s has no coordinate map\n", pngname);
+		goto out;
+	}
+	if (x < 0 || x >= pngw || y < 0 || y >= pngh) {
+		fprintf(stderr, "ERROR: %d,%d is outside the %ldx%ld image\n",
+		    x, y, pngw, pngh);
+		goto out;
+	}
+	if ((err = d2p_locate(map, len, x, y, &offset, &plen, source,
+	    sizeof (source))) != D2P_OK) {
+		fprintf(stderr, "ERROR: can't locate %d,%d: %s\n", x, y,
+		    d2p_strerror(err));
+		goto out;
+	}
+	if (file == NULL)
+		file = source;
+	printf("Pixel %d,%d: bytes %lld-%lld (0x%llx-0x%llx) of %s\n", x, y,
+	    (long long)offset, (long long)(offset + plen - 1),
+	    (long long)offset, (long long)(offset + plen - 1), file);
+
+	/* hexdump whole lines around the pixel's bytes */
+	if ((fd = open(file, O_RDONLY)) < 0) {
+		fprintf(stderr, "ERROR: Can't read %s\n", file);
+		goto out;
+	}
+	start = offset & ~(off_t)15;
+	n = ((offset + plen - start + 15) & ~15);
+	if (n > LOCATE_MAX)
+		n = LOCATE_MAX;
+	if ((in = pread(fd, buf, n, start)) < 0) {
+		perror("Read failed");
+		close(fd);
+		goto out;
+	}
+	close(fd);
+	for (i = 0; i < in; i += 16) {
+		printf("%08llx ", (long long)(start + i));
+		for (j = i; j < i + 16; j++) {
+			if (j < in)
+				printf("%c%02x", start + j == offset ? '[' :
+				    start + j == offset + plen ? ']' : ' ',
+				    buf[j]);
+			else
+				printf("   ");
+		}
+		printf("%c |", start + j == offset + plen ? ']' : ' ');
+		for (j = i; j < i + 16 && j < in; j++)
+			putchar(isprint(buf[j]) ? buf[j] : '.');
+		printf("|\n");
+	}
+	code = 0;
+
+out:
+	free(map);
+	fclose(png);
+	return (code);
+}
+
+/*
+ * Collapse mode.  A first pass reads the input and finds runs of rows whose
+ * rendered bytes all have one value (usually zero).  Runs longer than the
+ * threshold are drawn as a thin separator band labeled with the value and
+ * size skipped, and the second pass renders only the remaining rows, so
+ * sparse cores give much shorter images.  Each run starts a new run in the
+ * coordinate map, so --locate stays exact; separator rows map to the start
+ * of the run they replace.
+ */
+#define	SEP_ROWS	(FONT_H + 4)		/* separator band height */
+#define	SEP_RGB		0x30, 0x00, 0x30	/* separator band color */
+#define	SCAN_BYTES	(1024 * 1024)		/* read size for the scan */
+
+typedef struct crun {
+	int		inrow;		/* first input row */
+	int		nrows;		/* input rows */
+	int		value;		/* collapsed byte value, or -1 */
+} crun_t;
+
+/*
+ * Return the byte value if all len bytes of buf are the same, else -1.
+ */
+static int
+uniform(const unsigned char *buf, size_t len)
+{
+	if (len == 0 || (len > 1 && memcmp(buf, buf + 1, len - 1) != 0))
+		return (-1);
+	return (buf[0]);
+}
+
+/*
+ * Append a run, merging runs of drawn rows.
+ */
+static int
+addrun(crun_t **runsp, int *nrunsp, int *sizep, int inrow, int nrows,
+    int value)
+{
+	crun_t *r = *runsp;
+
+	if (value < 0 && *nrunsp > 0 && r[*nrunsp - 1].value < 0) {
+		r[*nrunsp - 1].nrows += nrows;
+		return (0);
+	}
+	if (*nrunsp == *sizep) {
+		if ((r = realloc(r, (*sizep * 2 + 16) * sizeof (crun_t))) ==
+		    NULL)
+			return (-1);
+		*runsp = r;
+		*sizep = *sizep * 2 + 16;
+	}
+	r[*nrunsp].inrow = inrow;
+	r[*nrunsp].nrows = nrows;
+	r[*nrunsp].value = value;
+	(*nrunsp)++;
+	return (0);
+}
+
+/*
+ * Scan the input's rows, returning the runs to draw in *runsp.
+ */
+static int
+collapsescan(d2p_t *d2p, int infile, off_t seek, int minrows,
+    crun_t **runsp, int *nrunsp)
+{
+	size_t stride = d2p_row_stride(d2p), rowbytes = d2p_row_bytes(d2p);
+	int height = d2p_get_height(d2p), per, y, e, i, size = 0, code = -1;
+	unsigned char *buf;
+	short *vals;
+	ssize_t in = 0;
+
+	*runsp = NULL;
+	*nrunsp = 0;
+	per = SCAN_BYTES / stride > 0 ? SCAN_BYTES / stride : 1;
+	buf = malloc(per * stride);
+	vals = malloc(height * sizeof (short));
+	if (buf == NULL || vals == NULL)
+		goto out;
+
+	/* each row's single value, or -1 */
+	for (y = 0; y < height; y++) {
+		if (y % per == 0) {
+			throttle((long long)per * stride);
+			if ((in = pread(infile, buf, per * stride,
+			    seek + (off_t)y * stride)) < 0)
+				in = 0;
+		}
+		i = y % per;
+		vals[y] = (size_t)in >= i * stride + rowbytes ?
+		    uniform(&buf[i * stride], rowbytes) : -1;
+	}
+
+	for (y = 0; y < height; y = e) {
+		for (e = y + 1; e < height && vals[e] == vals[y]; e++)
+			;
+		if (addrun(runsp, nrunsp, &size, y, e - y, vals[y] >= 0 &&
+		    e - y > minrows && e - y > SEP_ROWS ? vals[y] : -1) != 0)
+			goto out;
+	}
+	code = 0;
+
+out:
+	free(buf);
+	free(vals);
+	return (code);
+}
+
+/*
+ * Format a byte count for a separator label, eg, 12.5M.
+ */
+static void
+sizestr(char *buf, size_t len, long long bytes)
+{
+	const char *units = "KMGTP";
+	double v = bytes;
+	int u = -1;
+
+	while (v >= 1024 && units[u + 1] != '\0') {
+		v /= 1024;
+		u++;
+	}
+	if (u < 0)
+		snprintf(buf, len, "%lld", bytes);
+	else
+		snprintf(buf, len, "%.1f%c", v, units[u]);
+}
+
+static int
+docollapse(d2p_t *d2p, int infile, const char *outfilename, off_t seek,
+    int minrows)
+{
+	static const unsigned char sep[3] = { SEP_RGB };
+	size_t stride = d2p_row_stride(d2p), rowbytes = d2p_row_bytes(d2p);
+	int width = d2p_get_width(d2p), inheight = d2p_get_height(d2p);
+	int nruns, height = 0, y, x, c, r, collapsed = 0, code = 1;
+	long long skipped = 0;
+	png_structp pngstruct = NULL;
+	png_infop pnginfo = NULL;
+	png_text pngtitle;
+	unsigned char *inbuf = NULL, *row = NULL;
+	char label[80], size[16];
+	crun_t *runs = NULL;
+	FILE *out = NULL;
+	ssize_t in;
+	uint64_t t = traceb();
+
+	if (collapsescan(d2p, infile, seek, minrows, &runs, &nruns) != 0) {
+		perror("Out of memory");
+		goto out;
+	}
+	tracee("scan", t, -1);
+	t = traceb();
+
+	/* the output height, and a coordinate map run per collapse run */
+	for (r = 0; r < nruns; r++) {
+		if (d2p_add_map_run(d2p, height, seek + (off_t)runs[r].inrow *
+		    stride) != D2P_OK) {
+			perror("Out of memory");
+			goto out;
+		}
+		if (runs[r].value >= 0) {
+			height += SEP_ROWS;
+			skipped += (long long)runs[r].nrows * stride;
+			collapsed++;
+		} else {
+			height += runs[r].nrows;
+		}
+	}
+	printf("Collapsed %d runs (%lld bytes): height %d -> %d\n", collapsed,
+	    skipped, inheight, height);
+
+	if ((out = outopen(outfilename, (long long)height *
+	    (d2p_get_width(d2p) * 3 + 1))) == NULL) {
+		fprintf(stderr, "ERROR: Could not write to %s\n", outfilename);
+		goto out;
+	}
+	printf("Writing %s...\n", outfilename);
+	pngstruct = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL,
+	    NULL);
+	if (pngstruct != NULL)
+		pnginfo = png_create_info_struct(pngstruct);
+	inbuf = malloc(rowbytes);
+	row = malloc(width * 3);
+	if (pngstruct == NULL || pnginfo == NULL || inbuf == NULL ||
+	    row == NULL) {
+		perror("Out of memory");
+		goto out;
+	}
+	if (setjmp(png_jmpbuf(pngstruct))) {
+		perror("Error during png creation");
+		goto out;
+	}
+
+	png_init_io(pngstruct, out);
+	png_set_IHDR(pngstruct, pnginfo, width, height, 8, PNG_COLOR_TYPE_RGB,
+	    PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE,
+	    PNG_FILTER_TYPE_BASE);
+	pngtitle.compression = PNG_TEXT_COMPRESSION_NONE;
+	pngtitle.key = "Title";
+	pngtitle.text = "dump2png";
+	png_set_text(pngstruct, pnginfo, &pngtitle, 1);
+	pngmap(pngstruct, pnginfo, d2p);
+	png_write_info(pngstruct, pnginfo);
+
+	for (r = 0; r < nruns; r++) {
+		if (runs[r].value < 0) {
+			for (y = runs[r].inrow; y < runs[r].inrow +
+			    runs[r].nrows; y++) {
+				throttle(rowbytes);
+				if ((in = pread(infile, inbuf, rowbytes, seek +
+				    (off_t)y * stride)) < 0)
+					in = 0;
+				if (d2p_render_row(d2p, inbuf, in, row) !=
+				    D2P_OK) {
+					fprintf(stderr, "ERROR: render "
+					    "failed\n");
+					goto out;
+				}
+				png_write_row(pngstruct, row);
+			}
+			meteradd((long long)runs[r].nrows * stride,
+			    runs[r].nrows);
+			continue;
+		}
+
+		/* separator band: border lines, and a label */
+		sizestr(size, sizeof (size), (long long)runs[r].nrows *
+		    stride);
+		snprintf(label, sizeof (label), "0x%02x * %s (%lld bytes) "
+		    "collapsed", runs[r].value, size,
+		    (long long)runs[r].nrows * stride);
+		for (y = 0; y < SEP_ROWS; y++) {
+			for (x = 0; x < width; x++) {
+				for (c = 0; c < 3; c++) {
+					row[x * 3 + c] = y == 0 ||
+					    y == SEP_ROWS - 1 ? 0x80 : sep[c];
+				}
+			}
+			if (y >= 2 && y < 2 + FONT_H)
+				drawtext(row, 4, width - 4, y - 2, label);
+			png_write_row(pngstruct, row);
+		}
+		meteradd((long long)runs[r].nrows * stride, SEP_ROWS);
+	}
+	png_write_end(pngstruct, NULL);
+	tracee("render", t, -1);
+	code = 0;
+
+out:
+	if (pngstruct != NULL)
+		png_destroy_write_struct(&pngstruct, &pnginfo);
+	if (out != NULL && fclose(out) != 0) {
+		fprintf(stderr, "ERROR: Write to %s failed\n", outfilename);
+		code = 1;
+	}
+	free(inbuf);
+	free(row);
+	free(runs);
+	return (code);
+}
+
+/*
+ * --stats: print where the time went.  The library times each stage per
+ * row or I/O; colorize and encode never block, so their wall time is also
+ * CPU time, while read and write include waits (their CPU is mostly the
+ * sys time).  Syscall counts come from /proc/self/io where there is one,
+ * else from the library's own counts.
+ */
+static void
+printstats(d2p_t *d2p, const char *outfilename, double start, int json)
+{
+	d2p_stats_t st;
+	struct rusage ru;
+	unsigned long long syscr = 0, syscw = 0, v;
+	double wall, user, sys, other;
+	char line[128];
+	FILE *io;
+
+	d2p_get_stats(d2p, &st);
+	wall = now() - start;
+	(void) getrusage(RUSAGE_SELF, &ru);
+	user = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+	sys = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+	other = wall - (st.read_ns + st.colorize_ns + st.encode_ns +
+	    st.write_ns) / 1e9;
+
+	if ((io = fopen("/proc/self/io", "r")) != NULL) {
+		while (fgets(line, sizeof (line), io) != NULL) {
+			if (sscanf(line, "syscr: %llu", &v) == 1)
+				syscr = v;
+			else if (sscanf(line, "syscw: %llu", &v) == 1)
+				syscw = v;
+		}
+		fclose(io);
+	} else {
+		syscr = st.reads;
+		syscw = st.writes;
+	}
+
+	if (json) {
+		printf("{\"output\": \"%s\", \"wall_s\": %.6f, "
+		    "\"user_s\": %.6f, \"sys_s\": %.6f, "
+		    "\"read_s\": %.6f, \"colorize_s\": %.6f, "
+		    "\"encode_s\": %.6f, \"write_s\": %.6f, \"other_s\": %.6f, "
+		    "\"reads\": %llu, \"writes\": %llu, "
+		    "\"bytes_in\": %llu, \"bytes_out\": %llu, "
+		    "\"rows\": %llu, \"zero_rows\": %llu, "
+		    "\"syscalls_read\": %llu, \"syscalls_write\": %llu, "
+		    "\"peak_rss_kb\": %ld, \"gb_per_s\": %.4f}\n",
+		    outfilename, wall, user, sys, st.read_ns / 1e9,
+		    st.colorize_ns / 1e9, st.encode_ns / 1e9, st.write_ns / 1e9,
+		    other, (unsigned long long)st.reads,
+		    (unsigned long long)st.writes,
+		    (unsigned long long)st.bytes_in,
+		    (unsigned long long)st.bytes_out,
+		    (unsigned long long)st.rows,
+		    (unsigned long long)st.zero_rows, syscr, syscw,
+		    ru.ru_maxrss, st.bytes_in / wall / 1e9);
+		return;
+	}
+
+	printf("Stats for %s:\n", outfilename);
+	printf("  read       %10.2f ms wall, %llu calls, %llu bytes\n",
+	    st.read_ns / 1e6, (unsigned long long)st.reads,
+	    (unsigned long long)st.bytes_in);
+	printf("  colorize   %10.2f ms wall and cpu\n", st.colorize_ns / 1e6);
+	printf("  encode     %10.2f ms wall and cpu (filter, deflate)\n",
+	    st.encode_ns / 1e6);
+	printf("  write      %10.2f ms wall, %llu calls, %llu bytes\n",
+	    st.write_ns / 1e6, (unsigned long long)st.writes,
+	    (unsigned long long)st.bytes_out);
+	printf("  other      %10.2f ms wall (startup, setup)\n", other * 1e3);
+	printf("  total      %10.2f ms wall, %.2f ms user, %.2f ms sys\n",
+	    wall * 1e3, user * 1e3, sys * 1e3);
+	printf("  rows       %llu, %llu of all zero input\n",
+	    (unsigned long long)st.rows, (unsigned long long)st.zero_rows);
+	printf("  syscalls   %llu read, %llu write\n", syscr, syscw);
+	printf("  peak RSS   %ld Kbytes\n", ru.ru_maxrss);
+	printf("  throughput %.3f GB/s\n", st.bytes_in / wall / 1e9);
+}
+
+/*
+ * --perf: hardware counters per stage, per input byte, to show whether a
+ * stage is bound by instruction supply (low IPC, few misses), branches or
+ * memory.  Counters the system didn't give are printed as "-".
+ */
+static void
+printperf(d2p_t *d2p, const char *outfilename)
+{
+	static const char *stages[D2P_NSTAGES] = {
+		"read", "colorize", "encode", "write"
+	};
+	uint64_t total[D2P_NCOUNTERS] = { 0 }, *c;
+	double bytes;
+	d2p_stats_t st;
+	d2p_perf_t pf;
+	char f[D2P_NCOUNTERS + 1][16];
+	int s, i;
+
+	d2p_get_stats(d2p, &st);
+	d2p_get_perf(d2p, &pf);
+	bytes = st.bytes_in > 0 ? st.bytes_in : 1;
+
+	printf("Counters for %s (user level, per input byte):\n",
+	    outfilename);
+	printf("  %-10s %10s %10s %7s %12s %12s\n", "STAGE", "cycles",
+	    "instrs", "IPC", "cache-miss", "branch-miss");
+	for (s = 0; s <= D2P_NSTAGES; s++) {
+		if (s < D2P_NSTAGES) {
+			c = pf.count[s];
+			for (i = 0; i < D2P_NCOUNTERS; i++)
+				total[i] += c[i];
+		} else {
+			c = total;
+		}
+		for (i = 0; i < D2P_NCOUNTERS; i++) {
+			if (pf.avail & (1 << i))
+				snprintf(f[i], sizeof (f[i]), i <
+				    D2P_PERF_CACHE_MISSES ? "%.3f" : "%.5f",
+				    c[i] / bytes);
+			else
+				strcpy(f[i], "-");
+		}
+		if ((pf.avail & (1 << D2P_PERF_CYCLES)) &&
+		    (pf.avail & (1 << D2P_PERF_INSTRUCTIONS)) &&
+		    c[D2P_PERF_CYCLES] > 0)
+			snprintf(f[i], sizeof (f[i]), "%.2f",
+			    (double)c[D2P_PERF_INSTRUCTIONS] /
+			    c[D2P_PERF_CYCLES]);
+		else
+			strcpy(f[i], "-");
+		printf("  %-10s %10s %10s %7s %12s %12s\n",
+		    s < D2P_NSTAGES ? stages[s] : "total",
+		    f[D2P_PERF_CYCLES], f[D2P_PERF_INSTRUCTIONS], f[i],
+		    f[D2P_PERF_CACHE_MISSES], f[D2P_PERF_BRANCH_MISSES]);
+	}
+}
+
+/*
+ * --trace: a timeline of the work done on each thread, written at exit in
+ * Chrome trace format (load it in Perfetto, or chrome://tracing).  Each
+ * thread appends complete events to its own buffer, so recording takes no
+ * locks; buffers are linked into a list with compare-and-swap when a thread
+ * first records.  Events are per batch of work: a band, frame, chunk of
+ * rows, or read; for the single file render, each row's stages from the
+ * library's trace callback.
+ */
+#define	TRACE_MAX	(1024 * 1024)	/* events kept per thread */
+
+typedef struct tevent {
+	const char	*name;
+	uint64_t	begin, end;	/* CLOCK_MONOTONIC ns */
+	long		arg;		/* eg, row or band; -1 for none */
+} tevent_t;
+
+typedef struct tbuf {
+	struct tbuf	*next;
+	tevent_t	*events;
+	int		n, size;
+	long		dropped;
+	int		tid;
+	char		name[64];
+} tbuf_t;
+
+static tbuf_t *tracebufs;		/* every thread's buffer */
+static int tracetids;
+static uint64_t tracestart;
+static char *tracepath;
+static __thread tbuf_t *tracebuf;
+
+static uint64_t
+nsnow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static tbuf_t *
+tracethread(void)
+{
+	tbuf_t *b;
+
+	if (tracebuf != NULL)
+		return (tracebuf);
+	if ((b = calloc(1, sizeof (tbuf_t))) == NULL)
+		return (NULL);
+	b->tid = __sync_add_and_fetch(&tracetids, 1);
+	snprintf(b->name, sizeof (b->name), "thread %d", b->tid);
+	do {
+		b->next = tracebufs;
+	} while (!__sync_bool_compare_and_swap(&tracebufs, b->next, b));
+	return (tracebuf = b);
+}
+
+/*
+ * Name the calling thread in the trace.
+ */
+static void
+tracename(const char *fmt, ...)
+{
+	va_list ap;
+	tbuf_t *b;
+
+	if (!tracing || (b = tracethread()) == NULL)
+		return;
+	va_start(ap, fmt);
+	vsnprintf(b->name, sizeof (b->name), fmt, ap);
+	va_end(ap);
+}
+
+/*
+ * Begin an event: returns its start time, or 0 when not tracing.
+ */
+static uint64_t
+traceb(void)
+{
+	return (tracing ? nsnow() : 0);
+}
+
+/*
+ * End an event begun at begin, recording it in this thread's buffer.
+ */
+static void
+tracerecord(const char *name, uint64_t begin, uint64_t end, long arg)
+{
+	tevent_t *ev;
+	tbuf_t *b;
+	int size;
+
+	if ((b = tracethread()) == NULL)
+		return;
+	if (b->n == b->size) {
+		size = b->size * 2 + 1024;
+		if (b->size == TRACE_MAX || (ev = realloc(b->events,
+		    (size > TRACE_MAX ? TRACE_MAX : size) *
+		    sizeof (tevent_t))) == NULL) {
+			b->dropped++;
+			return;
+		}
+		b->events = ev;
+		b->size = size > TRACE_MAX ? TRACE_MAX : size;
+	}
+	ev = &b->events[b->n++];
+	ev->name = name;
+	ev->begin = begin;
+	ev->end = end;
+	ev->arg = arg;
+}
+
+static void
+tracee(const char *name, uint64_t begin, long arg)
+{
+	if (tracing && begin != 0)
+		tracerecord(name, begin, nsnow(), arg);
+}
+
+/* library trace callback: stage names are static strings */
+static void
+tracehook(void *arg, const char *stage, uint64_t begin, uint64_t end)
+{
+	tracerecord(stage, begin, end, -1);
+}
+
+static void
+tracewrite(void)
+{
+	tbuf_t *b;
+	FILE *out;
+	int i, first = 1;
+
+	if ((out = fopen(tracepath, "w")) == NULL) {
+		fprintf(stderr, "ERROR: Could not write to %s\n", tracepath);
+		return;
+	}
+	fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+	for (b = tracebufs; b != NULL; b = b->next) {
+		fprintf(out, "%s{\"name\": \"thread_name\", \"ph\": \"M\", "
+		    "\"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+		    first ? "" : ",\n", b->tid, b->name);
+		first = 0;
+		for (i = 0; i < b->n; i++) {
+			fprintf(out, ",\n{\"name\": \"%s\", \"ph\": \"X\", "
+			    "\"pid\": 1, \"tid\": %d, \"ts\": %.3f, "
+			    "\"dur\": %.3f", b->events[i].name, b->tid,
+			    (b->events[i].begin - tracestart) / 1e3,
+			    (b->events[i].end - b->events[i].begin) / 1e3);
+			if (b->events[i].arg >= 0)
+				fprintf(out, ", \"args\": {\"n\": %ld}",
+				    b->events[i].arg);
+			fprintf(out, "}");
+		}
+		if (b->dropped > 0)
+			fprintf(stderr, "WARNING: trace: %ld events dropped on "
+			    "%s\n", b->dropped, b->name);
+	}
+	fprintf(out, "\n]}\n");
+	if (fclose(out) != 0)
+		fprintf(stderr, "ERROR: Write to %s failed\n", tracepath);
+}
+
+/*
+ * Start tracing; the trace is written to path at exit.
+ */
+static void
+traceopen(const char *path)
+{
+	if (tracing)
+		return;
+	tracepath = strdup(path);
+	tracestart = nsnow();
+	tracing = 1;
+	tracename("main");
+	atexit(tracewrite);
+}
+
+/*
+ * --progress: a reporter thread prints the input bytes and output rows done,
+ * the current MB/s and an ETA once a second, from counters the workers add
+ * to atomically after each batch (a band, chunk of rows, or buffer).  On
+ * stderr the report is for people; with an fd it's one JSON object per line,
+ * for a job runner to parse (or to notice a stalled render by).  The total
+ * can be adjusted while running, as in batch mode, where each file's share
+ * is only exact once it's opened.
+ */
+#define	METER_INTERVAL	1		/* seconds between reports */
+
+static struct meter {
+	long long	bytes, rows;	/* done so far */
+	long long	totalbytes, totalrows;
+	double		start;
+	double		lasttime;
+	long long	lastbytes;
+	int		stop;
+	pthread_t	tid;
+	pthread_mutex_t	lock;
+	pthread_cond_t	cv;
+} meter = { .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cv = PTHREAD_COND_INITIALIZER };
+
+static void
+meteradd(long long bytes, long long rows)
+{
+	if (!metering)
+		return;
+	if (bytes != 0)
+		__sync_fetch_and_add(&meter.bytes, bytes);
+	if (rows != 0)
+		__sync_fetch_and_add(&meter.rows, rows);
+}
+
+static void
+metertotal(long long bytes)
+{
+	if (metering)
+		__sync_fetch_and_add(&meter.totalbytes, bytes);
+}
+
+/* row callback for single file renders */
+static int
+meterrow(void *arg, int y, const unsigned char *rgb, int width)
+{
+	meteradd(d2p_row_stride(arg), 1);
+	return (0);
+}
+
+#define	ETA_MAX		(99999 * 3600.0)	/* seconds shown, at most */
+
+static void
+eta(char *buf, size_t len, double secs)
+{
+	long s;
+
+	/* a stalled rate gives a huge estimate, out of range of a long */
+	if (!(secs >= 0))
+		secs = 0;
+	else if (secs > ETA_MAX)
+		secs = ETA_MAX;
+	s = secs + 0.5;
+
+	if (s >= 3600)
+		snprintf(buf, len, "%ldh%02ldm", s / 3600, s / 60 % 60);
+	else if (s >= 60)
+		snprintf(buf, len, "%ldm%02lds", s / 60, s % 60);
+	else
+		snprintf(buf, len, "%lds", s);
+}
+
+static void
+meterreport(int done)
+{
+	long long bytes = meter.bytes, rows = meter.rows;
+	long long total = meter.totalbytes;
+	double t = now(), rate, avg, left = -1;
+	char b[16], tb[16], e[48], line[160];	/* e: any long, eta() */
+	int n;
+
+	if (total > 0 && bytes > total)
+		bytes = total;
+	rate = t > meter.lasttime ? (bytes - meter.lastbytes) /
+	    (t - meter.lasttime) : 0;
+	avg = t > meter.start ? bytes / (t - meter.start) : 0;
+	if (done)
+		left = 0;
+	else if (total > 0 && avg > 0)
+		left = (total - bytes) / avg;
+	meter.lasttime = t;
+	meter.lastbytes = bytes;
+
+	if (meterfd >= 0) {
+		n = snprintf(line, sizeof (line), "{\"bytes\": %lld, "
+		    "\"total_bytes\": %lld, \"rows\": %lld, "
+		    "\"total_rows\": %lld, \"mb_per_s\": %.2f, "
+		    "\"eta_s\": %.1f, \"elapsed_s\": %.1f, \"done\": %s}\n",
+		    bytes, total, rows, meter.totalrows, rate / 1048576, left,
+		    t - meter.start, done ? "true" : "false");
+		if (write(meterfd, line, n) == n)
+			return;
+		/* fall back to stderr */
+		fprintf(stderr, "ERROR: --progress fd %d: %s\n", meterfd,
+		    strerror(errno));
+		meterfd = -1;
+	}
+
+	sizestr(b, sizeof (b), bytes);
+	sizestr(tb, sizeof (tb), total);
+	if (done)
+		eta(e, sizeof (e), t - meter.start);
+	else if (left >= 0)
+		eta(e, sizeof (e), left);
+	else
+		strcpy(e, "?");
+	fprintf(stderr, "%s%s of %s", isatty(2) ? "\r" : "", b, tb);
+	if (total > 0)
+		fprintf(stderr, " (%.1f%%)", 100.0 * bytes / total);
+	fprintf(stderr, ", %lld rows, %.1f MB/s, %s %s%s", rows,
+	    (done ? avg : rate) / 1048576, done ? "done in" : "ETA", e,
+	    isatty(2) && !done ? "\033[K" : "\n");
+}
+
+static void *
+meterthread(void *arg)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&meter.lock);
+	while (!meter.stop) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += METER_INTERVAL;
+		if (pthread_cond_timedwait(&meter.cv, &meter.lock, &ts) ==
+		    ETIMEDOUT && !meter.stop)
+			meterreport(0);
+	}
+	pthread_mutex_unlock(&meter.lock);
+	return (NULL);
+}
+
+static void
+meterstart(long long bytes, long long rows)
+{
+	if (!metering)
+		return;
+	meter.totalbytes = bytes;
+	meter.totalrows = rows;
+	meter.start = meter.lasttime = now();
+	if (pthread_create(&meter.tid, NULL, meterthread, NULL) != 0) {
+		perror("Can't create thread; no progress reports");
+		metering = 0;
+	}
+}
+
+static void
+meterstop(void)
+{
+	if (!metering)
+		return;
+	pthread_mutex_lock(&meter.lock);
+	meter.stop = 1;
+	pthread_cond_signal(&meter.cv);
+	pthread_mutex_unlock(&meter.lock);
+	pthread_join(meter.tid, NULL);
+	meterreport(1);
+}
+
+/*
+ * Sharing a host: --max-read-rate paces input reads with a token bucket
+ * shared by every thread, charged before each batch is read; --idle moves
+ * the process to the idle CPU and I/O classes, so it only gets what the
+ * host's other work leaves; and --drop-behind evicts input from the page
+ * cache once it has been read, so a large dump doesn't push the host's own
+ * data out.
+ */
+#define	THROTTLE_BURST	0.1		/* seconds of credit to bank */
+#define	THROTTLE_CHUNK	(1024 * 1024)	/* single render read pacing */
+
+static pthread_mutex_t throttlelock = PTHREAD_MUTEX_INITIALIZER;
+static double throttlenext;		/* when the bucket is next empty */
+
+static void
+throttle(long long bytes)
+{
+	struct timespec ts;
+	double t, wait;
+
+	if (maxrate <= 0)
+		return;
+	pthread_mutex_lock(&throttlelock);
+	t = now();
+	if (throttlenext < t - THROTTLE_BURST)
+		throttlenext = t - THROTTLE_BURST;
+	throttlenext += bytes / maxrate;
+	wait = throttlenext - t;
+	pthread_mutex_unlock(&throttlelock);
+
+	if (wait > 0) {
+		ts.tv_sec = wait;
+		ts.tv_nsec = (wait - ts.tv_sec) * 1e9;
+		while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+			;
+	}
+}
+
+static void
+dropcache(int fd, off_t offset, off_t len)
+{
+#ifdef POSIX_FADV_DONTNEED
+	if (dropbehind && len > 0)
+		(void) posix_fadvise(fd, offset, len, POSIX_FADV_DONTNEED);
+#endif
+}
+
+/*
+ * The single file render, reading a chunk at a time so the reads can be
+ * paced and dropped.
+ */
+static int
+feedpaced(d2p_t *d2p, int infile)
+{
+	off_t pos = lseek(infile, 0, SEEK_CUR), next;
+	int err;
+
+	while (!d2p_done(d2p)) {
+		throttle(THROTTLE_CHUNK);
+		if ((err = d2p_feed_fd(d2p, infile, THROTTLE_CHUNK)) != D2P_OK)
+			return (err);
+		next = lseek(infile, 0, SEEK_CUR);
+		dropcache(infile, pos, next - pos);
+		if (next - pos < THROTTLE_CHUNK)
+			break;
+		pos = next;
+	}
+	return (D2P_OK);
+}
+
+#ifdef __linux__
+#ifndef SCHED_IDLE
+#define	SCHED_IDLE		5	/* older headers */
+#endif
+#define	IOPRIO_WHO_PROCESS	1
+#define	IOPRIO_CLASS_IDLE	3
+#define	IOPRIO_CLASS_SHIFT	13
+#endif
+
+/*
+ * Called before any threads are started, which inherit both settings.
+ */
+static void
+demote(void)
+{
+#ifdef SCHED_IDLE
+	struct sched_param sp;
+
+	memset(&sp, 0, sizeof (sp));
+	if (sched_setscheduler(0, SCHED_IDLE, &sp) != 0)
+		perror("WARNING: Can't set idle CPU priority");
+#else
+	if (nice(19) == -1)
+		perror("WARNING: Can't lower CPU priority");
+#endif
+#if defined(__linux__) && defined(SYS_ioprio_set)
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+	    IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) != 0)
+		perror("WARNING: Can't set idle I/O priority");
+#endif
+}
+
+/*
+ * Container limits.  In a cgroup the online CPU count is the host's; what
+ * can be used is the cgroup's CPU quota over its period (cpu.max in cgroup
+ * v2, cpu.cfs_quota_us and cpu.cfs_period_us in v1), and memory is capped
+ * by memory.max (memory.limit_in_bytes).  Any level up to the root may set
+ * a limit, so the smallest is taken.
+ */
+#define	CGROUP_ROOT	"/sys/fs/cgroup"
+
+/*
+ * This process's cgroup directory for controller ctrl, preferring the v2
+ * unified hierarchy.  rootlen is set to the length of its mount point.
+ */
+static int
+cgroupdir(const char *ctrl, char *dir, size_t len, size_t *rootlen, int *v2)
+{
+	char line[PATH_MAX], v1[PATH_MAX] = "", path[PATH_MAX], want[64];
+	char *c, *p;
+	size_t v1root = 0;
+	FILE *f;
+
+	*v2 = 0;
+	snprintf(want, sizeof (want), ",%s,", ctrl);
+	if ((f = fopen("/proc/self/cgroup", "r")) == NULL)
+		return (0);
+	while (fgets(line, sizeof (line), f) != NULL) {
+		line[strcspn(line, "\n")] = '\0';
+		if ((c = strchr(line, ':')) == NULL ||
+		    (p = strchr(c + 1, ':')) == NULL)
+			continue;
+		*p++ = '\0';
+		c++;
+		if (strcmp(p, "/") == 0)
+			p = "";
+		if (*c == '\0') {
+			snprintf(path, sizeof (path), "%s/cgroup.controllers",
+			    CGROUP_ROOT);
+			if (access(path, R_OK) == 0) {
+				snprintf(dir, len, "%s%s", CGROUP_ROOT, p);
+				*rootlen = strlen(CGROUP_ROOT);
+				*v2 = 1;
+			}
+		} else {
+			snprintf(path, sizeof (path), ",%s,", c);
+			if (strstr(path, want) != NULL) {
+				snprintf(v1, sizeof (v1), "%s/%s%s",
+				    CGROUP_ROOT, c, p);
+				v1root = strlen(CGROUP_ROOT) + 1 + strlen(c);
+			}
+		}
+	}
+	fclose(f);
+	if (!*v2 && v1[0] != '\0') {
+		snprintf(dir, len, "%s", v1);
+		*rootlen = v1root;
+	}
+	return (*v2 || v1[0] != '\0');
+}
+
+static long long
+cgroupll(const char *dir, const char *file)
+{
+	char path[PATH_MAX];
+	long long v;
+	FILE *f;
+
+	snprintf(path, sizeof (path), "%s/%s", dir, file);
+	if ((f = fopen(path, "r")) == NULL)
+		return (-1);
+	if (fscanf(f, "%lld", &v) != 1)
+		v = -1;			/* eg, "max" */
+	fclose(f);
+	return (v);
+}
+
+static double
+cgroupcpu(const char *dir, int v2)
+{
+	char path[PATH_MAX], max[32];
+	long long quota = -1, period = 0;
+	FILE *f;
+
+	if (v2) {
+		snprintf(path, sizeof (path), "%s/cpu.max", dir);
+		if ((f = fopen(path, "r")) == NULL)
+			return (0);
+		if (fscanf(f, "%31s %lld", max, &period) == 2 &&
+		    strcmp(max, "max") != 0)
+			quota = atoll(max);
+		fclose(f);
+	} else {
+		quota = cgroupll(dir, "cpu.cfs_quota_us");
+		period = cgroupll(dir, "cpu.cfs_period_us");
+	}
+	return (quota > 0 && period > 0 ? (double)quota / period : 0);
+}
+
+static double
+cgroupmem(const char *dir, int v2)
+{
+	long long v = cgroupll(dir, v2 ? "memory.max" :
+	    "memory.limit_in_bytes");
+
+	/* v1 says "unlimited" with a number near LLONG_MAX */
+	return (v > 0 && v < (1LL << 60) ? (double)v : 0);
+}
+
+/*
+ * The smallest limit func finds from this process's cgroup up, or 0.
+ */
+static double
+cgroupmin(const char *ctrl, double (*func)(const char *, int))
+{
+	char dir[PATH_MAX], *p;
+	size_t rootlen;
+	double v, min = 0;
+	int v2;
+
+	if (!cgroupdir(ctrl, dir, sizeof (dir), &rootlen, &v2))
+		return (0);
+	for (;;) {
+		if ((v = func(dir, v2)) > 0 && (min == 0 || v < min))
+			min = v;
+		if (strlen(dir) <= rootlen || (p = strrchr(dir, '/')) == NULL)
+			break;
+		*p = '\0';
+	}
+	return (min);
+}
+
+/*
+ * Default worker threads: the online CPUs, or fewer if the cgroup's quota
+ * allows fewer.
+ */
+static int
+cputhreads(void)
+{
+	long ncpu;
+	double quota;
+
+	if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		ncpu = 1;
+	if ((quota = cgroupmin("cpu", cgroupcpu)) > 0 && quota < ncpu)
+		ncpu = (long)ceil(quota);
+	return (ncpu > 0 ? (int)ncpu : 1);
+}
+
+/*
+ * Default --memory-budget: half the cgroup's memory limit, leaving the rest
+ * for libpng, zlib, the page cache and the process itself; else none.
+ */
+static long long
+cgroupbudget(void)
+{
+	return ((long long)(cgroupmin("memory", cgroupmem) / 2));
+}
+
+/*
+ * Threads to use when each needs perthread bytes, on top of fixed.
+ */
+static int
+fitthreads(int nthreads, long long perthread, long long fixed)
+{
+	long long n;
+
+	if (membudget <= 0 || perthread <= 0)
+		return (nthreads);
+	n = (membudget - fixed) / perthread;
+	if (n < 1)
+		n = 1;
+	return (n < nthreads ? (int)n : nthreads);
+}
+
+/*
+ * Asynchronous output (--async-write): png output is copied into one of two
+ * large aligned buffers, and a writer thread per output file writes each
+ * full buffer with a single write(2), while the render fills the other.
+ * Writeback of each buffer is started as soon as it is written, and waited
+ * for one buffer later (sync_file_range), so dirty pages stay bounded and
+ * are written steadily rather than in bursts.  --preallocate reserves the
+ * expected size up front (fallocate, keeping the file size), and whatever
+ * isn't used is released when the file is closed.
+ *
+ * The output is an ordinary stdio FILE (fopencookie), so the library and
+ * the png writers here use it unchanged; fclose() flushes, waits for the
+ * writer, and reports any write error.
+ */
+#ifdef __linux__
+typedef struct awriter {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cv;
+	pthread_t	tid;
+	int		fd;
+	unsigned char	*bufs[2];
+	size_t		lens[2];
+	int		fill;		/* buffer being filled */
+	int		pending;	/* buffer to write, or -1 */
+	int		closing;
+	int		error;		/* errno of a failed write */
+	off_t		off;		/* bytes written */
+	off_t		prev;		/* start of the previous write */
+} awriter_t;
+
+static void *
+awthread(void *arg)
+{
+	awriter_t *w = arg;
+	unsigned char *p;
+	ssize_t n;
+	size_t left;
+	off_t start;
+	uint64_t begin;
+	int b;
+
+	tracename("writer");
+	for (;;) {
+		pthread_mutex_lock(&w->lock);
+		while (w->pending < 0 && !w->closing)
+			pthread_cond_wait(&w->cv, &w->lock);
+		if ((b = w->pending) < 0) {
+			pthread_mutex_unlock(&w->lock);
+			break;
+		}
+		pthread_mutex_unlock(&w->lock);
+
+		begin = traceb();
+		start = w->off;
+		for (p = w->bufs[b], left = w->lens[b]; left > 0 &&
+		    !w->error; p += n, left -= n) {
+			if ((n = write(w->fd, p, left)) < 0) {
+				if (errno == EINTR)
+					n = 0;
+				else
+					w->error = errno;
+			}
+		}
+		w->off += w->lens[b] - left;
+#ifdef SYNC_FILE_RANGE_WRITE
+		/* start this buffer's writeback; wait for the last one's */
+		if (!w->error) {
+			if (start > w->prev) {
+				(void) sync_file_range(w->fd, w->prev,
+				    start - w->prev,
+				    SYNC_FILE_RANGE_WAIT_BEFORE |
+				    SYNC_FILE_RANGE_WRITE |
+				    SYNC_FILE_RANGE_WAIT_AFTER);
+			}
+			(void) sync_file_range(w->fd, start, w->off - start,
+			    SYNC_FILE_RANGE_WRITE);
+			w->prev = start;
+		}
+#endif
+		tracee("write", begin, (long)w->lens[b]);
+
+		pthread_mutex_lock(&w->lock);
+		w->pending = -1;
+		pthread_cond_broadcast(&w->cv);
+		pthread_mutex_unlock(&w->lock);
+	}
+	return (NULL);
+}
+
+/*
+ * Hand the filling buffer to the writer, once it has finished the other.
+ */
+static int
+awflush(awriter_t *w)
+{
+	int error;
+
+	pthread_mutex_lock(&w->lock);
+	while (w->pending >= 0)
+		pthread_cond_wait(&w->cv, &w->lock);
+	if ((error = w->error) == 0 && w->lens[w->fill] > 0) {
+		w->pending = w->fill;
+		w->fill ^= 1;
+		w->lens[w->fill] = 0;
+		pthread_cond_broadcast(&w->cv);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return (error);
+}
+
+static ssize_t
+awwrite(void *cookie, const char *buf, size_t size)
+{
+	awriter_t *w = cookie;
+	size_t done, n;
+	int error;
+
+	for (done = 0; done < size; done += n) {
+		n = awsize - w->lens[w->fill];
+		if (n > size - done)
+			n = size - done;
+		(void) memcpy(w->bufs[w->fill] + w->lens[w->fill],
+		    buf + done, n);
+		if ((w->lens[w->fill] += n) == awsize &&
+		    (error = awflush(w)) != 0) {
+			errno = error;
+			return (-1);
+		}
+	}
+	return (size);
+}
+
+static int
+awclose(void *cookie)
+{
+	awriter_t *w = cookie;
+	int error;
+
+	error = awflush(w);
+	pthread_mutex_lock(&w->lock);
+	w->closing = 1;
+	pthread_cond_broadcast(&w->cv);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->tid, NULL);
+	if (error == 0)
+		error = w->error;
+
+	/* release any preallocation past the end */
+	if (preallocate && error == 0 && ftruncate(w->fd, w->off) != 0)
+		error = errno;
+	if (close(w->fd) != 0 && error == 0)
+		error = errno;
+	pthread_mutex_destroy(&w->lock);
+	pthread_cond_destroy(&w->cv);
+	free(w->bufs[0]);
+	free(w->bufs[1]);
+	free(w);
+	if (error != 0) {
+		errno = error;
+		return (-1);
+	}
+	return (0);
+}
+#endif
+
+/*
+ * Open a png output file: through a writer thread with --async-write,
+ * else plain stdio.  expect is the likely size, for --preallocate (0 if
+ * unknown).
+ */
+static FILE *
+outopen(const char *path, long long expect)
+{
+#ifdef __linux__
+	cookie_io_functions_t io = { NULL, awwrite, NULL, awclose };
+	awriter_t *w;
+	FILE *fp;
+
+	if (awsize == 0)
+		return (fopen(path, "wb"));
+	if ((w = calloc(1, sizeof (awriter_t))) == NULL)
+		return (NULL);
+	w->pending = -1;
+	if ((w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+		free(w);
+		return (NULL);
+	}
+#ifdef FALLOC_FL_KEEP_SIZE
+	if (preallocate && expect > 0)
+		(void) fallocate(w->fd, FALLOC_FL_KEEP_SIZE, 0, expect);
+#endif
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cv, NULL);
+	if (posix_memalign((void **)&w->bufs[0], DIRECT_ALIGN, awsize) != 0 ||
+	    posix_memalign((void **)&w->bufs[1], DIRECT_ALIGN, awsize) != 0 ||
+	    pthread_create(&w->tid, NULL, awthread, w) != 0) {
+		(void) close(w->fd);
+		free(w->bufs[0]);
+		free(w->bufs[1]);
+		free(w);
+		return (NULL);
+	}
+	if ((fp = fopencookie(w, "wb", io)) == NULL) {
+		(void) awclose(w);
+		return (NULL);
+	}
+	/* the cookie buffers; stdio's own would only add a copy */
+	(void) setvbuf(fp, NULL, _IONBF, 0);
+	return (fp);
+#else
+	return (fopen(path, "wb"));
+#endif
+}
+
+/*
+ * Palette plugins.  A palette name that isn't built in is loaded from
+ * name.so on the plugin path, which must define it in its D2P_PLUGIN_SYMBOL
+ * array; a name with a / is a .so path itself, and its first palette is
+ * used.  Plugins stay loaded until exit, as clones of the context share
+ * their kernels.
+ */
+static const d2p_plugin_t *
+plugin(const char *name)
+{
+	const d2p_plugin_t *p;
+	const char *dirs, *want = name;
+	char path[PATH_MAX];
+	size_t len;
+	void *h;
+
+	if ((dirs = getenv("DUMP2PNG_PLUGINS")) == NULL)
+		dirs = PLUGIN_PATH;
+	for (;;) {
+		if (strchr(name, '/') != NULL) {
+			snprintf(path, sizeof (path), "%s", name);
+			want = NULL;
+		} else {
+			len = strcspn(dirs, ":");
+			snprintf(path, sizeof (path), "%.*s/%s.so", (int)len,
+			    dirs, name);
+			dirs += len;
+		}
+		if (access(path, F_OK) == 0) {
+			if ((h = dlopen(path, RTLD_NOW | RTLD_LOCAL)) == NULL ||
+			    (p = dlsym(h, D2P_PLUGIN_SYMBOL)) == NULL) {
+				fprintf(stderr, "ERROR: plugin %s: %s\n", path,
+				    dlerror());
+				return (NULL);
+			}
+			for (; p->name != NULL; p++) {
+				if (p->version != D2P_PLUGIN_VERSION) {
+					fprintf(stderr, "ERROR: plugin %s: "
+					    "version %d, expected %d\n", path,
+					    p->version, D2P_PLUGIN_VERSION);
+					return (NULL);
+				}
+				if (want == NULL || strcmp(p->name, want) == 0)
+					return (p);
+			}
+			fprintf(stderr, "ERROR: plugin %s has no palette %s\n",
+			    path, want != NULL ? want : "");
+			return (NULL);
+		}
+		if (want == NULL || *dirs++ == '\0')
+			return (NULL);
+	}
+}
+
+/*
+ * Palette files, -p file:path: a table of 256 RGB entries (per byte) or
+ * 65536 (per 16-bit little-endian word).  A path ending in .txt is a text
+ * table, with an entry per line, "r g b" or 0xrrggbb, and # comments; any
+ * other is binary, just its 768 or 196608 bytes of RGB triples, and is
+ * mapped rather than read, so that runs share the page cache copy and a
+ * batch's contexts share the one mapping.  The format goes by the name
+ * rather than the contents, as either can look like the other.  Tables
+ * stay until exit, like plugins.
+ */
+#define	PALFILE_PREFIX	"file:"
+#define	PALFILE_TEXT	".txt"
+#define	PALFILE_MAX	(65536 * 3)
+
+static int
+palfile(d2p_t *d2p, const char *name)
+{
+	const char *path = name + strlen(PALFILE_PREFIX);
+	size_t len = strlen(path), linesize = 0;
+	unsigned char *t, *map;
+	char *line = NULL, *p, *end;
+	struct stat st;
+	long v[3];
+	int fd, i, n, lineno = 0, entries = 0;
+	FILE *fp;
+
+	if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+		perror(path);
+		if (fd >= 0)
+			(void) close(fd);
+		return (-1);
+	}
+	if (len < strlen(PALFILE_TEXT) ||
+	    strcmp(&path[len - strlen(PALFILE_TEXT)], PALFILE_TEXT) != 0) {
+		if (st.st_size != 256 * 3 && st.st_size != PALFILE_MAX) {
+			fprintf(stderr, "ERROR: palette %s is %lld bytes; "
+			    "expected 768 or 196608 (or a " PALFILE_TEXT
+			    " text table)\n", path, (long long)st.st_size);
+			(void) close(fd);
+			return (-1);
+		}
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		(void) close(fd);
+		if (map == MAP_FAILED) {
+			perror(path);
+			return (-1);
+		}
+		if (d2p_set_palette_table(d2p, name, map, st.st_size / 3) !=
+		    D2P_OK) {
+			(void) munmap(map, st.st_size);
+			return (-1);
+		}
+		return (1);
+	}
+
+	if ((fp = fdopen(fd, "r")) == NULL || (t = malloc(PALFILE_MAX)) ==
+	    NULL) {
+		perror(path);
+		if (fp != NULL)
+			(void) fclose(fp);
+		else
+			(void) close(fd);
+		return (-1);
+	}
+	while (getline(&line, &linesize, fp) != -1) {
+		lineno++;
+		if ((p = strchr(line, '#')) != NULL)
+			*p = '\0';
+		for (n = 0, p = line; ; n++, p = end) {
+			while (isspace((unsigned char)*p))
+				p++;
+			if (*p == '\0')
+				break;
+			if (n == 3 || (v[n] = strtol(p, &end, 0)) < 0 ||
+			    end == p || v[n] > (n == 0 ? 0xffffff : 255))
+				goto bad;
+		}
+		if (n == 0)
+			continue;
+		if (n == 2 || (n == 3 && v[0] > 255) || entries == 65536)
+			goto bad;
+		if (n == 1) {
+			v[2] = v[0] & 0xff;
+			v[1] = v[0] >> 8 & 0xff;
+			v[0] >>= 16;
+		}
+		for (i = 0; i < 3; i++)
+			t[entries * 3 + i] = v[i];
+		entries++;
+	}
+	free(line);
+	(void) fclose(fp);
+	if (entries != 256 && entries != 65536) {
+		fprintf(stderr, "ERROR: palette %s has %d entries; expected "
+		    "256 or 65536\n", path, entries);
+		free(t);
+		return (-1);
+	}
+	if (d2p_set_palette_table(d2p, name, t, entries) != D2P_OK) {
+		free(t);
+		return (-1);
+	}
+	/* a 256 entry table was copied */
+	if (entries == 256)
+		free(t);
+	return (1);
+
+bad:
+	fprintf(stderr, "ERROR: palette %s line %d: expected \"r g b\" "
+	    "(0-255) or 0xrrggbb%s\n", path, lineno,
+	    entries == 65536 ? ", after 65536 entries" : "");
+	free(line);
+	free(t);
+	(void) fclose(fp);
+	return (-1);
+}
+
+/*
+ * Set a built-in palette (returning 0), or a palette file's or plugin's (1);
+ * -1 if none.
+ */
+static int
+setpalette(d2p_t *d2p, const char *name)
+{
+	const d2p_plugin_t *p;
+
+	if (d2p_set_palette(d2p, name) == D2P_OK)
+		return (0);
+	if (strncmp(name, PALFILE_PREFIX, strlen(PALFILE_PREFIX)) == 0)
+		return (palfile(d2p, name));
+	if ((p = plugin(name)) == NULL || d2p_set_palette_kernel(d2p,
+	    p->name, p->chrs, p->kernel, p->arg) != D2P_OK)
+		return (-1);
+	return (1);
+}
@@ -0,0 +1,2259 @@
+/*
+ * libdump2png	Visualize file data as a png, as a library.
+ *
+ * See libdump2png.h for the interface.  This holds the palettes, the row
+ * renderer, and png output through libpng.  All state lives in the render
+ * context.
+ *
+ * Copyright 2012 Joyent, Inc.  All rights reserved.
+ * Copyright 2012 Brendan Gregg.  All rights reserved.
+ *
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <time.h>
+#include <png.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#include "libdump2png.h"
+
+typedef enum {
+	GRAY = 0,
+	GRAY16B,
+	GRAY32B,
+	GRAY16L,
+	GRAY32L,
+	HUES,
+	HUES6,
+	FHUES,
+	COLOR,
+	COLOR16,
+	COLOR32,
+	RGB,
+	DVI,
+	X86,
+	X86_64,
+	CUSTOM		/* a caller's kernel; not in palnames */
+} palette_t;
+
+static const char *const palnames[] = {
+	"gray", "gray16b", "gray32b", "gray16l", "gray32l", "hues", "hues6",
+	"fhues", "color", "color16", "color32", "rgb", "dvi", "x86", "x86_64",
+	NULL
+};
+
+/*
+ * The coordinate map records, for runs of rows, the input offset of the
+ * first row; rows within a run follow on at the row stride.
+ */
+typedef struct mapseg {
+	int		row;
+	off_t		offset;
+} mapseg_t;
+
+#define	MAP_VERSION	1
+#define	MAP_HDR		24	/* version, pad, width, zoom, skip, chrs, n */
+#define	MAP_SEG		12	/* row, offset */
+
+typedef struct xprog xprog_t;	/* a compiled expression palette */
+
+#define	X64_WINDOW	32		/* x86_64 palette window, bytes */
+
+struct d2p {
+	/* settings */
+	palette_t	pal;
+	int		chrs;
+	int		width;
+	int		height;
+	int		zoom;
+	int		skip;
+	int		mask;
+	unsigned char	table[256 * 3];	/* per byte palettes */
+	int		hastable;
+	char		*palname;	/* custom palettes */
+	d2p_kernel_f	kernel;
+	void		*karg;
+	xprog_t		*prog;		/* expression palettes */
+	char		*source;	/* for the coordinate map */
+	mapseg_t	*segs;
+	int		nsegs;
+
+	/* render state */
+	int		started;
+	int		finished;
+	int		error;
+	int		y;		/* rows emitted */
+	unsigned char	last;		/* dvi state */
+	signed char	x64ring[X64_WINDOW];	/* x86_64 window state */
+	unsigned int	x64pos;
+	int		x64sum;
+	uint32_t	x64text;	/* bit per printable byte */
+	int		x64ntext;	/* bits set */
+	unsigned char	*inbuf;		/* one row stride of input */
+	size_t		infill;
+	unsigned char	*rgb;		/* one row of pixels */
+	unsigned char	*krgb;		/* kernel output, before zoom */
+	size_t		krgbsize;
+
+	/* outputs */
+	d2p_row_f	rowfunc;
+	void		*rowarg;
+	FILE		*pngfile;
+	unsigned char	*pngbuf;
+	size_t		pngsize;
+	size_t		pnglen;
+	png_structp	png;
+	png_infop	pnginfo;
+	int		pngerr;
+
+	/* statistics and tracing */
+	int		stats;		/* collect them */
+	d2p_stats_t	st;
+	d2p_trace_f	tracefn;
+	void		*tracearg;
+	int		perffd[D2P_NCOUNTERS];
+	int		perfslot[D2P_NCOUNTERS];	/* in a group read */
+	int		perfleader;
+	int		nperf;		/* counters open */
+	d2p_perf_t	perf;
+	int		timed;		/* stats, tracing or counters */
+};
+
+/*
+ * Statistics are timed per row or per I/O, with the vDSO clock, and only
+ * when enabled.
+ */
+static inline uint64_t
+nsnow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/*
+ * Hardware counters, opened as one group so a single read(2) returns them
+ * all.  Each stage adds the counts between a snapshot at its start and
+ * its end, as it does its time.
+ */
+#ifdef __linux__
+static const struct {
+	uint32_t	type;
+	uint64_t	config;
+} perfevents[D2P_NCOUNTERS] = {
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES }
+};
+#endif
+
+static void
+perfclose(d2p_t *d)
+{
+	int c;
+
+	for (c = 0; c < D2P_NCOUNTERS; c++) {
+		if (d->perf.avail & (1 << c))
+			(void) close(d->perffd[c]);
+	}
+	d->perf.avail = 0;
+	d->nperf = 0;
+}
+
+static int
+perfopen(d2p_t *d)
+{
+#ifdef __linux__
+	struct perf_event_attr attr;
+	int c, fd, leader = -1;
+
+	for (c = 0; c < D2P_NCOUNTERS; c++) {
+		memset(&attr, 0, sizeof (attr));
+		attr.size = sizeof (attr);
+		attr.type = perfevents[c].type;
+		attr.config = perfevents[c].config;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP;
+		if ((fd = syscall(SYS_perf_event_open, &attr, 0, -1,
+		    leader, 0)) < 0)
+			continue;
+		if (leader < 0) {
+			leader = fd;
+			d->perfleader = c;
+		}
+		d->perffd[c] = fd;
+		d->perfslot[c] = d->nperf++;
+		d->perf.avail |= 1 << c;
+	}
+#endif
+	return (d->nperf);
+}
+
+/* snapshot the counters into c */
+static void
+perfread(d2p_t *d, uint64_t *c)
+{
+	uint64_t buf[1 + D2P_NCOUNTERS];
+	int i;
+
+	if (d->nperf == 0)
+		return;
+	if (read(d->perffd[d->perfleader], buf, sizeof (buf)) <
+	    (ssize_t)((1 + d->nperf) * sizeof (uint64_t))) {
+		memset(c, 0, D2P_NCOUNTERS * sizeof (uint64_t));
+		return;
+	}
+	for (i = 0; i < D2P_NCOUNTERS; i++) {
+		c[i] = d->perf.avail & (1 << i) ?
+		    buf[1 + d->perfslot[i]] : 0;
+	}
+}
+
+/* add the counts since begin to stage, less nested writes since wbegin */
+static void
+perfadd(d2p_t *d, int stage, const uint64_t *begin, const uint64_t *wbegin)
+{
+	uint64_t now[D2P_NCOUNTERS];
+	int i;
+
+	if (d->nperf == 0)
+		return;
+	perfread(d, now);
+	for (i = 0; i < D2P_NCOUNTERS; i++) {
+		d->perf.count[stage][i] += now[i] - begin[i];
+		if (wbegin != NULL) {
+			d->perf.count[stage][i] -=
+			    d->perf.count[D2P_STAGE_WRITE][i] - wbegin[i];
+		}
+	}
+}
+
+static palette_t
+atopal(const char *opt)
+{
+	int i;
+
+	for (i = 0; palnames[i] != NULL; i++) {
+		if (strcmp(opt, palnames[i]) == 0)
+			return ((palette_t)i);
+	}
+	return ((palette_t)-1);
+}
+
+static int
+pal2chrs(palette_t pal)
+{
+	switch (pal) {
+		case RGB:
+			return (3);
+		case GRAY16B:
+		case GRAY16L:
+		case COLOR16:
+			return (2);
+		case GRAY32B:
+		case GRAY32L:
+		case COLOR32:
+			return (4);
+		default:
+			return (1);
+	}
+}
+
+static inline void
+map_hues(png_byte *ptr, unsigned char val)
+{
+	int v = val * 3;
+	if (v < 256) {
+		ptr[0] = v; ptr[1] = 0; ptr[2] = 0;
+	} else if (v < 512) {
+		ptr[0] = 0; ptr[1] = v % 256; ptr[2] = 0;
+	} else {
+		ptr[0] = 0; ptr[1] = 0; ptr[2] = v % 256;
+	}
+}
+
+static inline void
+map_fhues(png_byte *ptr, unsigned char val)
+{
+	int v = val * 6;
+	if (v < 256) {
+		ptr[0] = v; ptr[1] = 0; ptr[2] = 0;
+	} else if (v < 256 * 2) {
+		ptr[0] = 255; ptr[1] = v % 256; ptr[2] = v % 256;
+	} else if (v < 256 * 3) {
+		ptr[0] = 0; ptr[1] = v % 256; ptr[2] = 0;
+	} else if (v < 256 * 4) {
+		ptr[0] = v % 256; ptr[1] = 255; ptr[2] = v % 256;
+	} else if (v < 256 * 5) {
+		ptr[0] = 0; ptr[1] = 0; ptr[2] = v % 256;
+	} else {
+		ptr[0] = v % 256; ptr[1] = v % 256; ptr[2] = 255;
+	}
+}
+
+static inline void
+map_hues6(png_byte *ptr, unsigned char val)
+{
+	int v = val * 6;
+	if (v < 256) {
+		ptr[0] = v; ptr[1] = 0; ptr[2] = 0;
+	} else if (v < 256 * 2) {
+		ptr[0] = 0; ptr[1] = v % 256; ptr[2] = 0;
+	} else if (v < 256 * 3) {
+		ptr[0] = 0; ptr[1] = 0; ptr[2] = v % 256;
+	} else if (v < 256 * 4) {
+		ptr[0] = 0; ptr[1] = v % 256; ptr[2] = v % 256;
+	} else if (v < 256 * 5) {
+		ptr[0] = v % 256; ptr[1] = 0; ptr[2] = v % 256;
+	} else {
+		ptr[0] = v % 256; ptr[1] = v % 256; ptr[2] = 0;
+	}
+}
+
+static inline void
+map_color16(png_byte *ptr, unsigned short val)
+{
+	ptr[0] = (val & 0xfc00) >> 8;
+	ptr[1] = (val & 0x03c0) >> 2;
+	ptr[2] = (val & 0x001f) << 3;
+}
+
+static inline void
+map_color32(png_byte *ptr, unsigned long val)
+{
+	ptr[0] = (val & 0xff000000) >> 24;
+	ptr[1] = (val & 0x001fe000) >> 13;
+	ptr[2] = (val & 0x000001fe) >> 1;
+}
+
+static inline unsigned char
+c2v_binary(unsigned char c)
+{
+	switch (c) {
+		case 0x01: return (0xff);
+		case 0x02: return (0xcf);
+		case 0x03: return (0xaf);
+	}
+	return (0);
+}
+
+static inline unsigned char
+c2v_english(char c)
+{
+	switch (c) {
+		case 'e': return (0xff);
+		case 't': return (0xcf);
+		case 'a': return (0xaf);
+	}
+	return (0);
+}
+
+static inline unsigned char
+c2v_x86(unsigned char c)
+{
+	switch (c) {
+		case 0x8b: return (0xff);	/* movl */
+		case 0xe8: return (0xcf);	/* call */
+		case 0x85: return (0xaf);	/* testl */
+	}
+	return (0);
+}
+
+static void
+map_x86(unsigned char *rgb, unsigned char c)
+{
+	rgb[0] = rgb[1] = rgb[2] = 0;
+
+	rgb[0] = c2v_x86(c);
+	rgb[1] = c2v_english(c);
+	rgb[2] = c2v_binary(c);
+
+	/* default to grayscale */
+	if ((rgb[0] + rgb[1] + rgb[2]) == 0) {
+		rgb[0] = rgb[1] = rgb[2] = c;
+	}
+}
+
+/*
+ * x86_64: how well the bytes around each one fit x86-64 code.  Every pair
+ * of adjacent bytes has a score, from -8 (text, runs) to 8 (REX.W then a
+ * common opcode, push %rbp then REX.W, leave then ret), so that prefix,
+ * opcode, ModRM and SIB chains score on each link; the scores are computed
+ * once into a 64 Kbyte table.  Each byte is colored by the sum of the
+ * scores over the last X64_WINDOW bytes, kept as a rolling sum, so it costs
+ * a lookup, add and subtract per byte: code is red by how well it fits,
+ * windows of printable text green, and the rest gray.
+ */
+#define	X64_FLOOR	24		/* sum above most random data */
+#define	X64_SCALE	4		/* sum over the floor to red level */
+
+/* opcodes that take a ModRM byte: add, or, and, sub, xor, cmp, mov, lea... */
+static int
+x64modrmop(int c)
+{
+	switch (c) {
+		case 0x01: case 0x03: case 0x09: case 0x0b: case 0x21:
+		case 0x23: case 0x29: case 0x2b: case 0x31: case 0x33:
+		case 0x39: case 0x3b: case 0x63: case 0x84: case 0x85:
+		case 0x87: case 0x88: case 0x89: case 0x8a: case 0x8b:
+		case 0x8d:
+			return (1);
+	}
+	return (0);
+}
+
+/* group opcodes, with the operation in ModRM.reg and often an immediate */
+static int
+x64groupop(int c)
+{
+	switch (c) {
+		case 0x80: case 0x81: case 0x83: case 0xc0: case 0xc1:
+		case 0xc6: case 0xc7: case 0xd1: case 0xd3: case 0xf6:
+		case 0xf7: case 0xff:
+			return (1);
+	}
+	return (0);
+}
+
+/* the second byte of common 0x0f opcodes */
+static int
+x64escape(int c)
+{
+	if ((c & 0xf0) == 0x80)				/* jcc rel32 */
+		return (7);
+	if ((c & 0xf0) == 0x90 || (c & 0xf0) == 0x40)	/* setcc, cmovcc */
+		return (5);
+	switch (c) {
+		case 0x05: case 0x0b: case 0x10: case 0x11: case 0x1e:
+		case 0x1f: case 0x28: case 0x29: case 0x2e: case 0x57:
+		case 0x6f: case 0x7f: case 0xa2: case 0xaf: case 0xb6:
+		case 0xb7: case 0xbe: case 0xbf: case 0xd6: case 0xef:
+			return (7);
+	}
+	return (-2);
+}
+
+/* how likely b is as a ModRM byte: registers, stack and rip relative */
+static int
+x64modrm(int b)
+{
+	if (b >= 0xc0)
+		return (4);			/* register to register */
+	if ((b & 0xc7) == 0x44 || (b & 0xc7) == 0x45 || (b & 0xc7) == 0x05)
+		return (5);			/* disp8 off rsp/rbp, rip */
+	if ((b & 0xc0) == 0x80 || ((b & 0xc0) == 0 && (b & 7) != 4))
+		return (2);			/* disp32, or (reg) */
+	return (1);
+}
+
+static int
+x64pair(int a, int b)
+{
+	int s = 0;
+
+	/* prefixes, opcodes and operands */
+	if ((a & 0xf8) == 0x48 && (x64modrmop(b) || x64groupop(b) ||
+	    b == 0x0f || b == 0x98 || b == 0x99 || (b & 0xf8) == 0xb8))
+		s += 8;				/* REX.W */
+	else if ((a & 0xf8) == 0x40 && (x64modrmop(b) || x64groupop(b) ||
+	    b == 0x0f))
+		s += 4;				/* REX */
+	if (a == 0x41 && (b & 0xf0) == 0x50)
+		s += 6;				/* push/pop %r8-15 */
+	if (x64modrmop(a))
+		s += x64modrm(b);
+	if (x64groupop(a))
+		s += b >= 0xc0 ? 3 : 1;
+	if (((a & 0xc7) == 0x44 || (a & 0xc7) == 0x04) && b == 0x24)
+		s += 6;				/* SIB: (%rsp) */
+	if (a == 0x0f)
+		s += x64escape(b);
+	if (a == 0xff && ((b & 0xf8) == 0xd0 || (b & 0xf8) == 0xe0 ||
+	    b == 0x15 || b == 0x25))
+		s += 5;				/* indirect call, jmp */
+	if (((a & 0xf0) == 0x70 || a == 0xeb) && (b < 0x40 || b >= 0xc0))
+		s += 2;				/* short jumps go short */
+	if (a == 0xe8 || a == 0xe9 || (a & 0xf8) == 0xb8)
+		s += 1;				/* rel32, imm32 follow */
+
+	/* prologues, epilogues and padding */
+	if ((a == 0x55 || a == 0x53) && b == 0x48)
+		s += 8;				/* push %rbp; REX.W */
+	if (a == 0x89 && b == 0xe5)
+		s += 4;				/* mov %rsp, %rbp */
+	if (a == 0x41 && b >= 0x54 && b <= 0x57)
+		s += 2;				/* push %r12-15 */
+	if ((a == 0x5d || a == 0xc9 || a == 0x5b || a == 0xf3) && b == 0xc3)
+		s += 8;				/* pop %rbp; ret, leave; ret */
+	if (a == 0xc3 && (b == 0x90 || b == 0xcc || b == 0x66 ||
+	    b == 0x0f || b == 0x55 || b == 0xf3 || b == 0x41))
+		s += 6;				/* ret; padding or next */
+	if ((a == 0x66 && (b == 0x90 || b == 0x2e || b == 0x0f)) ||
+	    (a == 0x2e && b == 0x0f) || (a == 0xf3 && b == 0x0f) ||
+	    (a == 0xf2 && b == 0x0f) || (a == 0x1e && b == 0xfa))
+		s += 6;				/* nopw, sse, endbr64 */
+	if ((a == 0xcc || a == 0x90) && a == b)
+		s += 3;				/* int3, nop padding */
+
+	/* unlike code */
+	if (((a >= 'a' && a <= 'z') || a == ' ') &&
+	    ((b >= 'a' && b <= 'z') || b == ' '))
+		s -= 4;				/* text */
+	else if (a == b && a != 0xcc && a != 0x90)
+		s -= 2;				/* runs */
+
+	return (s < -8 ? -8 : s > 8 ? 8 : s);
+}
+
+/*
+ * The table is constant, so it is built once, on first use, and shared
+ * read-only by every context: clones (one per batch band, progressive
+ * chunk or fan-out target) cost nothing extra.
+ */
+static signed char x64scores[256 * 256];
+static pthread_once_t x64once = PTHREAD_ONCE_INIT;
+
+static void
+x64build(void)
+{
+	int a, b;
+
+	for (a = 0; a < 256; a++) {
+		for (b = 0; b < 256; b++)
+			x64scores[a << 8 | b] = x64pair(a, b);
+	}
+}
+
+/*
+ * Per byte palettes are precomputed into a 256 entry RGB table, held in the
+ * context.
+ */
+static int
+paltable(palette_t pal, unsigned char *table)
+{
+	unsigned char *t;
+	int c;
+
+	switch (pal) {
+		case GRAY:
+		case HUES:
+		case HUES6:
+		case FHUES:
+		case COLOR:
+		case X86:
+			break;
+		default:
+			return (0);
+	}
+
+	for (c = 0; c < 256; c++) {
+		t = &table[c * 3];
+		switch (pal) {
+			case GRAY:
+				t[0] = t[1] = t[2] = c;
+				break;
+			case HUES:
+				map_hues(t, c);
+				break;
+			case HUES6:
+				map_hues6(t, c);
+				break;
+			case FHUES:
+				map_fhues(t, c);
+				break;
+			case COLOR:
+				t[0] = c & 0xe0;
+				t[1] = (c & 0x1c) << 3;
+				t[2] = (c & 0x03) << 6;
+				break;
+			default:
+				map_x86(t, c);
+				break;
+		}
+	}
+	return (1);
+}
+
+/*
+ * A custom palette's row: the kernel colors every whole pixel of input in
+ * one call, and pixels are then averaged for zoom and masked here.
+ */
+static int
+kernelrow(d2p_t *d, const unsigned char *inbuf, int in, unsigned char *rgbout)
+{
+	unsigned char m = d->mask ? D2P_BYTE_MASK : 0xff;
+	unsigned char *k = rgbout;
+	size_t n, i, x, width = d->width, zoom = d->zoom;
+	unsigned long sum[3];
+
+	if (zoom > 1 && d->krgbsize < width * zoom * 3) {
+		free(d->krgb);
+		d->krgbsize = 0;
+		if ((d->krgb = malloc(width * zoom * 3)) == NULL)
+			return (D2P_ENOMEM);
+		d->krgbsize = width * zoom * 3;
+	}
+	if (zoom > 1)
+		k = d->krgb;
+	n = in / d->chrs / zoom;	/* whole output pixels */
+	if (n > width)
+		n = width;
+	if (n > 0)
+		d->kernel(d->karg, inbuf, k, n * zoom);
+
+	if (zoom > 1) {
+		for (x = 0; x < n; x++) {
+			sum[0] = sum[1] = sum[2] = 0;
+			for (i = x * zoom * 3; i < (x + 1) * zoom * 3; i += 3) {
+				sum[0] += k[i];
+				sum[1] += k[i + 1];
+				sum[2] += k[i + 2];
+			}
+			rgbout[x * 3] = sum[0] / zoom;
+			rgbout[x * 3 + 1] = sum[1] / zoom;
+			rgbout[x * 3 + 2] = sum[2] / zoom;
+		}
+	}
+	if (m != 0xff) {
+		for (i = 0; i < n * 3; i++)
+			rgbout[i] &= m;
+	}
+	memset(&rgbout[n * 3], 0, (width - n) * 3);
+	return (D2P_OK);
+}
+
+/*
+ * Expression palettes: "r = ...; g = ...; b = ..." over the input, with C
+ * operators, precedence and literals (and 'c' characters), and the
+ * functions popcount(), abs(), log2() (bit length), min() and max().  The
+ * input is b (a byte), w or W (a 16-bit word, little or big-endian), d or
+ * D (32-bit) and q (64-bit, little-endian); the widest used sets the bytes
+ * per pixel.  Channels are clamped to 0..255, and unset ones are 0.
+ *
+ * Expressions compile to a stack bytecode.  Each instruction runs over a
+ * block of pixels at a time, as a simple loop the compiler can vectorize,
+ * so dispatch is paid per block rather than per pixel.  Byte expressions
+ * are run once over all 256 values, into the palette table.
+ */
+#define	EXPR_OPS	256		/* max instructions */
+#define	EXPR_STACK	16		/* max evaluation depth */
+#define	EXPR_BLOCK	64		/* pixels per instruction pass */
+
+typedef enum {
+	X_CONST = 0, X_B, X_W, X_WB, X_D, X_DB, X_Q,
+	X_NEG, X_NOT, X_LNOT, X_POPCOUNT, X_ABS, X_LOG2,
+	X_MUL, X_DIV, X_MOD, X_ADD, X_SUB, X_SHL, X_SHR,
+	X_LT, X_LE, X_GT, X_GE, X_EQ, X_NE, X_AND, X_XOR, X_OR,
+	X_LAND, X_LOR, X_MIN, X_MAX, X_SELECT, X_STORE
+} xop_t;
+
+typedef struct xinst {
+	int		op;
+	int64_t		k;		/* constant, or store channel */
+} xinst_t;
+
+struct xprog {
+	int		n;
+	int		chrs;
+	xinst_t		code[EXPR_OPS];
+};
+
+typedef struct xparse {
+	const char	*p;
+	xprog_t		*prog;
+	int		depth;
+	int		err;
+} xparse_t;
+
+static const struct {
+	const char	*tok;
+	int		prec;
+	int		op;
+} xbinops[] = {
+	{ "||", 1, X_LOR }, { "&&", 2, X_LAND }, { "==", 6, X_EQ },
+	{ "!=", 6, X_NE }, { "<<", 8, X_SHL }, { ">>", 8, X_SHR },
+	{ "<=", 7, X_LE }, { ">=", 7, X_GE }, { "|", 3, X_OR },
+	{ "^", 4, X_XOR }, { "&", 5, X_AND }, { "<", 7, X_LT },
+	{ ">", 7, X_GT }, { "+", 9, X_ADD }, { "-", 9, X_SUB },
+	{ "*", 10, X_MUL }, { "/", 10, X_DIV }, { "%", 10, X_MOD },
+	{ NULL }
+};
+
+static const struct {
+	const char	*name;
+	int		op;
+	int		chrs;
+} xvars[] = {
+	{ "b", X_B, 1 }, { "w", X_W, 2 }, { "W", X_WB, 2 },
+	{ "d", X_D, 4 }, { "D", X_DB, 4 }, { "q", X_Q, 8 },
+	{ NULL }
+};
+
+static const struct {
+	const char	*name;
+	int		op;
+	int		args;
+} xfuncs[] = {
+	{ "popcount", X_POPCOUNT, 1 }, { "abs", X_ABS, 1 },
+	{ "log2", X_LOG2, 1 }, { "min", X_MIN, 2 }, { "max", X_MAX, 2 },
+	{ NULL }
+};
+
+static void xternary(xparse_t *x);
+
+static void
+xemit(xparse_t *x, int op, int64_t k, int push)
+{
+	if (x->err)
+		return;
+	if (x->prog->n == EXPR_OPS ||
+	    (x->depth += push) > EXPR_STACK) {
+		x->err = 1;
+		return;
+	}
+	x->prog->code[x->prog->n].op = op;
+	x->prog->code[x->prog->n++].k = k;
+}
+
+static int
+xpeek(xparse_t *x, const char *tok)
+{
+	while (isspace((unsigned char)*x->p))
+		x->p++;
+	return (strncmp(x->p, tok, strlen(tok)) == 0);
+}
+
+static void
+xexpect(xparse_t *x, const char *tok)
+{
+	if (!xpeek(x, tok))
+		x->err = 1;
+	else
+		x->p += strlen(tok);
+}
+
+static size_t
+xident(xparse_t *x)
+{
+	size_t len = 0;
+
+	while (isalnum((unsigned char)x->p[len]) || x->p[len] == '_')
+		len++;
+	return (len);
+}
+
+static void
+xprimary(xparse_t *x)
+{
+	const char *start;
+	char *end;
+	size_t len;
+	int i, a;
+
+	if (x->err)
+		return;
+	if (xpeek(x, "(")) {
+		x->p++;
+		xternary(x);
+		xexpect(x, ")");
+		return;
+	}
+	if (x->p[0] == '\'' && x->p[1] != '\0' && x->p[2] == '\'') {
+		xemit(x, X_CONST, (unsigned char)x->p[1], 1);
+		x->p += 3;
+		return;
+	}
+	if (isdigit((unsigned char)*x->p)) {
+		errno = 0;
+		xemit(x, X_CONST, (int64_t)strtoull(x->p, &end, 0), 1);
+		if (errno != 0 || isalnum((unsigned char)*end))
+			x->err = 1;
+		else
+			x->p = end;
+		return;
+	}
+	start = x->p;
+	if ((len = xident(x)) == 0) {
+		x->err = 1;
+		return;
+	}
+	for (i = 0; xvars[i].name != NULL; i++) {
+		if (strlen(xvars[i].name) == len &&
+		    strncmp(start, xvars[i].name, len) == 0) {
+			x->p += len;
+			xemit(x, xvars[i].op, 0, 1);
+			if (xvars[i].chrs > x->prog->chrs)
+				x->prog->chrs = xvars[i].chrs;
+			return;
+		}
+	}
+	for (i = 0; xfuncs[i].name != NULL; i++) {
+		if (strlen(xfuncs[i].name) == len &&
+		    strncmp(start, xfuncs[i].name, len) == 0) {
+			x->p += len;
+			xexpect(x, "(");
+			for (a = 0; a < xfuncs[i].args && !x->err; a++) {
+				if (a > 0)
+					xexpect(x, ",");
+				xternary(x);
+			}
+			xexpect(x, ")");
+			xemit(x, xfuncs[i].op, 0, 1 - xfuncs[i].args);
+			return;
+		}
+	}
+	x->err = 1;
+}
+
+static void
+xunary(xparse_t *x)
+{
+	int op;
+
+	if (xpeek(x, "-"))
+		op = X_NEG;
+	else if (xpeek(x, "~"))
+		op = X_NOT;
+	else if (xpeek(x, "!"))
+		op = X_LNOT;
+	else if (xpeek(x, "+"))
+		op = -1;
+	else {
+		xprimary(x);
+		return;
+	}
+	x->p++;
+	xunary(x);
+	if (op >= 0)
+		xemit(x, op, 0, 0);
+}
+
+/*
+ * Binary operators, by precedence climbing.  The operator is matched
+ * first (xbinops lists "&&" before "&", and so on, so the longest wins)
+ * and only then checked against minprec, so that a low "&&" isn't taken
+ * for an "&".
+ */
+static void
+xbinary(xparse_t *x, int minprec)
+{
+	int i;
+
+	xunary(x);
+	while (!x->err) {
+		for (i = 0; xbinops[i].tok != NULL; i++) {
+			if (xpeek(x, xbinops[i].tok))
+				break;
+		}
+		if (xbinops[i].tok == NULL || xbinops[i].prec < minprec)
+			return;
+		x->p += strlen(xbinops[i].tok);
+		xbinary(x, xbinops[i].prec + 1);
+		xemit(x, xbinops[i].op, 0, -1);
+	}
+}
+
+static void
+xternary(xparse_t *x)
+{
+	xbinary(x, 1);
+	if (x->err || !xpeek(x, "?"))
+		return;
+	x->p++;
+	xternary(x);
+	xexpect(x, ":");
+	xternary(x);
+	xemit(x, X_SELECT, 0, -2);
+}
+
+/*
+ * Compile expr; returns NULL with *errpos set to the offset of the error.
+ */
+static xprog_t *
+xcompile(const char *expr, int *errpos)
+{
+	static const char chan[] = "rgb";
+	xparse_t x;
+	size_t len;
+
+	memset(&x, 0, sizeof (x));
+	x.p = expr;
+	if ((x.prog = calloc(1, sizeof (xprog_t))) == NULL)
+		return (NULL);
+	x.prog->chrs = 1;
+	for (;;) {
+		while (isspace((unsigned char)*x.p) || *x.p == ';' ||
+		    *x.p == ',')
+			x.p++;
+		if (*x.p == '\0')
+			break;
+		if ((len = xident(&x)) != 1 || strchr(chan, *x.p) == NULL) {
+			x.err = 1;
+			break;
+		}
+		len = strchr(chan, *x.p) - chan;
+		x.p++;
+		if (xpeek(&x, "==") || !xpeek(&x, "=")) {
+			x.err = 1;
+			break;
+		}
+		x.p++;
+		xternary(&x);
+		xemit(&x, X_STORE, len, -1);
+		if (!x.err && !xpeek(&x, ";") && !xpeek(&x, ",") &&
+		    *x.p != '\0')
+			x.err = 1;
+		if (x.err)
+			break;
+	}
+	if (x.err || x.prog->n == 0) {
+		if (errpos != NULL)
+			*errpos = x.p - expr;
+		free(x.prog);
+		return (NULL);
+	}
+	return (x.prog);
+}
+
+/*
+ * Run prog over n (up to EXPR_BLOCK) pixels.
+ */
+static void
+xrun(const xprog_t *prog, const unsigned char *in, unsigned char *rgb,
+    size_t n)
+{
+	int64_t st[EXPR_STACK][EXPR_BLOCK], *a = NULL, *b = NULL, *c;
+	const xinst_t *xi;
+	size_t i, chrs = prog->chrs;
+	uint64_t v;
+	int sp = 0, j;
+
+	memset(rgb, 0, n * 3);
+	for (xi = prog->code; xi < &prog->code[prog->n]; xi++) {
+		if (xi->op <= X_Q) {
+			a = st[sp++];
+		} else if (xi->op >= X_MUL && xi->op <= X_MAX) {
+			b = st[--sp];
+			a = st[sp - 1];
+		} else {
+			a = st[sp - 1];
+		}
+		switch (xi->op) {
+			case X_CONST:
+				for (i = 0; i < n; i++)
+					a[i] = xi->k;
+				break;
+			case X_B:
+				for (i = 0; i < n; i++)
+					a[i] = in[i * chrs];
+				break;
+			case X_W:
+				for (i = 0; i < n; i++)
+					a[i] = in[i * chrs] |
+					    in[i * chrs + 1] << 8;
+				break;
+			case X_WB:
+				for (i = 0; i < n; i++)
+					a[i] = in[i * chrs] << 8 |
+					    in[i * chrs + 1];
+				break;
+			case X_D:
+				for (i = 0; i < n; i++)
+					a[i] = in[i * chrs] |
+					    in[i * chrs + 1] << 8 |
+					    in[i * chrs + 2] << 16 |
+					    (int64_t)in[i * chrs + 3] << 24;
+				break;
+			case X_DB:
+				for (i = 0; i < n; i++)
+					a[i] = (int64_t)in[i * chrs] << 24 |
+					    in[i * chrs + 1] << 16 |
+					    in[i * chrs + 2] << 8 |
+					    in[i * chrs + 3];
+				break;
+			case X_Q:
+				for (i = 0; i < n; i++) {
+					for (v = 0, j = 7; j >= 0; j--)
+						v = v << 8 | in[i * chrs + j];
+					a[i] = v;
+				}
+				break;
+			case X_NEG:
+				for (i = 0; i < n; i++)
+					a[i] = -(uint64_t)a[i];
+				break;
+			case X_NOT:
+				for (i = 0; i < n; i++)
+					a[i] = ~a[i];
+				break;
+			case X_LNOT:
+				for (i = 0; i < n; i++)
+					a[i] = !a[i];
+				break;
+			case X_POPCOUNT:
+				for (i = 0; i < n; i++)
+					a[i] = __builtin_popcountll(a[i]);
+				break;
+			case X_ABS:
+				for (i = 0; i < n; i++)
+					a[i] = a[i] < 0 ? -(uint64_t)a[i] :
+					    a[i];
+				break;
+			case X_LOG2:
+				for (i = 0; i < n; i++)
+					a[i] = a[i] == 0 ? 0 :
+					    64 - __builtin_clzll(a[i]);
+				break;
+			case X_MUL:
+				for (i = 0; i < n; i++)
+					a[i] = (uint64_t)a[i] * b[i];
+				break;
+			case X_DIV:
+				for (i = 0; i < n; i++)
+					a[i] = b[i] == 0 ? 0 : b[i] == -1 ?
+					    -(uint64_t)a[i] : a[i] / b[i];
+				break;
+			case X_MOD:
+				for (i = 0; i < n; i++)
+					a[i] = b[i] == 0 || b[i] == -1 ? 0 :
+					    a[i] % b[i];
+				break;
+			case X_ADD:
+				for (i = 0; i < n; i++)
+					a[i] = (uint64_t)a[i] + b[i];
+				break;
+			case X_SUB:
+				for (i = 0; i < n; i++)
+					a[i] = (uint64_t)a[i] - b[i];
+				break;
+			case X_SHL:
+				for (i = 0; i < n; i++)
+					a[i] = (uint64_t)a[i] << (b[i] & 63);
+				break;
+			case X_SHR:
+				for (i = 0; i < n; i++)
+					a[i] = a[i] >> (b[i] & 63);
+				break;
+			case X_LT:
+				for (i = 0; i < n; i++)
+					a[i] = a[i] < b[i];
+				break;
+			case X_LE:
+				for (i = 0; i < n; i++)
+					a[i] = a[i] <= b[i];
+				break;
+			case X_GT:
+				for (i = 0; i < n; i++)
+					a[i] = a[i] > b[i];
+				break;
+			case X_GE:
+				for (i = 0; i < n; i++)
+					a[i] = a[i] >= b[i];
+				break;
+			case X_EQ:
+				for (i = 0; i < n; i++)
+					a[i] = a[i] == b[i];
+				break;
+			case X_NE:
+				for (i = 0; i < n; i++)
+					a[i] = a[i] != b[i];
+				break;
+			case X_AND:
+				for (i = 0; i < n; i++)
+					a[i] &= b[i];
+				break;
+			case X_XOR:
+				for (i = 0; i < n; i++)
+					a[i] ^= b[i];
+				break;
+			case X_OR:
+				for (i = 0; i < n; i++)
+					a[i] |= b[i];
+				break;
+			case X_LAND:
+				for (i = 0; i < n; i++)
+					a[i] = a[i] != 0 && b[i] != 0;
+				break;
+			case X_LOR:
+				for (i = 0; i < n; i++)
+					a[i] = a[i] != 0 || b[i] != 0;
+				break;
+			case X_MIN:
+				for (i = 0; i < n; i++)
+					a[i] = a[i] < b[i] ? a[i] : b[i];
+				break;
+			case X_MAX:
+				for (i = 0; i < n; i++)
+					a[i] = a[i] > b[i] ? a[i] : b[i];
+				break;
+			case X_SELECT:
+				c = st[--sp];
+				b = st[--sp];
+				a = st[sp - 1];
+				for (i = 0; i < n; i++)
+					a[i] = a[i] != 0 ? b[i] : c[i];
+				break;
+			case X_STORE:
+				sp--;
+				for (i = 0; i < n; i++)
+					rgb[i * 3 + xi->k] = a[i] < 0 ? 0 :
+					    a[i] > 255 ? 255 : a[i];
+				break;
+		}
+	}
+}
+
+static void
+xkernel(void *arg, const unsigned char *in, unsigned char *rgb, size_t n)
+{
+	const xprog_t *prog = arg;
+	size_t i, len;
+
+	for (i = 0; i < n; i += len) {
+		len = n - i < EXPR_BLOCK ? n - i : EXPR_BLOCK;
+		xrun(prog, &in[i * prog->chrs], &rgb[i * 3], len);
+	}
+}
+
+/*
+ * 16-bit palette tables, by little-endian word.  At 192 Kbytes the table
+ * misses L1 but sits in L2, and a plain loop lets the loads overlap well
+ * enough: blocking the lookups and prefetching entries measured slower.
+ */
+static void
+table16(void *arg, const unsigned char *in, unsigned char *rgb, size_t n)
+{
+	const unsigned char *t = arg, *e;
+	size_t i;
+
+	for (i = 0; i < n; i++, in += 2, rgb += 3) {
+		e = &t[(in[0] | in[1] << 8) * 3];
+		rgb[0] = e[0];
+		rgb[1] = e[1];
+		rgb[2] = e[2];
+	}
+}
+
+/*
+ * An x86_64 row, carrying the window from row to row in the context.
+ */
+static int
+x64row(d2p_t *d, const unsigned char *inbuf, int in, unsigned char *rgbout)
+{
+	unsigned char m = d->mask ? D2P_BYTE_MASK : 0xff;
+	unsigned char last = d->last, c;
+	const signed char *t = x64scores;
+	signed char *ring = d->x64ring, s;
+	unsigned int pos = d->x64pos;
+	int x, xx, z, f, base, sum = d->x64sum, zoom = d->zoom;
+	int ntext = d->x64ntext;
+	uint32_t text = d->x64text;
+	unsigned long rgb[3];
+
+	for (x = 0, xx = 0; x < d->width; x++) {
+		if (xx >= in) {
+			rgbout[x * 3] = 0;
+			rgbout[x * 3 + 1] = 0;
+			rgbout[x * 3 + 2] = 0;
+			continue;
+		}
+		rgb[0] = rgb[1] = rgb[2] = 0;
+		for (z = 0; z < zoom; z++, xx++) {
+			c = inbuf[xx];
+			s = t[last << 8 | c];
+			sum += s - ring[pos];
+			ring[pos] = s;
+			pos = (pos + 1) & (X64_WINDOW - 1);
+			ntext -= text >> (X64_WINDOW - 1);
+			text = text << 1 | ((c >= 0x20 && c < 0x7f) ||
+			    c == '\n' || c == '\t');
+			ntext += text & 1;
+			last = c;
+
+			/* red by fit over the floor, blending out the gray */
+			f = (sum - X64_FLOOR) * X64_SCALE;
+			base = c >> 1;
+			if (f > 0) {
+				f = f > 256 ? 256 : f;
+				rgb[0] += base + ((f * (255 - base)) >> 8);
+				rgb[1] += (base * (256 - f)) >> 8;
+				rgb[2] += (base * (256 - f)) >> 8;
+			} else if (ntext >= X64_WINDOW - 2) {
+				rgb[0] += c >> 2;
+				rgb[1] += 0x80 + base;
+				rgb[2] += c >> 2;
+			} else {
+				rgb[0] += c;
+				rgb[1] += c;
+				rgb[2] += c;
+			}
+		}
+		if (zoom > 1) {
+			rgb[0] /= zoom;
+			rgb[1] /= zoom;
+			rgb[2] /= zoom;
+		}
+		rgbout[x * 3] = rgb[0] & m;
+		rgbout[x * 3 + 1] = rgb[1] & m;
+		rgbout[x * 3 + 2] = rgb[2] & m;
+	}
+
+	d->last = last;
+	d->x64pos = pos;
+	d->x64sum = sum;
+	d->x64text = text;
+	d->x64ntext = ntext;
+	return (D2P_OK);
+}
+
+/*
+ * Convert one row of input data to rgb pixels.  x tracks the destination
+ * pixel x offset.  xx tracks the offset in the input buffer, which can step
+ * at a faster rate when it's necessary to combine multiple bytes into one
+ * pixel (with zoom or certain palettes).  in is the number of valid bytes in
+ * inbuf; pixels beyond it are black.
+ */
+static int
+dorow(d2p_t *d, const unsigned char *inbuf, int in, unsigned char *rgbout)
+{
+	unsigned char last = d->last, rgb[3] = { 0, 0, 0 };
+	unsigned char m = d->mask ? D2P_BYTE_MASK : 0xff;
+	const unsigned char *t;
+	int xx, x, z, chrs = d->chrs, zoom = d->zoom;
+	unsigned long sum[3];
+
+	if (d->kernel != NULL)
+		return (kernelrow(d, inbuf, in, rgbout));
+	if (d->pal == X86_64)
+		return (x64row(d, inbuf, in, rgbout));
+
+	if (d->hastable) {
+		for (x = 0, xx = 0; x < d->width; x++) {
+			if (xx >= in) {
+				rgbout[x * 3] = 0;
+				rgbout[x * 3 + 1] = 0;
+				rgbout[x * 3 + 2] = 0;
+				continue;
+			}
+			if (zoom == 1) {
+				t = &d->table[inbuf[xx++] * 3];
+				rgbout[x * 3] = t[0] & m;
+				rgbout[x * 3 + 1] = t[1] & m;
+				rgbout[x * 3 + 2] = t[2] & m;
+				continue;
+			}
+			sum[0] = sum[1] = sum[2] = 0;
+			for (z = 0; z < zoom; z++) {
+				t = &d->table[inbuf[xx++] * 3];
+				sum[0] += t[0];
+				sum[1] += t[1];
+				sum[2] += t[2];
+			}
+			rgbout[x * 3] = (sum[0] / zoom) & m;
+			rgbout[x * 3 + 1] = (sum[1] / zoom) & m;
+			rgbout[x * 3 + 2] = (sum[2] / zoom) & m;
+		}
+		return (D2P_OK);
+	}
+
+	for (x = 0, xx = 0; x < d->width; x++) {
+		if (xx + chrs > in) {
+			(&rgbout[x * 3])[0] = 0;
+			(&rgbout[x * 3])[1] = 0;
+			(&rgbout[x * 3])[2] = 0;
+			continue;
+		}
+
+		sum[0] = sum[1] = sum[2] = 0;
+
+		for (z = 0; z < d->zoom; z++, xx++) {
+			switch (d->pal) {
+				case GRAY:
+					rgb[0] = inbuf[xx];
+					rgb[1] = inbuf[xx];
+					rgb[2] = inbuf[xx];
+					break;
+				/*
+				 * Gray 16|32 skip bytes and map
+				 * significant byte to grayscale.
+				 */
+				case GRAY16B:
+					rgb[0] = inbuf[xx];
+					rgb[1] = inbuf[xx];
+					rgb[2] = inbuf[xx++];
+					break;
+				case GRAY32B:
+					rgb[0] = inbuf[xx];
+					rgb[1] = inbuf[xx];
+					rgb[2] = inbuf[xx];
+					xx += 3;
+					break;
+				case GRAY16L:
+					rgb[0] = inbuf[++xx];
+					rgb[1] = inbuf[xx];
+					rgb[2] = inbuf[xx];
+					break;
+				case GRAY32L:
+					xx += 3;
+					rgb[0] = inbuf[xx];
+					rgb[1] = inbuf[xx];
+					rgb[2] = inbuf[xx];
+					break;
+				case HUES:
+					map_hues(&rgb[0], inbuf[xx]);
+					break;
+				case HUES6:
+					map_hues6(&rgb[0], inbuf[xx]);
+					break;
+				case FHUES:
+					map_fhues(&rgb[0], inbuf[xx]);
+					break;
+				/*
+				 * Color palettes mask and shifts bits
+				 * into RGB
+				 */
+				case COLOR:
+					rgb[0] = inbuf[xx] & 0xe0;
+					rgb[1] = (inbuf[xx] & 0x1c) << 3;
+					rgb[2] = (inbuf[xx] & 0x03) << 6;
+					break;
+				case COLOR16:
+					map_color16(&rgb[0],
+					    inbuf[xx] + (inbuf[xx + 1] << 8));
+					xx++;
+					break;
+				case COLOR32:
+					map_color32(&rgb[0],
+					    inbuf[xx] +
+					    (inbuf[xx + 1] << 8) +
+					    (inbuf[xx + 2] << 16) +
+					    ((unsigned long)inbuf[xx + 3] << 24));
+					xx += 3;
+					break;
+				/*
+				 * RGB uses sequential bytes for RGB
+				 */
+				case RGB:
+					rgb[0] = inbuf[xx++];
+					rgb[1] = inbuf[xx++];
+					rgb[2] = inbuf[xx];
+					break;
+				case X86:
+					map_x86(&rgb[0], inbuf[xx]);
+					break;
+				case DVI:
+					rgb[0] = abs(inbuf[xx] - last);
+					rgb[1] = inbuf[xx];
+					rgb[2] = (inbuf[xx] + last) / 2;
+					break;
+				default:
+					return (D2P_EINVAL);
+			}
+
+			if (d->zoom > 1) {
+				sum[0] += rgb[0];
+				sum[1] += rgb[1];
+				sum[2] += rgb[2];
+			}
+		}
+
+		if (d->zoom > 1) {
+			rgb[0] = sum[0] / d->zoom;
+			rgb[1] = sum[1] / d->zoom;
+			rgb[2] = sum[2] / d->zoom;
+		}
+
+		rgb[0] &= m;
+		rgb[1] &= m;
+		rgb[2] &= m;
+
+		(&rgbout[x * 3])[0] = rgb[0];
+		(&rgbout[x * 3])[1] = rgb[1];
+		(&rgbout[x * 3])[2] = rgb[2];
+
+		last = inbuf[x];
+	}
+
+	d->last = last;
+	return (D2P_OK);
+}
+
+/*
+ * Contexts and settings
+ */
+d2p_t *
+d2p_create(void)
+{
+	d2p_t *d;
+
+	if ((d = calloc(1, sizeof (d2p_t))) == NULL)
+		return (NULL);
+	d->width = 1024;
+	d->zoom = 1;
+	d->skip = 1;
+	d->mask = 1;
+	(void) d2p_set_palette(d, "x86");
+	return (d);
+}
+
+d2p_t *
+d2p_clone(const d2p_t *src)
+{
+	d2p_t *d;
+
+	if ((d = d2p_create()) == NULL)
+		return (NULL);
+	d->pal = src->pal;
+	d->chrs = src->chrs;
+	d->width = src->width;
+	d->height = src->height;
+	d->zoom = src->zoom;
+	d->skip = src->skip;
+	d->mask = src->mask;
+	d->hastable = src->hastable;
+	memcpy(d->table, src->table, sizeof (d->table));
+	d->kernel = src->kernel;
+	d->karg = src->karg;
+	if ((src->palname != NULL &&
+	    (d->palname = strdup(src->palname)) == NULL) ||
+	    (src->prog != NULL &&
+	    (d->prog = malloc(sizeof (xprog_t))) == NULL)) {
+		d2p_destroy(d);
+		return (NULL);
+	}
+	if (src->prog != NULL) {
+		memcpy(d->prog, src->prog, sizeof (xprog_t));
+		d->karg = d->prog;
+	}
+	if (src->source != NULL && (d2p_set_origin(d, src->source,
+	    src->segs[0].offset) != D2P_OK)) {
+		d2p_destroy(d);
+		return (NULL);
+	}
+	return (d);
+}
+
+void
+d2p_destroy(d2p_t *d)
+{
+	if (d == NULL)
+		return;
+	if (d->png != NULL)
+		png_destroy_write_struct(&d->png, &d->pnginfo);
+	free(d->inbuf);
+	free(d->rgb);
+	free(d->krgb);
+	free(d->palname);
+	free(d->prog);
+	free(d->source);
+	free(d->segs);
+	perfclose(d);
+	free(d);
+}
+
+const char *
+d2p_strerror(int err)
+{
+	switch (err) {
+		case D2P_OK:
+			return ("success");
+		case D2P_ENOMEM:
+			return ("out of memory");
+		case D2P_EINVAL:
+			return ("invalid argument");
+		case D2P_EIO:
+			return ("input read failed");
+		case D2P_EPNG:
+			return ("png encoding or output failed");
+		case D2P_ENOSPC:
+			return ("png output buffer too small");
+		case D2P_ESTATE:
+			return ("render already started");
+		case D2P_ECALLBACK:
+			return ("row callback aborted");
+		case D2P_ENOTSUP:
+			return ("not supported on this system");
+		default:
+			return ("unknown error");
+	}
+}
+
+int
+d2p_set_palette(d2p_t *d, const char *name)
+{
+	palette_t pal;
+
+	if (d->started)
+		return (D2P_ESTATE);
+	if ((int)(pal = atopal(name)) < 0)
+		return (D2P_EINVAL);
+	if (pal == X86_64)
+		(void) pthread_once(&x64once, x64build);
+	d->pal = pal;
+	d->chrs = pal2chrs(pal);
+	d->hastable = paltable(pal, d->table);
+	d->kernel = NULL;
+	free(d->palname);
+	d->palname = NULL;
+	free(d->prog);
+	d->prog = NULL;
+	return (D2P_OK);
+}
+
+int
+d2p_set_palette_kernel(d2p_t *d, const char *name, int chrs,
+    d2p_kernel_f func, void *arg)
+{
+	char *copy;
+
+	if (d->started)
+		return (D2P_ESTATE);
+	if (name == NULL || func == NULL || chrs < 1 || chrs > D2P_CHRS_MAX)
+		return (D2P_EINVAL);
+	if ((copy = strdup(name)) == NULL)
+		return (D2P_ENOMEM);
+	free(d->palname);
+	d->palname = copy;
+	free(d->prog);
+	d->prog = NULL;
+	d->pal = CUSTOM;
+	d->chrs = chrs;
+	d->hastable = 0;
+	d->kernel = func;
+	d->karg = arg;
+	return (D2P_OK);
+}
+
+int
+d2p_set_palette_table(d2p_t *d, const char *name, const unsigned char *rgb,
+    int entries)
+{
+	int err;
+
+	if (entries != 256 && entries != 65536)
+		return (D2P_EINVAL);
+	if ((err = d2p_set_palette_kernel(d, name, entries == 256 ? 1 : 2,
+	    table16, (void *)rgb)) != D2P_OK || entries == 65536)
+		return (err);
+	memcpy(d->table, rgb, sizeof (d->table));
+	d->kernel = NULL;
+	d->karg = NULL;
+	d->hastable = 1;
+	return (D2P_OK);
+}
+
+int
+d2p_set_palette_expr(d2p_t *d, const char *expr, int *errpos)
+{
+	unsigned char in[256];
+	xprog_t *prog;
+	int c, err, pos = -1;
+
+	if (d->started)
+		return (D2P_ESTATE);
+	if ((prog = xcompile(expr, &pos)) == NULL) {
+		if (errpos != NULL)
+			*errpos = pos;
+		return (pos >= 0 ? D2P_EINVAL : D2P_ENOMEM);
+	}
+	if ((err = d2p_set_palette_kernel(d, expr, prog->chrs, xkernel,
+	    prog)) != D2P_OK) {
+		free(prog);
+		return (err);
+	}
+	if (prog->chrs > 1) {
+		d->prog = prog;
+		return (D2P_OK);
+	}
+
+	/* bytes: the table, from all 256 of them */
+	for (c = 0; c < 256; c++)
+		in[c] = c;
+	for (c = 0; c < 256; c += EXPR_BLOCK)
+		xrun(prog, &in[c], &d->table[c * 3], EXPR_BLOCK);
+	free(prog);
+	d->kernel = NULL;
+	d->karg = NULL;
+	d->hastable = 1;
+	return (D2P_OK);
+}
+
+#define	D2P_SETTER(field, min)					\
+int								\
+d2p_set_##field(d2p_t *d, int field)				\
+{								\
+	if (d->started)						\
+		return (D2P_ESTATE);				\
+	if (field < (min))					\
+		return (D2P_EINVAL);				\
+	d->field = field;					\
+	return (D2P_OK);					\
+}								\
+								\
+int								\
+d2p_get_##field(const d2p_t *d)					\
+{								\
+	return (d->field);					\
+}
+
+D2P_SETTER(width, 1)
+D2P_SETTER(height, 0)
+D2P_SETTER(zoom, 1)
+D2P_SETTER(skip, 1)
+D2P_SETTER(mask, 0)
+
+const char *
+d2p_get_palette(const d2p_t *d)
+{
+	if (d->pal == CUSTOM)
+		return (d->palname);
+	return (palnames[d->pal]);
+}
+
+int
+d2p_get_chrs(const d2p_t *d)
+{
+	return (d->chrs);
+}
+
+const char *const *
+d2p_palettes(void)
+{
+	return (palnames);
+}
+
+size_t
+d2p_row_bytes(const d2p_t *d)
+{
+	return ((size_t)d->width * d->chrs * d->zoom);
+}
+
+size_t
+d2p_row_stride(const d2p_t *d)
+{
+	return (d2p_row_bytes(d) * d->skip);
+}
+
+int
+d2p_height_for(const d2p_t *d, off_t size)
+{
+	return (ceil((float)(size / (d->zoom * d->skip * d->chrs)) /
+	    d->width));
+}
+
+/*
+ * Coordinate map
+ */
+int
+d2p_set_origin(d2p_t *d, const char *source, off_t offset)
+{
+	char *s;
+	mapseg_t *seg;
+
+	if (d->started)
+		return (D2P_ESTATE);
+	if (source == NULL || offset < 0)
+		return (D2P_EINVAL);
+	if ((s = strdup(source)) == NULL ||
+	    (seg = malloc(sizeof (mapseg_t))) == NULL) {
+		free(s);
+		return (D2P_ENOMEM);
+	}
+	free(d->source);
+	free(d->segs);
+	d->source = s;
+	d->segs = seg;
+	d->segs[0].row = 0;
+	d->segs[0].offset = offset;
+	d->nsegs = 1;
+	return (D2P_OK);
+}
+
+int
+d2p_add_map_run(d2p_t *d, int row, off_t offset)
+{
+	mapseg_t *segs;
+
+	if (d->started)
+		return (D2P_ESTATE);
+	if (d->source == NULL || row < d->segs[d->nsegs - 1].row ||
+	    offset < 0)
+		return (D2P_EINVAL);
+	if (row == d->segs[d->nsegs - 1].row) {
+		d->segs[d->nsegs - 1].offset = offset;
+		return (D2P_OK);
+	}
+	if ((segs = realloc(d->segs, (d->nsegs + 1) * sizeof (mapseg_t))) ==
+	    NULL)
+		return (D2P_ENOMEM);
+	d->segs = segs;
+	d->segs[d->nsegs].row = row;
+	d->segs[d->nsegs].offset = offset;
+	d->nsegs++;
+	return (D2P_OK);
+}
+
+static void
+put32(unsigned char *p, unsigned long v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static unsigned long
+get32(const unsigned char *p)
+{
+	return ((unsigned long)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]);
+}
+
+size_t
+d2p_map_chunk(const d2p_t *d, unsigned char *buf, size_t size)
+{
+	size_t len;
+	int i;
+
+	if (d->source == NULL)
+		return (0);
+	len = MAP_HDR + (size_t)d->nsegs * MAP_SEG + strlen(d->source);
+	if (buf == NULL || size < len)
+		return (len);
+
+	memset(buf, 0, MAP_HDR);
+	buf[0] = MAP_VERSION;
+	put32(&buf[4], d->width);
+	put32(&buf[8], d->zoom);
+	put32(&buf[12], d->skip);
+	put32(&buf[16], d->chrs);
+	put32(&buf[20], d->nsegs);
+	for (i = 0; i < d->nsegs; i++) {
+		put32(&buf[MAP_HDR + i * MAP_SEG], d->segs[i].row);
+		put32(&buf[MAP_HDR + i * MAP_SEG + 4],
+		    (unsigned long long)d->segs[i].offset >> 32);
+		put32(&buf[MAP_HDR + i * MAP_SEG + 8], d->segs[i].offset);
+	}
+	memcpy(&buf[MAP_HDR + d->nsegs * MAP_SEG], d->source,
+	    strlen(d->source));
+	return (len);
+}
+
+int
+d2p_locate(const void *map, size_t maplen, int x, int y, off_t *offp,
+    size_t *lenp, char *source, size_t srcsize)
+{
+	const unsigned char *m = map;
+	unsigned long width, zoom, skip, chrs, nsegs, i;
+	const unsigned char *seg = NULL;
+	size_t srclen;
+	off_t offset;
+
+	if (maplen < MAP_HDR || m[0] != MAP_VERSION)
+		return (D2P_EINVAL);
+	width = get32(&m[4]);
+	zoom = get32(&m[8]);
+	skip = get32(&m[12]);
+	chrs = get32(&m[16]);
+	nsegs = get32(&m[20]);
+	if (nsegs == 0 || nsegs > (maplen - MAP_HDR) / MAP_SEG ||
+	    x < 0 || x >= width || y < 0)
+		return (D2P_EINVAL);
+
+	/* the last run starting at or before y */
+	for (i = 0; i < nsegs; i++) {
+		if (get32(&m[MAP_HDR + i * MAP_SEG]) > (unsigned long)y)
+			break;
+		seg = &m[MAP_HDR + i * MAP_SEG];
+	}
+	if (seg == NULL)
+		return (D2P_EINVAL);
+
+	offset = (off_t)((unsigned long long)get32(&seg[4]) << 32 |
+	    get32(&seg[8]));
+	*offp = offset + (off_t)(y - get32(seg)) * width * zoom * chrs * skip +
+	    (off_t)x * zoom * chrs;
+	*lenp = zoom * chrs;
+
+	if (source != NULL && srcsize > 0) {
+		srclen = maplen - MAP_HDR - nsegs * MAP_SEG;
+		if (srclen >= srcsize)
+			srclen = srcsize - 1;
+		memcpy(source, &m[MAP_HDR + nsegs * MAP_SEG], srclen);
+		source[srclen] = '\0';
+	}
+	return (D2P_OK);
+}
+
+/*
+ * Outputs
+ */
+int
+d2p_set_row_callback(d2p_t *d, d2p_row_f func, void *arg)
+{
+	if (d->started)
+		return (D2P_ESTATE);
+	d->rowfunc = func;
+	d->rowarg = arg;
+	return (D2P_OK);
+}
+
+int
+d2p_set_png_buffer(d2p_t *d, void *buf, size_t size)
+{
+	if (d->started)
+		return (D2P_ESTATE);
+	d->pngbuf = buf;
+	d->pngsize = size;
+	d->pngfile = NULL;
+	return (D2P_OK);
+}
+
+int
+d2p_set_png_file(d2p_t *d, FILE *fp)
+{
+	if (d->started)
+		return (D2P_ESTATE);
+	d->pngfile = fp;
+	d->pngbuf = NULL;
+	return (D2P_OK);
+}
+
+size_t
+d2p_png_length(const d2p_t *d)
+{
+	return (d->pnglen);
+}
+
+static void
+png_error_fn(png_structp png, png_const_charp msg)
+{
+	longjmp(png_jmpbuf(png), 1);
+}
+
+static void
+png_warn_fn(png_structp png, png_const_charp msg)
+{
+}
+
+static void
+png_write_fn(png_structp png, png_bytep data, png_size_t len)
+{
+	d2p_t *d = png_get_io_ptr(png);
+	uint64_t t = d->timed ? nsnow() : 0, pc[D2P_NCOUNTERS];
+
+	if (d->timed)
+		perfread(d, pc);
+
+	if (d->pngbuf != NULL) {
+		if (d->pnglen + len > d->pngsize) {
+			d->pngerr = D2P_ENOSPC;
+			png_error(png, "buffer full");
+		}
+		memcpy(&d->pngbuf[d->pnglen], data, len);
+	} else if (fwrite(data, 1, len, d->pngfile) != len) {
+		d->pngerr = D2P_EPNG;
+		png_error(png, "write failed");
+	}
+	d->pnglen += len;
+	if (d->timed) {
+		uint64_t e = nsnow();
+
+		d->st.write_ns += e - t;
+		perfadd(d, D2P_STAGE_WRITE, pc, NULL);
+		d->st.writes++;
+		d->st.bytes_out += len;
+		if (d->tracefn != NULL)
+			d->tracefn(d->tracearg, "write", t, e);
+	}
+}
+
+static void
+png_flush_fn(png_structp png)
+{
+	d2p_t *d = png_get_io_ptr(png);
+
+	if (d->pngfile != NULL)
+		fflush(d->pngfile);
+}
+
+static int
+pngfail(d2p_t *d)
+{
+	d->error = d->pngerr != D2P_OK ? d->pngerr : D2P_EPNG;
+	return (d->error);
+}
+
+/*
+ * Allocate buffers and write the png header, on the first feed.
+ */
+static int
+start(d2p_t *d)
+{
+	png_text pngtitle;
+
+	if (d->started)
+		return (d->error);
+	d->started = 1;
+
+	d->inbuf = malloc(d2p_row_stride(d));
+	d->rgb = malloc((size_t)d->width * 3);
+	if (d->inbuf == NULL || d->rgb == NULL)
+		return (d->error = D2P_ENOMEM);
+
+	if (d->pngbuf == NULL && d->pngfile == NULL)
+		return (D2P_OK);
+	if (d->height == 0)
+		return (d->error = D2P_EINVAL);
+
+	d->png = png_create_write_struct(PNG_LIBPNG_VER_STRING, d,
+	    png_error_fn, png_warn_fn);
+	if (d->png == NULL ||
+	    (d->pnginfo = png_create_info_struct(d->png)) == NULL)
+		return (d->error = D2P_ENOMEM);
+
+	if (setjmp(png_jmpbuf(d->png)))
+		return (pngfail(d));
+
+	png_set_write_fn(d->png, d, png_write_fn, png_flush_fn);
+	png_set_IHDR(d->png, d->pnginfo, d->width, d->height, 8,
+	    PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE,
+	    PNG_FILTER_TYPE_BASE);
+
+	pngtitle.compression = PNG_TEXT_COMPRESSION_NONE;
+	pngtitle.key = "Title";
+	pngtitle.text = "dump2png";
+	png_set_text(d->png, d->pnginfo, &pngtitle, 1);
+
+	if (d->source != NULL) {
+		png_unknown_chunk map;
+
+		memcpy(map.name, D2P_MAP_CHUNK, 5);
+		map.size = d2p_map_chunk(d, NULL, 0);
+		if ((map.data = malloc(map.size)) == NULL)
+			return (d->error = D2P_ENOMEM);
+		(void) d2p_map_chunk(d, map.data, map.size);
+		map.location = PNG_HAVE_IHDR;
+		png_set_keep_unknown_chunks(d->png, PNG_HANDLE_CHUNK_ALWAYS,
+		    (png_const_bytep)D2P_MAP_CHUNK, 1);
+		png_set_unknown_chunks(d->png, d->pnginfo, &map, 1);
+		free(map.data);
+	}
+
+	png_write_info(d->png, d->pnginfo);
+	return (D2P_OK);
+}
+
+/*
+ * Render the current row from in bytes of input, and pass it to the
+ * outputs.
+ */
+static int
+emitrow(d2p_t *d, const unsigned char *in, size_t len)
+{
+	uint64_t t = 0, e, w = 0;
+	uint64_t pc[D2P_NCOUNTERS], wc[D2P_NCOUNTERS];
+	int err;
+
+	if (len > d2p_row_bytes(d))
+		len = d2p_row_bytes(d);
+	if (d->timed) {
+		perfread(d, pc);
+		t = nsnow();
+		if (len > 0 && in[0] == 0 && memcmp(in, in + 1, len - 1) == 0)
+			d->st.zero_rows++;
+	}
+	if ((err = dorow(d, in, len, d->rgb)) != D2P_OK)
+		return (d->error = err);
+	if (d->timed) {
+		e = nsnow();
+		d->st.colorize_ns += e - t;
+		perfadd(d, D2P_STAGE_COLORIZE, pc, NULL);
+		if (d->tracefn != NULL)
+			d->tracefn(d->tracearg, "colorize", t, e);
+		w = d->st.write_ns;
+		memcpy(wc, d->perf.count[D2P_STAGE_WRITE], sizeof (wc));
+		perfread(d, pc);
+		t = nsnow();
+	}
+
+	if (d->rowfunc != NULL &&
+	    d->rowfunc(d->rowarg, d->y, d->rgb, d->width) != 0)
+		return (d->error = D2P_ECALLBACK);
+
+	if (d->png != NULL) {
+		if (setjmp(png_jmpbuf(d->png)))
+			return (pngfail(d));
+		png_write_row(d->png, d->rgb);
+	}
+
+	/* encode time, less the writes it made */
+	if (d->timed) {
+		e = nsnow();
+		d->st.encode_ns += e - t - (d->st.write_ns - w);
+		perfadd(d, D2P_STAGE_ENCODE, pc, wc);
+		d->st.rows++;
+		if (d->tracefn != NULL)
+			d->tracefn(d->tracearg, "encode", t, e);
+	}
+	d->y++;
+	return (D2P_OK);
+}
+
+/*
+ * Input
+ */
+int
+d2p_done(const d2p_t *d)
+{
+	return (d->height > 0 && d->y >= d->height);
+}
+
+int
+d2p_rows(const d2p_t *d)
+{
+	return (d->y);
+}
+
+int
+d2p_feed(d2p_t *d, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	size_t stride = d2p_row_stride(d), n;
+	int err;
+
+	if ((err = start(d)) != D2P_OK)
+		return (err);
+	if (d->timed)
+		d->st.bytes_in += len;
+
+	while (len > 0 && !d2p_done(d)) {
+		/* whole rows straight from the caller's buffer */
+		if (d->infill == 0 && len >= stride) {
+			if ((err = emitrow(d, p, stride)) != D2P_OK)
+				return (err);
+			p += stride;
+			len -= stride;
+			continue;
+		}
+		n = stride - d->infill < len ? stride - d->infill : len;
+		memcpy(&d->inbuf[d->infill], p, n);
+		d->infill += n;
+		p += n;
+		len -= n;
+		if (d->infill == stride) {
+			d->infill = 0;
+			if ((err = emitrow(d, d->inbuf, stride)) != D2P_OK)
+				return (err);
+		}
+	}
+
+	return (D2P_OK);
+}
+
+int
+d2p_feed_iov(d2p_t *d, const struct iovec *iov, int iovcnt)
+{
+	int i, err;
+
+	for (i = 0; i < iovcnt; i++) {
+		if ((err = d2p_feed(d, iov[i].iov_base, iov[i].iov_len)) !=
+		    D2P_OK)
+			return (err);
+	}
+	return (D2P_OK);
+}
+
+/*
+ * Read from fd a row stride at a time, straight into the row buffer.
+ */
+int
+d2p_feed_fd(d2p_t *d, int fd, off_t len)
+{
+	size_t stride = d2p_row_stride(d), want;
+	ssize_t n;
+	int err;
+
+	if ((err = start(d)) != D2P_OK)
+		return (err);
+
+	while (len != 0 && !d2p_done(d)) {
+		want = stride - d->infill;
+		if (len > 0 && want > len)
+			want = len;
+		if (d->timed) {
+			uint64_t t, e, pc[D2P_NCOUNTERS];
+
+			perfread(d, pc);
+			t = nsnow();
+			n = read(fd, &d->inbuf[d->infill], want);
+			e = nsnow();
+			d->st.read_ns += e - t;
+			perfadd(d, D2P_STAGE_READ, pc, NULL);
+			d->st.reads++;
+			if (n > 0)
+				d->st.bytes_in += n;
+			if (d->tracefn != NULL)
+				d->tracefn(d->tracearg, "read", t, e);
+		} else {
+			n = read(fd, &d->inbuf[d->infill], want);
+		}
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return (d->error = D2P_EIO);
+		}
+		if (n == 0)
+			break;
+		d->infill += n;
+		if (len > 0)
+			len -= n;
+		if (d->infill == stride) {
+			d->infill = 0;
+			if ((err = emitrow(d, d->inbuf, stride)) != D2P_OK)
+				return (err);
+		}
+	}
+
+	return (D2P_OK);
+}
+
+/*
+ * Flush a partial row, pad the image to its height with black rows, and
+ * finish the png.
+ */
+int
+d2p_finish(d2p_t *d)
+{
+	int err;
+
+	if ((err = start(d)) != D2P_OK)
+		return (err);
+	if (d->finished)
+		return (D2P_OK);
+	d->finished = 1;
+
+	if (d->infill > 0 && !d2p_done(d)) {
+		if ((err = emitrow(d, d->inbuf, d->infill)) != D2P_OK)
+			return (err);
+		d->infill = 0;
+	}
+	while (d->y < d->height) {
+		if ((err = emitrow(d, d->inbuf, 0)) != D2P_OK)
+			return (err);
+	}
+
+	if (d->png != NULL) {
+		uint64_t t = d->timed ? nsnow() : 0, w = d->st.write_ns, e;
+		uint64_t pc[D2P_NCOUNTERS], wc[D2P_NCOUNTERS];
+
+		if (d->timed) {
+			perfread(d, pc);
+			memcpy(wc, d->perf.count[D2P_STAGE_WRITE], sizeof (wc));
+		}
+		if (setjmp(png_jmpbuf(d->png)))
+			return (pngfail(d));
+		png_write_end(d->png, NULL);
+		if (d->pngfile != NULL && fflush(d->pngfile) != 0)
+			return (d->error = D2P_EPNG);
+		if (d->timed) {
+			e = nsnow();
+			d->st.encode_ns += e - t - (d->st.write_ns - w);
+			perfadd(d, D2P_STAGE_ENCODE, pc, wc);
+			if (d->tracefn != NULL)
+				d->tracefn(d->tracearg, "encode", t, e);
+		}
+	}
+
+	return (D2P_OK);
+}
+
+int
+d2p_set_stats(d2p_t *d, int enable)
+{
+	if (d->started)
+		return (D2P_ESTATE);
+	d->stats = enable;
+	d->timed = d->stats || d->tracefn != NULL || d->nperf > 0;
+	return (D2P_OK);
+}
+
+void
+d2p_get_stats(const d2p_t *d, d2p_stats_t *st)
+{
+	*st = d->st;
+}
+
+int
+d2p_set_trace(d2p_t *d, d2p_trace_f func, void *arg)
+{
+	if (d->started)
+		return (D2P_ESTATE);
+	d->tracefn = func;
+	d->tracearg = arg;
+	d->timed = d->stats || d->tracefn != NULL || d->nperf > 0;
+	return (D2P_OK);
+}
+
+/*
+ * Counters are opened here, so they count the calling thread: enable them
+ * on the thread that will render.
+ */
+int
+d2p_set_perf(d2p_t *d, int enable)
+{
+	int err = D2P_OK;
+
+	if (d->started)
+		return (D2P_ESTATE);
+	perfclose(d);
+	memset(&d->perf, 0, sizeof (d->perf));
+	if (enable && perfopen(d) == 0)
+		err = D2P_ENOTSUP;
+	d->timed = d->stats || d->tracefn != NULL || d->nperf > 0;
+	return (err);
+}
+
+void
+d2p_get_perf(const d2p_t *d, d2p_perf_t *perf)
+{
+	*perf = d->perf;
+}
+
+int
+d2p_render_row(d2p_t *d, const unsigned char *in, size_t inlen,
+    unsigned char *rgb)
+{
+	if (inlen > d2p_row_bytes(d))
+		inlen = d2p_row_bytes(d);
+	return (dorow(d, in, inlen, rgb));
+}
@@ -0,0 +1,265 @@
+/*
+ * libdump2png	Visualize file data as a png, as a library.
+ *
+ * A render context (d2p_t) holds the palette and geometry settings, and the
+ * state of one render.  Input bytes are fed in from buffers, file
+ * descriptors or iovecs; each image row takes width * zoom * chrs bytes,
+ * and skips a further (skip - 1) rows worth.  Finished rows are passed to
+ * a row callback as RGB, and/or encoded as a png into a caller buffer or
+ * stdio FILE.
+ *
+ * There is no global state: contexts are independent, and separate
+ * contexts may be used concurrently from different threads.  A context
+ * itself is not thread safe.  Functions return D2P_OK (0) or a negative
+ * D2P_E* error code, and never exit the process.
+ *
+ * Typical use:
+ *
+ *	d2p_t *d = d2p_create();
+ *	d2p_set_palette(d, "x86");
+ *	d2p_set_width(d, 1024);
+ *	d2p_set_height(d, d2p_height_for(d, size));
+ *	d2p_set_png_buffer(d, buf, bufsize);
+ *	d2p_feed(d, data, size);
+ *	d2p_finish(d);
+ *	... d2p_png_length(d) bytes of png are in buf ...
+ *	d2p_destroy(d);
+ *
+ * Copyright 2012 Joyent, Inc.  All rights reserved.
+ * Copyright 2012 Brendan Gregg.  All rights reserved.
+ *
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+#ifndef _LIBDUMP2PNG_H
+#define	_LIBDUMP2PNG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define	D2P_OK		0
+#define	D2P_ENOMEM	(-1)	/* out of memory */
+#define	D2P_EINVAL	(-2)	/* invalid argument */
+#define	D2P_EIO		(-3)	/* input read failed */
+#define	D2P_EPNG	(-4)	/* png encoding or output failed */
+#define	D2P_ENOSPC	(-5)	/* png output buffer too small */
+#define	D2P_ESTATE	(-6)	/* not valid once rendering has started */
+#define	D2P_ECALLBACK	(-7)	/* row callback returned non-zero */
+#define	D2P_ENOTSUP	(-8)	/* not available on this system */
+
+#define	D2P_BYTE_MASK	0xfe	/* applied to each channel when masking */
+
+typedef struct d2p d2p_t;
+
+/*
+ * Row callback: y is the row number, rgb holds width pixels of 3 bytes.
+ * Return non-zero to abort the render.
+ */
+typedef int (*d2p_row_f)(void *arg, int y, const unsigned char *rgb,
+    int width);
+
+/* contexts */
+d2p_t *d2p_create(void);
+d2p_t *d2p_clone(const d2p_t *d);	/* settings only, not outputs */
+void d2p_destroy(d2p_t *d);
+const char *d2p_strerror(int err);
+
+/* settings; must precede the first feed */
+int d2p_set_palette(d2p_t *d, const char *name);
+int d2p_set_width(d2p_t *d, int width);
+int d2p_set_height(d2p_t *d, int height);	/* 0: rows as fed */
+int d2p_set_zoom(d2p_t *d, int zoom);
+int d2p_set_skip(d2p_t *d, int skip);
+int d2p_set_mask(d2p_t *d, int mask);
+
+const char *d2p_get_palette(const d2p_t *d);
+int d2p_get_width(const d2p_t *d);
+int d2p_get_height(const d2p_t *d);
+int d2p_get_zoom(const d2p_t *d);
+int d2p_get_skip(const d2p_t *d);
+int d2p_get_mask(const d2p_t *d);
+int d2p_get_chrs(const d2p_t *d);	/* input bytes per unzoomed pixel */
+const char *const *d2p_palettes(void);	/* NULL terminated names */
+
+/*
+ * Custom palettes: a kernel colors a span of n pixels, from n * chrs bytes
+ * of in to n * 3 bytes of rgb, and is called once per row (or zoom * width
+ * pixels, which are then averaged), so it can be vectorized like the
+ * built-in ones.  The mask is applied after it.  Clones share func and arg,
+ * which must be safe to call from several threads at once.
+ */
+#define	D2P_CHRS_MAX	64	/* max input bytes per pixel */
+
+typedef void (*d2p_kernel_f)(void *arg, const unsigned char *in,
+    unsigned char *rgb, size_t n);
+
+int d2p_set_palette_kernel(d2p_t *d, const char *name, int chrs,
+    d2p_kernel_f func, void *arg);
+
+/*
+ * Expression palettes, eg "r = b & 0xf0; g = (b == 'H') * 255; b =
+ * popcount(b) * 32": each of r, g and b is set from an expression of the
+ * input, b (byte), w or W (16-bit word, little or big-endian), d or D
+ * (32-bit) or q (64-bit), with C operators and popcount(), abs(), log2()
+ * (bit length), min() and max().  Results are clamped to 0..255.  Byte
+ * expressions become a table; wider ones run as bytecode over spans.  On a
+ * syntax error, D2P_EINVAL is returned and *errpos (if set) is the offset.
+ */
+int d2p_set_palette_expr(d2p_t *d, const char *expr, int *errpos);
+
+/*
+ * Table palettes: rgb holds entries (256 or 65536) RGB triples, indexed by
+ * byte or by 16-bit little-endian word.  A 256 entry table is copied; a
+ * 65536 entry one is not, and must stay valid while the context or its
+ * clones use it.
+ */
+int d2p_set_palette_table(d2p_t *d, const char *name,
+    const unsigned char *rgb, int entries);
+
+/*
+ * Palette plugins: a shared object defines an array of these named
+ * D2P_PLUGIN_SYMBOL, ended by an entry with a NULL name, for dump2png to
+ * dlopen() and pass to d2p_set_palette_kernel().
+ */
+#define	D2P_PLUGIN_VERSION	1
+#define	D2P_PLUGIN_SYMBOL	"d2p_plugin"
+
+typedef struct d2p_plugin {
+	int		version;	/* D2P_PLUGIN_VERSION */
+	const char	*name;
+	int		chrs;		/* input bytes per pixel */
+	d2p_kernel_f	kernel;
+	void		*arg;
+} d2p_plugin_t;
+
+/* geometry */
+size_t d2p_row_bytes(const d2p_t *d);	/* bytes rendered per row */
+size_t d2p_row_stride(const d2p_t *d);	/* bytes consumed per row */
+int d2p_height_for(const d2p_t *d, off_t size);
+
+/*
+ * Coordinate map: with an origin set, pngs carry a private D2P_MAP_CHUNK
+ * chunk mapping pixels back to their source offsets.  d2p_map_chunk()
+ * encodes it into buf for writers of their own pngs, returning the length
+ * (nothing is written if size is too small); d2p_locate() decodes one, and
+ * gives the offset and length of input behind pixel x, y.  Rows follow on
+ * from the origin at the row stride; d2p_add_map_run() starts a new run at
+ * row (in increasing order), for renders that don't show every input row.
+ */
+#define	D2P_MAP_CHUNK	"dmAP"
+
+int d2p_set_origin(d2p_t *d, const char *source, off_t offset);
+int d2p_add_map_run(d2p_t *d, int row, off_t offset);
+size_t d2p_map_chunk(const d2p_t *d, unsigned char *buf, size_t size);
+int d2p_locate(const void *map, size_t maplen, int x, int y, off_t *offp,
+    size_t *lenp, char *source, size_t srcsize);
+
+/* outputs */
+int d2p_set_row_callback(d2p_t *d, d2p_row_f func, void *arg);
+int d2p_set_png_buffer(d2p_t *d, void *buf, size_t size);
+int d2p_set_png_file(d2p_t *d, FILE *fp);
+size_t d2p_png_length(const d2p_t *d);
+
+/* input */
+int d2p_feed(d2p_t *d, const void *buf, size_t len);
+int d2p_feed_iov(d2p_t *d, const struct iovec *iov, int iovcnt);
+int d2p_feed_fd(d2p_t *d, int fd, off_t len);	/* len < 0: to EOF */
+int d2p_done(const d2p_t *d);		/* all height rows emitted */
+int d2p_finish(d2p_t *d);
+int d2p_rows(const d2p_t *d);		/* rows emitted so far */
+
+/*
+ * Statistics: per stage wall time in nanoseconds, and counters.  Encode is
+ * libpng filtering and deflate, less the time spent writing its output.
+ * Enable before the first feed; they cost a clock read per row and I/O.
+ */
+typedef struct d2p_stats {
+	uint64_t	read_ns;	/* d2p_feed_fd() reads */
+	uint64_t	colorize_ns;
+	uint64_t	encode_ns;
+	uint64_t	write_ns;	/* png output */
+	uint64_t	reads;		/* read(2) calls */
+	uint64_t	writes;		/* png output writes */
+	uint64_t	bytes_in;
+	uint64_t	bytes_out;
+	uint64_t	rows;		/* rows emitted */
+	uint64_t	zero_rows;	/* of those, all zero input */
+} d2p_stats_t;
+
+int d2p_set_stats(d2p_t *d, int enable);
+void d2p_get_stats(const d2p_t *d, d2p_stats_t *st);
+
+/*
+ * Trace callback: called on the rendering thread as each stage ("read",
+ * "colorize", "encode", "write") of a row or I/O finishes, with its
+ * CLOCK_MONOTONIC begin and end in nanoseconds.  Writes nest within
+ * encodes.
+ */
+typedef void (*d2p_trace_f)(void *arg, const char *stage, uint64_t begin,
+    uint64_t end);
+
+int d2p_set_trace(d2p_t *d, d2p_trace_f func, void *arg);
+
+/*
+ * Hardware counters per stage, from perf_event_open(2): user level counts
+ * for the thread that enables them, read at the same points as the stage
+ * times (a read(2) each, so they slow the render).  Counters the system
+ * won't give (eg, in a container or VM) are left out of avail and read 0;
+ * if none can be opened, d2p_set_perf() returns D2P_ENOTSUP.
+ */
+#define	D2P_STAGE_READ		0
+#define	D2P_STAGE_COLORIZE	1
+#define	D2P_STAGE_ENCODE	2
+#define	D2P_STAGE_WRITE		3
+#define	D2P_NSTAGES		4
+
+#define	D2P_PERF_CYCLES		0
+#define	D2P_PERF_INSTRUCTIONS	1
+#define	D2P_PERF_CACHE_MISSES	2
+#define	D2P_PERF_BRANCH_MISSES	3
+#define	D2P_NCOUNTERS		4
+
+typedef struct d2p_perf {
+	int		avail;		/* bit per counter opened */
+	uint64_t	count[D2P_NSTAGES][D2P_NCOUNTERS];
+} d2p_perf_t;
+
+int d2p_set_perf(d2p_t *d, int enable);
+void d2p_get_perf(const d2p_t *d, d2p_perf_t *perf);
+
+/*
+ * Render one row of input directly, without the context's outputs: in
+ * holds inlen valid bytes (up to d2p_row_bytes()), and rgb receives width
+ * pixels.  Bytes past inlen are drawn black.
+ */
+int d2p_render_row(d2p_t *d, const unsigned char *in, size_t inlen,
+    unsigned char *rgb);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _LIBDUMP2PNG_H */
@@ -0,0 +1,82 @@
+/*
+ * ptrs		Palette plugin: classify 64-bit words as pointers or data.
+ *
+ * An example of the palette plugin interface (see libdump2png.h).  Each
+ * pixel is one little-endian 64-bit word: zero is black, canonical user
+ * space pointers are red and kernel pointers blue (brighter for higher
+ * addresses, so heap, mmap and stack regions differ), small integers are
+ * green by magnitude, and anything else is gray by its byte sum.  Pointer
+ * arrays, allocator headers and free lists stand out from the data around
+ * them.
+ *
+ * USAGE: DUMP2PNG_PLUGINS=plugins dump2png -p ptrs core
+ *
+ * Copyright 2012 Joyent, Inc.  All rights reserved.
+ * Copyright 2012 Brendan Gregg.  All rights reserved.
+ *
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "../libdump2png.h"
+
+#define	USER_MIN	0x100000000ULL		/* below is likely an int */
+#define	SMALL_MAX	0x10000ULL
+
+/*
+ * The whole span in one loop, without calls, so the compiler can unroll
+ * and vectorize it.
+ */
+static void
+ptrs(void *arg, const unsigned char *in, unsigned char *rgb, size_t n)
+{
+	uint64_t v;
+	size_t i;
+	int bits;
+
+	for (i = 0; i < n; i++, in += 8, rgb += 3) {
+		v = (uint64_t)in[0] | (uint64_t)in[1] << 8 |
+		    (uint64_t)in[2] << 16 | (uint64_t)in[3] << 24 |
+		    (uint64_t)in[4] << 32 | (uint64_t)in[5] << 40 |
+		    (uint64_t)in[6] << 48 | (uint64_t)in[7] << 56;
+		if (v == 0) {
+			rgb[0] = rgb[1] = rgb[2] = 0;
+		} else if (v >> 47 == 0 && v >= USER_MIN) {
+			rgb[0] = 0x80 + (v >> 40 & 0x7f);
+			rgb[1] = rgb[2] = 0x20;
+		} else if (v >> 47 == 0x1ffff) {
+			rgb[2] = 0x80 + (v >> 40 & 0x7f);
+			rgb[0] = rgb[1] = 0x20;
+		} else if (v < SMALL_MAX) {
+			bits = 64 - __builtin_clzll(v);
+			rgb[1] = 0x40 + bits * 0x0b;
+			rgb[0] = rgb[2] = 0;
+		} else {
+			rgb[0] = rgb[1] = rgb[2] = (in[0] + in[1] + in[2] +
+			    in[3] + in[4] + in[5] + in[6] + in[7]) / 8;
+		}
+	}
+}
+
+const d2p_plugin_t d2p_plugin[] = {
+	{ D2P_PLUGIN_VERSION, "ptrs", 8, ptrs, NULL },
+	{ 0 }
+};
@@ -0,0 +1,164 @@
+/*
+ * deadline	Check that dump2png --deadline writes a valid png on time.
+ *
+ * Writes a 64 Mbyte input of random bytes, then runs ./dump2png with
+ * --deadline at a tall height (-h 100000, so a full encode would take
+ * seconds) for several budgets, and checks that each run exits zero within
+ * its deadline plus SLACK, and leaves a png (by its signature).
+ *
+ * USAGE: deadline		(exits non-zero on any failure)
+ *
+ * Copyright 2012 Joyent, Inc.  All rights reserved.
+ * Copyright 2012 Brendan Gregg.  All rights reserved.
+ *
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define	INSIZE		(64 * 1024 * 1024)	/* input bytes */
+#define	SLACK		0.25			/* seconds over allowed */
+
+static const struct {
+	const char	*arg;
+	double		secs;
+} deadlines[] = {
+	{ "500ms", 0.5 },
+	{ "1s", 1.0 },
+	{ "2s", 2.0 },
+	{ NULL }
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/*
+ * Run dump2png with a deadline, output discarded.  Returns the exit status,
+ * and the wall time in *secs.
+ */
+static int
+run(const char *deadline, const char *infile, const char *outfile,
+    double *secs)
+{
+	double start = now();
+	pid_t pid;
+	int status, fd;
+
+	if ((pid = fork()) < 0) {
+		perror("fork");
+		return (-1);
+	}
+	if (pid == 0) {
+		if ((fd = open("/dev/null", O_WRONLY)) >= 0) {
+			dup2(fd, 1);
+			dup2(fd, 2);
+		}
+		execl("./dump2png", "./dump2png", "--deadline", deadline,
+		    "-h", "100000", "-o", outfile, infile, (char *)NULL);
+		_exit(127);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		perror("waitpid");
+		return (-1);
+	}
+	*secs = now() - start;
+	return (WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+}
+
+static int
+ispng(const char *path)
+{
+	static const unsigned char sig[8] =
+	    { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	unsigned char buf[8];
+	FILE *fp;
+	int ok;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		return (0);
+	ok = fread(buf, 1, 8, fp) == 8 && memcmp(buf, sig, 8) == 0;
+	fclose(fp);
+	return (ok);
+}
+
+int
+main(void)
+{
+	char dir[] = "/tmp/d2pdeadline.XXXXXX";
+	char infile[PATH_MAX], outfile[PATH_MAX];
+	unsigned char *buf;
+	double secs = 0;
+	FILE *fp;
+	int i, status, failures = 0;
+
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		return (2);
+	}
+	snprintf(infile, sizeof (infile), "%s/in.bin", dir);
+	snprintf(outfile, sizeof (outfile), "%s/out.png", dir);
+
+	if ((buf = malloc(INSIZE)) == NULL) {
+		perror("Out of memory");
+		return (2);
+	}
+	srand(1);
+	for (i = 0; i < INSIZE; i++)
+		buf[i] = rand();
+	if ((fp = fopen(infile, "w")) == NULL ||
+	    fwrite(buf, 1, INSIZE, fp) != INSIZE || fclose(fp) != 0) {
+		perror("Can't write input");
+		return (2);
+	}
+	free(buf);
+
+	for (i = 0; deadlines[i].arg != NULL; i++) {
+		(void) unlink(outfile);
+		status = run(deadlines[i].arg, infile, outfile, &secs);
+		if (status != 0 || secs > deadlines[i].secs + SLACK ||
+		    !ispng(outfile)) {
+			printf("FAIL --deadline %s: exit %d, %.2fs%s\n",
+			    deadlines[i].arg, status, secs,
+			    ispng(outfile) ? "" : ", no png");
+			failures++;
+			continue;
+		}
+		printf("ok   --deadline %s: %.2fs\n", deadlines[i].arg, secs);
+	}
+
+	(void) unlink(outfile);
+	(void) unlink(infile);
+	(void) rmdir(dir);
+	return (failures != 0);
+}
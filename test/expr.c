@@ -0,0 +1,193 @@
+/*
+ * expr		Check -P expression palettes against the same expressions in C.
+ *
+ * Each expression is compiled with d2p_set_palette_expr() and rendered for
+ * a row of every byte value (or a spread of 16-bit words, which take the
+ * bytecode path rather than the table), and its red channel compared with
+ * the C version, clamped to 0..255.  The cases chain and mix operators
+ * that share leading characters (&& and &, || and |, <, << and <=), and
+ * check precedence and associativity against C's.
+ *
+ * USAGE: expr		(exits non-zero on any mismatch)
+ *
+ * Copyright 2012 Joyent, Inc.  All rights reserved.
+ * Copyright 2012 Brendan Gregg.  All rights reserved.
+ *
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "../libdump2png.h"
+
+#define	N	256		/* pixels (values) per case */
+
+/* the C versions, of v as b or w, parenthesized as C parses them */
+static long
+f_land(long v)
+{
+	return (v > 1 && v < 5 && v != 3);
+}
+
+static long
+f_lor(long v)
+{
+	return ((v == 1 || v == 2 || v == 3) * 255);
+}
+
+static long
+f_mix(long v)
+{
+	return (((v & 0x0f) && (v | 1)) || v < 2);
+}
+
+static long
+f_bits(long v)
+{
+	return (((v & 3) | (v & 0x30)) ^ (v >> 2));
+}
+
+static long
+f_shift(long v)
+{
+	return ((v < 128 && (v << 1) <= 200) || v >= 250);
+}
+
+static long
+f_lt(long v)
+{
+	return (((v << 1) < v + 100) * 99 + (v <= 7));
+}
+
+static long
+f_cond(long v)
+{
+	return (v <= 3 ? 200 : (v & 1) ? 100 : 0);
+}
+
+static long
+f_not(long v)
+{
+	return (!v || (v && v - 1 && v - 2));
+}
+
+static long
+f_arith(long v)
+{
+	return (v % 7 * 30 + (v < 0x10) - 3);
+}
+
+static long
+f_wland(long v)
+{
+	return ((v > 0x100 && v < 0x8000) * 255);
+}
+
+static long
+f_wlor(long v)
+{
+	return (((v >> 8) == 0x12 || (v & 1)) * 200);
+}
+
+static long
+f_wmix(long v)
+{
+	return (((v >> 8) & 0x7f) || (v < 0x10 && (v | 2)));
+}
+
+static long
+f_wshift(long v)
+{
+	return (((v >> 8) << 1) <= (v >> 7));
+}
+
+static const struct {
+	const char	*expr;
+	long		(*func)(long v);
+	int		wide;		/* v is w */
+} cases[] = {
+	{ "b > 1 && b < 5 && b != 3", f_land, 0 },
+	{ "(b == 1 || b == 2 || b == 3) * 255", f_lor, 0 },
+	{ "b & 0x0f && b | 1 || b < 2", f_mix, 0 },
+	{ "(b & 3 | b & 0x30) ^ b >> 2", f_bits, 0 },
+	{ "b < 128 && b << 1 <= 200 || b >= 250", f_shift, 0 },
+	{ "(b<<1<b+100)*99+(b<=7)", f_lt, 0 },
+	{ "b <= 3 ? 200 : b & 1 ? 100 : 0", f_cond, 0 },
+	{ "!b || b && b - 1 && b - 2", f_not, 0 },
+	{ "b % 7 * 30 + (b < 0x10) - 3", f_arith, 0 },
+	{ "(w > 0x100 && w < 0x8000) * 255", f_wland, 1 },
+	{ "(w >> 8 == 0x12 || w & 1) * 200", f_wlor, 1 },
+	{ "w >> 8 & 0x7f || w < 0x10 && w | 2", f_wmix, 1 },
+	{ "w >> 8 << 1 <= w >> 7", f_wshift, 1 },
+	{ NULL }
+};
+
+int
+main(void)
+{
+	unsigned char in[N * 2], rgb[N * 3];
+	char expr[256];
+	long want;
+	int c, i, v, pos = -1, err = D2P_OK, failures = 0;
+	d2p_t *d;
+
+	for (c = 0; cases[c].expr != NULL; c++) {
+		snprintf(expr, sizeof (expr), "r = %s", cases[c].expr);
+		for (i = 0; i < N; i++) {
+			if (!cases[c].wide) {
+				in[i] = i;
+				continue;
+			}
+			/* both bytes varied, and a run of 0x12xx */
+			v = i < 16 ? 0x1200 + i : i * 251;
+			in[i * 2] = v & 0xff;
+			in[i * 2 + 1] = v >> 8;
+		}
+		if ((d = d2p_create()) == NULL ||
+		    (err = d2p_set_palette_expr(d, expr, &pos)) != D2P_OK ||
+		    (err = d2p_set_mask(d, 0)) != D2P_OK ||
+		    (err = d2p_set_width(d, N)) != D2P_OK ||
+		    (err = d2p_render_row(d, in, N * d2p_get_chrs(d),
+		    rgb)) != D2P_OK) {
+			printf("FAIL %s: %s (at %d)\n", expr, d == NULL ?
+			    "no context" : d2p_strerror(err), pos);
+			failures++;
+			d2p_destroy(d);
+			continue;
+		}
+		for (i = 0; i < N; i++) {
+			v = cases[c].wide ? in[i * 2] | in[i * 2 + 1] << 8 :
+			    in[i];
+			want = cases[c].func(v);
+			want = want < 0 ? 0 : want > 255 ? 255 : want;
+			if (rgb[i * 3] != want) {
+				printf("FAIL %s: v=%d gave %d, want %ld\n",
+				    expr, v, rgb[i * 3], want);
+				failures++;
+				break;
+			}
+		}
+		if (i == N)
+			printf("ok   %s\n", expr);
+		d2p_destroy(d);
+	}
+	return (failures != 0);
+}